@@ -16,22 +16,36 @@
  *	strchr(), strrchr(), strspn(), strcspn()
  *
  * File I/O routines:
- *	open(), close(), dup(), fopen(), fclose(),
- *	read(), fread(), fgets()
+ *	open(), close(), dup(), dup2(), fopen(), fclose(),
+ *	fdopen(), freopen(), tmpfile(),
+ *	read(), fread(), fgets(), write(), fwrite(), fputs()
+ *
+ * Descriptor routines (UNIX only):
+ *	socket(), accept(), pipe(), popen(), pclose(), open_memstream(),
+ *	accept4(), pipe2(), epoll_create1(), eventfd() (Linux)
+ *
+ * Mapped memory routines (UNIX only):
+ *	mmap(), munmap(), mremap() (Linux)
  * 
  * The library catches:
  *
  * - failed mallocs/callocs/reallocs and bad frees
  * - under DOS, allocation from the near heap and returning
  *	to the far heap, or vice-versa
- * - memory and file leaks
+ * - memory, mapping and file leaks, with leaked descriptors
+ *	counted by kind (file, socket, pipe...) and where opened,
+ *	and leaked streams with the bytes they had not yet written
+ * - close() of a stream's descriptor, streams closed twice, and
+ *	fclose() of a popen() stream or pclose() of any other
+ * - munmaps of part of a mapping, of memory already unmapped, or
+ *	of memory that was never mapped
  * - some bad parameters passed to these routines
  *
  * In addition:
  *
  * - some overruns of dynamic, global and auto buffers are caught,
  *	reported and recovered from (memcpy, memset,
- *	strcpy, strncpy, stpcpy, read, fread, fgets)
+ *	strcpy, strncpy, stpcpy, read, fread, fgets, write, fwrite)
  * - some potential overruns are warned about
  * - attempts to memcpy/strcpy/etc uninitialised memory is reported
  * - all overruns of dynamic buffers are reported when the memory
@@ -46,17 +60,171 @@
  * You can define DEBUG_LOG to be a log file name; else
  * standard error is used.
  *
+ * If your application is multithreaded (UNIX only), also define
+ * GW_THREADS and link with the pthreads library. The library then
+ * spreads its block registry over GW_SHARDS separately locked shards
+ * and keeps its counters per thread.
+ *
+ * Define GW_SAMPLE to a number of bytes to track only a sample of
+ * allocations, about one per GW_SAMPLE bytes allocated, chosen at
+ * random so that every byte is equally likely to be picked. Other
+ * blocks come straight from malloc with no header and are not
+ * checked. Counters and reports are then estimates, each tracked
+ * block standing for the blocks it was picked from. This is cheap
+ * enough to leave on in production builds; overruns and bad frees
+ * are only caught for the tracked blocks.
+ *
+ * Define GW_GUARD to a number of bytes (UNIX only) to give every
+ * block at least that big pages of its own, ending flush against an
+ * inaccessible page, so that running off the end faults on the spot
+ * instead of being noticed when the block is freed. GW_GUARD_BUDGET
+ * caps the address space this may use; past it, blocks are
+ * allocated as usual.
+ *
+ * Define GW_QUARANTINE to a number of bytes to hold on to freed
+ * blocks, up to that many bytes' worth, oldest first out. Held
+ * blocks are filled with a poison byte and checked when they are
+ * finally released, so writes through stale pointers are reported
+ * along with where the block was allocated and freed.
+ *
+ * Define GW_SHADOW to keep, for each block from malloc(), a bitmap
+ * of which of its bytes have been written through the wrappers, so
+ * that reading any byte that hasn't (by strlen, memcpy and the rest)
+ * is reported, not just a block whose first word is untouched.
+ * Stores the program makes itself can't be seen; the block is filled
+ * with a marker byte to begin with, and a byte that no longer holds
+ * it is taken to have been stored to.
+ *
+ * Call gw_sweep() now and then to check live blocks for overruns
+ * a few at a time, without waiting for them to be freed. With
+ * GW_THREADS, define GW_SWEEP to a number of milliseconds to have a
+ * thread do it that often, spending up to GW_SWEEP_BUDGET
+ * microseconds each time; a full sweep is also made at the end.
+ *
+ * Call gw_live_report() to have the state of the heap and files
+ * written out while the program runs. Define GW_REPORT_SIGNAL to a
+ * signal (UNIX only; SIGUSR1, say) to have one appended to the log
+ * name with `.live' on the end each time the process gets it; a
+ * thread of its own does the writing.
+ *
+ * Define GW_HISTOGRAMS (UNIX only) to count the sizes asked of
+ * malloc(), calloc() and realloc() and the time spent in each
+ * wrapper, in powers of two; my_report prints them, and
+ * gw_get_histograms() returns them.
+ *
+ * Define GW_STACKS to a number of frames (UNIX, with gcc and glibc)
+ * to have each block also remember that many return addresses
+ * from the stack it was allocated on, and the leaks listed by stack
+ * as well as by block. Build the program with -fno-omit-frame-pointer
+ * to see more than the one frame that called the library.
+ *
+ * Define GW_IO_STATS to count the reads and writes made through the
+ * wrappers, with the bytes moved and the sizes asked for, by call
+ * site and by file; my_report lists the busiest of each, and the
+ * sites making many read() or write() calls of fewer than GW_TINY_IO
+ * bytes, which spend their time in the system rather than in a
+ * buffer.
+ *
+ * Define GW_PRELOAD (UNIX only) to build this file as a shared
+ * library that replaces malloc(), calloc(), realloc(), free(),
+ * open(), close(), fopen() and fclose() in a program that was built
+ * without it:
+ *
+ *	LD_PRELOAD=./libgwdebug.so program
+ *
+ * Call sites are then return addresses, shown as module+offset for
+ * addr2line, and the log goes to $GWDEBUG_LOG if that is set. Only
+ * blocks and files that came through these calls are checked;
+ * anything else passed to free() or close() is passed straight on.
+ *
+ * Define GW_ASYNC_LOG to have diagnostics queued in memory and
+ * written out in batches (by a background thread under GW_THREADS)
+ * instead of being printed on the spot; see gw_log_policy() for
+ * what happens if they arrive faster than they can be written.
+ *
  * TODO:
  * Test all functions not yet done in mytest.c.
  */
 
 #ifdef GW_DEBUG
 
+#ifdef GW_PRELOAD
+#define _GNU_SOURCE	/* for RTLD_NEXT and dladdr */
+#ifndef GW_THREADS
+#define GW_THREADS	/* we can't know the program doesn't use them */
+#endif
+#endif
+#if defined(GW_STACKS) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* for pthread_getattr_np */
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* for mremap */
+#endif
+#if defined(GW_REPORT_SIGNAL) && !defined(GW_THREADS)
+#define GW_THREADS	/* the reports are written by a thread */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #ifdef __MSDOS__
 #include <io.h>
 #include <alloc.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(GW_GUARD) && __MSDOS__
+#undef GW_GUARD
+#endif
+#if defined(GW_HISTOGRAMS) && __MSDOS__
+#undef GW_HISTOGRAMS
+#endif
+#if defined(GW_STACKS) && (__MSDOS__ || !defined(__GNUC__))
+#undef GW_STACKS
+#endif
+#if !__MSDOS__
+#include <sys/mman.h>
+#endif
+#ifdef GW_PRELOAD
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
+#endif
+#ifdef GW_REPORT_SIGNAL
+#include <signal.h>
+#include <fcntl.h>
+#endif
+#if !__MSDOS__
+#include <sys/socket.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#if defined(__GLIBC__) || defined(__sun)
+#include <stdio_ext.h>
+#define GW_FPENDING
+#endif
+#ifdef GW_STACKS
+#include <stddef.h>
+#include <link.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* The string scans use SSE2, or AVX2 where the processor has it,
+   unless GW_NO_SIMD is defined */
+
+#if !defined(GW_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define GW_SIMD
+#include <immintrin.h>
+#endif
+
+/* Can we be handed pointers and files we didn't allocate or open? */
+
+#if defined(GW_SAMPLE) || defined(GW_PRELOAD)
+#define GW_UNTRACKED
 #endif
 #include <string.h>
 #include <time.h>
@@ -67,788 +235,6804 @@
 #include "heap.h" /* definitions for replacement heap for embedded code */
 #endif
 
+#define GW_LIBRARY
+#include "gwdebug.h"
+
+/* With GW_HISTOGRAMS the wrappers are compiled under other names,
+   and the names they had are given to versions that time them (see
+   "Wrapper timing" below) */
+
+#ifdef GW_HISTOGRAMS
+#define my_malloc	body_malloc
+static void *body_malloc(unsigned n, char *f, int l);
+#define my_calloc	body_calloc
+static void *body_calloc(unsigned n, char *f, int l);
+#define my_realloc	body_realloc
+static void *body_realloc(void *p, unsigned n, char *f, int l);
+#define my_free		body_free
+static void body_free(void *p, char *f, int l);
+#define my_memcpy	body_memcpy
+static char *body_memcpy(char *d, int space_avail, int limit, char *s,
+		int sspace, int flag, char *f, int l);
+#define my_strcpy	body_strcpy
+static char *body_strcpy(char *d, int space_avail, int limit, char *s,
+		int sspace, int flag, char *f, int l);
+#define my_memset	body_memset
+static char *body_memset(char *d, int space_avail, int limit, char c, char *f, int l);
+#define my_memcmp	body_memcmp
+static int body_memcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag,
+		char *f, int l);
+#define my_strcmp	body_strcmp
+static int body_strcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag,
+		char *f, int l);
+#define my_strlen	body_strlen
+static int body_strlen(char *s, int siz, char *f, int l);
+#define my_strdup	body_strdup
+static char *body_strdup(char *s, int siz, char *f, int l);
+#define my_strstr	body_strstr
+static char *body_strstr(char *s1, int siz1, char *s2, int siz2, char *f, int l);
+#define my_strpbrk	body_strpbrk
+static char *body_strpbrk(char *s1, int siz1, char *s2, int siz2, char *f, int l);
+#define my_strchr	body_strchr
+static char *body_strchr(char *s, int siz, int c, char *f, int l);
+#define my_strrchr	body_strrchr
+static char *body_strrchr(char *s, int siz, int c, char *f, int l);
+#define my_strspn	body_strspn
+static int body_strspn(char *s1, int siz1, char *s2, int siz2, char *f, int l);
+#define my_strcspn	body_strcspn
+static int body_strcspn(char *s1, int siz1, char *s2, int siz2, char *f, int l);
+#define my_fopen	body_fopen
+static FILE *body_fopen(char *n, char *m, char *f, int l);
+#define my_fclose	body_fclose
+static int body_fclose(FILE *fp, char *f, int l);
+#define my_fdopen	body_fdopen
+static FILE *body_fdopen(int h, char *m, char *f, int l);
+#define my_freopen	body_freopen
+static FILE *body_freopen(char *n, char *m, FILE *fp, char *f, int l);
+#define my_tmpfile	body_tmpfile
+static FILE *body_tmpfile(char *f, int l);
+#define my_open		body_open
+static int body_open(char *n, int m, int a, char *f, int l);
+#define my_close	body_close
+static int body_close(int h, char *f, int l);
+#define my_dup		body_dup
+static int body_dup(int h, char *f, int l);
+#define my_dup2		body_dup2
+static int body_dup2(int h, int h2, char *f, int l);
+#define my_socket	body_socket
+static int body_socket(int domain, int type, int protocol, char *f, int l);
+#define my_accept	body_accept
+static int body_accept(int h, void *a, socklen_t *n, char *f, int l);
+#define my_pipe		body_pipe
+static int body_pipe(int *fds, char *f, int l);
+#define my_popen	body_popen
+static FILE *body_popen(char *c, char *m, char *f, int l);
+#define my_pclose	body_pclose
+static int body_pclose(FILE *fp, char *f, int l);
+#define my_open_memstream body_open_memstream
+static FILE *body_open_memstream(char **p, size_t *n, char *f, int l);
+#ifdef __linux__
+#define my_accept4	body_accept4
+static int body_accept4(int h, void *a, socklen_t *n, int flags, char *f, int l);
+#define my_pipe2	body_pipe2
+static int body_pipe2(int *fds, int flags, char *f, int l);
+#define my_epoll_create1 body_epoll_create1
+static int body_epoll_create1(int flags, char *f, int l);
+#define my_eventfd	body_eventfd
+static int body_eventfd(unsigned n, int flags, char *f, int l);
+#endif
+#define my_read		body_read
+static int body_read(int h, void *buf, unsigned len, int space_avail,
+		char *f, int l);
+#define my_fread	body_fread
+static size_t body_fread(void *buf, size_t size, size_t n, FILE *fp,
+		int space_avail, char *f, int l);
+#define my_fgets	body_fgets
+static char *body_fgets(void *buf, int n, FILE *fp, int space_avail, char *f, int l);
+#define my_write	body_write
+static int body_write(int h, const void *buf, unsigned len, int space_avail,
+		char *f, int l);
+#define my_fwrite	body_fwrite
+static size_t body_fwrite(const void *buf, size_t size, size_t n, FILE *fp,
+		int space_avail, char *f, int l);
+#define my_fputs	body_fputs
+static int body_fputs(const char *s, int siz, FILE *fp, char *f, int l);
+#define my_mmap		body_mmap
+static void *body_mmap(void *a, size_t n, int prot, int flags, int fd, off_t off,
+		char *f, int l);
+#define my_munmap	body_munmap
+static int body_munmap(void *a, size_t n, char *f, int l);
+#ifdef __linux__
+#define my_mremap	body_mremap
+static void *body_mremap(void *a, size_t n, size_t m, int flags, void *na,
+		char *f, int l);
+#endif
+static void my_hist_report(FILE *fp);
+#endif
+
 static FILE *logfile = NULL;
+
+/* Call sites (file and line) are interned and referred to by id;
+   site 0 is `unknown' */
+
+#if __MSDOS__
+typedef unsigned long site_id;
+#else
+typedef unsigned int site_id;
+#endif
+
+typedef gw_site_stats site_info;	/* a site and its totals */
+
 static char *store_name(char *name);
+static site_id store_site(char *file, int line);
+static site_info *site_of(site_id id);
+static void count_site_alloc(site_info *sp, unsigned long count,
+		unsigned long bytes);
+static void count_site_free(site_info *sp, unsigned long count,
+		unsigned long bytes);
+static void my_site_report(FILE *fp);
+
+#define SITE_FILE(id)	(site_of(id)->file)
+#define SITE_LINE(id)	(site_of(id)->line)
+
 static void my_initialise(void);
 static void my_report(void);
+static char *stream_how(int how);
 
-/*******************************/
-/* Memory allocation debugging */
-/*******************************/
+/******************/
+/* Thread support */
+/******************/
 
-#define MAGIC			(0x24681357L)
+/* With GW_THREADS defined the library may be called from several
+   threads at once. The name store and file table have a lock each;
+   the block registry is sharded (see below). Without GW_THREADS the
+   locks vanish.
+*/
 
-#define ISFAR	1
+#ifdef GW_THREADS
+#include <pthread.h>
+#define GW_LOCK(m)	pthread_mutex_lock(&(m))
+#define GW_UNLOCK(m)	pthread_mutex_unlock(&(m))
+#define GW_ATOMIC_INC(v) __sync_add_and_fetch(&(v), 1)
+#define GW_ATOMIC_ADD(v,n) __sync_add_and_fetch(&(v), (n))
+#define GW_ATOMIC_SUB(v,n) __sync_sub_and_fetch(&(v), (n))
+#define LOAD_ACQ(v)	__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE_REL(v,x)	__atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#ifndef GW_SHARDS
+#define GW_SHARDS	16	/* must be a power of two */
+#endif
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef GW_QUARANTINE
+static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef GW_STACKS
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define GW_LOCK(m)
+#define GW_UNLOCK(m)
+#define GW_ATOMIC_INC(v) (++(v))
+#define GW_ATOMIC_ADD(v,n) ((v) += (n))
+#define GW_ATOMIC_SUB(v,n) ((v) -= (n))
+#define LOAD_ACQ(v)	(v)
+#define STORE_REL(v,x)	((v) = (x))
+#undef GW_SHARDS
+#define GW_SHARDS	1
+#endif
 
-/* Freeing a blk_info header will usually result in the memory
-   manager using the first few bytes to store the block on the
-   free list. The fields at the start of blk_info have been
-   chosen to be the ones we don't mind being clobbered.
-*/
+/* Under GW_PRELOAD our own use of malloc, stdio and so on comes back
+   through the replacements; while a thread is inside the library
+   they go straight to the C library instead. */
 
-typedef struct
-{
-    long	magic;
-    short	flags;	/* only used for far allocs at the moment */
-    void far   *next;
-    long	nbytes;
-    char       *file;
-    short	line;
-} blk_info;
+#ifdef GW_THREADS
+#define GW_TLS	__thread __attribute__((tls_model("initial-exec")))
+#else
+#define GW_TLS
+#endif
 
-#define GET_BLKP(p, o)		(( (blk_info huge *)(p) ) + (o))
-#define GET_BLK(p)		(blk_info far *)GET_BLKP(p, -1)
-#define GET_DATA(p)		((void far *)GET_BLKP(p, 1))
-#define BUMPSIZE(n)		((n)+sizeof(blk_info) + sizeof(long))
-/*#define GET_BLK(p)		(blk_info far *)(((char far *)p)-sizeof(blk_info))*/
-#define SET_ENDMAGIC(p,n)	*(long far *)( ((char huge *)p)+n ) = MAGIC
-#define TST_ENDMAGIC(p,n)	(*(long far *)( ((char huge *)p)+n ) == MAGIC)
+#ifdef GW_PRELOAD
+static GW_TLS int in_gw;
+#define GW_ENTER	(in_gw++)
+#define GW_LEAVE	(in_gw--)
+#else
+#define GW_ENTER
+#define GW_LEAVE
+#endif
 
-void my_free(void *p, char *f, int l);
+/* Our own headers go back to the C library directly: the replacements
+   would look each one up in the registry first, and a caller holding
+   that shard's lock would wait on itself. */
 
-#if __MSDOS__
-void my_ffree(void far *p, char *f, int l);
+#ifdef GW_PRELOAD
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+#define SYS_REALLOC(p,n)	real_realloc(p,n)
+#define SYS_FREE(p)	real_free(p)
+#else
+#define SYS_REALLOC(p,n)	realloc(p,n)
+#define SYS_FREE(p)	free(p)
 #endif
 
-static void far *heap_list_head = NULL;
+/*****************/
+/* Event logging */
+/*****************/
 
-void my_memory_report(int is_last)
+/* Every diagnostic is an event: a fixed-size record naming what
+   happened, where, and a few numbers. Normally each event is
+   written out as soon as it happens. If GW_ASYNC_LOG is defined
+   the wrappers instead just drop the record into a ring buffer,
+   and the text is produced later in batches: by a background
+   writer thread under GW_THREADS (each thread then has a ring of
+   its own, which only it fills and only the writer empties, so no
+   locks are needed), or else when the ring fills up. my_report
+   flushes everything that is still queued.
+
+   When a ring is full the producer either empties the rings itself
+   (the default) or, if gw_log_policy(GW_LOG_DROP) has been called
+   or GW_LOG_POLICY is defined as GW_LOG_DROP, throws the event
+   away; the number dropped is reported at the end.
+
+   If GW_BINARY_LOG is defined the events are written to the log in
+   a compact binary form rather than as text, and gwdecode produces
+   the usual messages and end-of-program report from that. What is
+   still live is written out at each memory report and at the end,
+   along with the totals by site, which is all those reports need.
+   Define GW_BINARY_TRACE as well to have every allocation, free,
+   mapping, open and close recorded as it happens instead, so the
+   log shows what was live at any point, even if the program dies;
+   over a long run that is a great deal more to write.
+*/
+
+#if defined(GW_BINARY_TRACE) && !defined(GW_BINARY_LOG)
+#undef GW_BINARY_TRACE
+#endif
+
+/* Produce the text for an event. This is also used by gwdecode to
+   turn a binary log back into text. */
+
+void gw_render_event(FILE *fp, gw_event *e)
 {
-    void far *p;
-    /* walk dat list... */
-    p = heap_list_head;
-    if (p)
+    switch (e->type)
     {
-    	fprintf(logfile,is_last ? "MEMORY LEAKS:\n" : "Allocated Memory Blocks:\n");
-    	while (p)
-    	{
-    	    blk_info far *bp = GET_BLK(p);
-#if __MSDOS__
-    	    fprintf(logfile,"\t%s Size %8ld File %16s Line %d\n",
-    		    (bp->flags&ISFAR)?"(Far) ":"Near",
-		    bp->nbytes, bp->file, bp->line);
-#else
-    	    fprintf(logfile,"\tSize %8ld File %16s Line %d\n",
-    		    bp->nbytes, bp->file, bp->line);
-#endif
-	    p = bp->next;
-	}
+    case GW_E_OVERRUN_FREE:
+    	fprintf(fp,"Block of size %ld allocated at %s, line %d, freed at %s, line %d, has been overrun\n",
+    		e->a, e->file2, e->line2, e->file, e->line);
+    	break;
+    case GW_E_WRONG_FREE:
+    	fprintf(fp,"Wrong version of free called for this block!\n");
+    	break;
+    case GW_E_BAD_FREE:
+    	fprintf(fp,"Bad call to free from file %s, line %d\n", e->file, e->line);
+    	break;
+    case GW_E_FREED_BEFORE:
+    	fprintf(fp,"Possibly freed before at %s, line %d, size %ld\n",
+    		e->file2, e->line2, e->a);
+    	break;
+    case GW_E_NULL_ARG:
+    	fprintf(fp,"%s(NULL) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_UNINIT_ARG:
+    	fprintf(fp,"%s(uninitialised) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_NULL_NULL:
+    	fprintf(fp,"%s(NULL,NULL) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_NULL_1:
+    	fprintf(fp,"%s(NULL,...) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_NULL_2:
+    	fprintf(fp,"%s(...,NULL) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_INVALID_1:
+    	fprintf(fp,"%s(invalid,...) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_INVALID_2:
+    	fprintf(fp,"%s(...,invalid) at file %s, line %d\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_COPY_OVERRUN:
+    	fprintf(fp,"String/memory copy overrun at file %s, line %d - truncating\n\ttarget space %ld, source length %ld\n",
+    		e->file, e->line, e->a, e->b);
+    	break;
+    case GW_E_COPY_POTENTIAL:
+    	fprintf(fp,"Potential string/memory copy overrun at file %s, line %d\n\ttarget space %ld, source size %ld\n",
+    		e->file, e->line, e->a, e->b);
+    	break;
+    case GW_E_COPY_CLOBBER:
+    	fprintf(fp,"String/memory copy clobber in %s, line %d\n", e->file, e->line);
+    	break;
+    case GW_E_MEMSET_OVERRUN:
+    	fprintf(fp,"memset overrun at file %s, line %d - truncating\n\ttarget length %ld, source length %ld\n",
+    		e->file, e->line, e->a, e->b);
+    	break;
+    case GW_E_FOPEN_REOPEN:
+    	fprintf(fp,"%2ld (%s) fopened at %s, line %d was already opened at %s, line %d\n",
+    		e->a, e->name, e->file, e->line, e->file2, e->line2);
+    	break;
+    case GW_E_FOPEN_FAIL:
+    	fprintf(fp,"fopen of %s at %s, line %d failed!\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_FCLOSE_BAD:
+    	fprintf(fp,"Bad close(%ld) at %s, line %d; already closed at %s, line %d\n",
+    		e->a, e->file, e->line, e->file2, e->line2);
+    	break;
+    case GW_E_FCLOSE_TRACE:
+    	fprintf(fp,"File %2ld (%s) opened at %s, line %d fclosed at %s, line %d\n",
+    		e->a, e->name, e->file2, e->line2, e->file, e->line);
+    	break;
+    case GW_E_FCLOSE_NULL:
+    	fprintf(fp,"Illegal fclose(NULL) by %s line %d\n", e->file, e->line);
+    	break;
+    case GW_E_OPEN_REOPEN:
+    	fprintf(fp,"%2ld (%s) fopened at %s, line %d was already open at %s, line %d\n",
+    		e->a, e->name, e->file, e->line, e->file2, e->line2);
+    	break;
+    case GW_E_OPEN_TRACE:
+    	fprintf(fp,"File %2ld (%s) fopened at %s, line %d\n",
+    		e->a, e->name, e->file, e->line);
+    	break;
+    case GW_E_OPEN_FAIL:
+    	fprintf(fp,"open of %s at %s, line %d failed!\n\t(%s)\n",
+    		e->name, e->file, e->line, strerror((int)e->b));
+    	break;
+    case GW_E_CLOSE_BAD:
+    	fprintf(fp,"Bad close(%ld) by %s, line %d; already closed at %s, line %d\n",
+    		e->a, e->file, e->line, e->file2, e->line2);
+    	break;
+    case GW_E_CLOSE_TRACE:
+    	fprintf(fp,"File %2ld (%s) opened at %s, line %d, fclosed at %s, line %d\n",
+    		e->a, e->name, e->file2, e->line2, e->file, e->line);
+    	break;
+    case GW_E_CLOSE_ILLEGAL:
+    	fprintf(fp,"Illegal close(%ld) by %s line %d\n", e->a, e->file, e->line);
+    	break;
+    case GW_E_DUP_ILLEGAL:
+    	fprintf(fp,"Illegal dup(%ld) by %s line %d\n", e->a, e->file, e->line);
+    	break;
+    case GW_E_DUP_TRACE:
+    	fprintf(fp,"File %2ld (%s) opened at %s, line %d, dup'ed to %ld at %s, line %d\n",
+    		e->a, e->name, e->file2, e->line2, e->b, e->file, e->line);
+    	break;
+    case GW_E_DUP_FAIL:
+    	fprintf(fp,"dup(%ld) by %s line %d failed!\n\t(%s)\n",
+    		e->a, e->file, e->line, strerror((int)e->b));
+    	break;
+    case GW_E_READ_NULL:
+    	fprintf(fp,"%s with NULL buffer by %s line %d!\n", e->name, e->file, e->line);
+    	break;
+    case GW_E_READ_OVER:
+    	fprintf(fp,"%s with count (%ld)  > available space (%ld) by %s line %d!\n",
+    		e->name, e->a, e->b, e->file, e->line);
+    	break;
+    case GW_E_FREAD_ZERO:
+    	fprintf(fp,"fread with size zero at %s line %d!\n", e->file, e->line);
+    	break;
+    case GW_E_FREED_WRITE:
+    	fprintf(fp,"Block of size %ld allocated at %s, line %d, freed at %s, line %d, has been written to since (offset %ld)\n",
+    		e->a, e->file2, e->line2, e->file, e->line, e->b);
+    	break;
+    case GW_E_SWEEP_OVERRUN:
+    	fprintf(fp,"Block of size %ld allocated at %s, line %d, still in use, has been overrun\n",
+    		e->a, e->file2, e->line2);
+    	break;
+    case GW_E_SWEEP_HEADER:
+    	fprintf(fp,"Block at %#lx, still in use, has had its header overwritten\n",
+    		(unsigned long)e->a);
+    	break;
+    case GW_E_MMAP_FAIL:
+    	fprintf(fp,"%s of %ld bytes at %s, line %d failed!\n\t(%s)\n",
+    		e->name, e->a, e->file, e->line, strerror((int)e->b));
+    	break;
+    case GW_E_MUNMAP_PARTIAL:
+    	fprintf(fp,"munmap at %s, line %d unmaps %ld of the %ld bytes mapped at %s, line %d\n",
+    		e->file, e->line, e->b, e->a, e->file2, e->line2);
+    	break;
+    case GW_E_MUNMAP_TWICE:
+    	fprintf(fp,"Bad %s(%#lx, %ld) at %s, line %d; already unmapped at %s, line %d\n",
+    		e->name, (unsigned long)e->a, e->b, e->file, e->line,
+    		e->file2, e->line2);
+    	break;
+    case GW_E_MUNMAP_UNKNOWN:
+    	fprintf(fp,"Bad %s(%#lx, %ld) at %s, line %d; not mapped\n",
+    		e->name, (unsigned long)e->a, e->b, e->file, e->line);
+    	break;
+    case GW_E_STREAM_MISMATCH:
+    	fprintf(fp,"%s at %s, line %d of a stream opened by %s at %s, line %d\n",
+    		e->name, e->file, e->line, stream_how((int)e->a),
+    		e->file2, e->line2);
+    	break;
+    case GW_E_CLOSE_STREAM:
+    	fprintf(fp,"close(%ld) at %s, line %d under stream `%s' opened at %s, line %d\n",
+    		e->a, e->file, e->line, e->name, e->file2, e->line2);
+    	break;
+    default: /* the rest are only recorded in binary logs */
+    	break;
     }
 }
 
-static void log_alloc(void far *rtn, unsigned long n,
-	char *f, int l, unsigned flags)
+/* Microseconds from an arbitrary origin */
+
+#ifdef __MSDOS__
+#define gw_usec()	((unsigned long)clock() * (1000000L / CLK_TCK))
+#else
+static unsigned long gw_usec(void)
 {
-    char *savedname;
-    blk_info far *bp = (blk_info far *)rtn;
-    assert(rtn);
-    if (!logfile) my_initialise();
-    /* Get the pointer that is returned to the user */
-    rtn = GET_DATA(rtn);
-    /* Save the size information */
-    bp->nbytes = n;
-    /* Prepend to front of heap list */
-    bp->next = heap_list_head;
-    heap_list_head = rtn;
-    /* Save file name and line number, and put in bounding magic markers */
-    bp->file = store_name(f);
-    bp->line = l;
-    bp->magic = MAGIC;
-    bp->flags = flags;
-    SET_ENDMAGIC(rtn, n);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
 }
+#endif
 
-void *my_calloc(unsigned n, char *f, int l)
-{
-    /* Allocate the memory with space enough for our info */
-    void *rtn = calloc(BUMPSIZE(n), 1);
-    log_alloc((void far *)rtn, (unsigned long)n, f, l, 0);
-#if defined(__TINY__) || defined(__SMALL__) || defined(__MEDIUM__)
-    return ((char *)rtn)+sizeof(blk_info);
+/* Event times. Only the binary log records them. */
+
+#ifdef GW_BINARY_LOG
+#define log_clock()	gw_usec()
 #else
-    return GET_DATA(rtn);
+#define log_clock()	0
+#endif
+
+#ifdef GW_BINARY_LOG
+
+/* The binary log. After a header (the characters GWDB, a version
+   byte, the size of a long and the start time) each event is a type
+   byte followed by its fields as variable-length integers, seven
+   bits a byte with the top bit set on all but the last:
+
+	time since the previous event (us, signed)
+	name, file, file2 (ids of strings; 0 for none)
+	line, line2 (signed), ptr, a, b (signed)
+
+   Signed fields are zigzag encoded so small negative numbers stay
+   short. Strings are written only once: the first time one is used
+   it is defined by a GW_E_NAME record (type, id, length, bytes).
+   The writer is the only user of these tables, and is serialised
+   by log_lock.
+*/
+
+#if !defined(DEBUG_LOG)
+#error GW_BINARY_LOG needs DEBUG_LOG to name the log file
 #endif
+
+#define ZIGZAG(v)	(((unsigned long)(v) << 1) ^ ((v) < 0 ? ~0UL : 0UL))
+
+typedef struct
+{
+    char       *key;
+    unsigned long id;
+} name_entry;
+
+static name_entry *name_map = NULL;
+static unsigned long name_map_size = 0;
+static unsigned long next_name_id = 1;
+static unsigned long last_time = 0;
+
+static void put_varint(FILE *fp, unsigned long v)
+{
+    while (v >= 0x80)
+    {
+    	putc((int)(v & 0x7f) | 0x80, fp);
+    	v >>= 7;
+    }
+    putc((int)v, fp);
 }
 
-void *my_malloc(unsigned n, char *f, int l)
+static unsigned long name_hash(char *key)
 {
-    void *rtn = my_calloc(n,f,l);
-    if (n >= sizeof(long))
-        *((unsigned long *)rtn) = MAGIC; /* mark as unitialised */
-    return rtn;
+    unsigned long h = (unsigned long)(char huge *)key;
+    h = (h >> 3) * 2654435761UL;
+    return h ^ (h >> 15);
 }
 
-static int log_free(void huge *p, char *f, int l, int isfar)
+/* The id of a string, keyed by its address; the strings we log are
+   literals or come from store_name, so their addresses are stable */
+
+static unsigned long name_id(FILE *fp, char *key)
 {
-    void far *tmp, far *last = NULL;
-    blk_info far *bp;
-    if (!logfile) my_initialise();
-    /* Search the list for the block */
-    tmp = heap_list_head;
-    while (tmp)
+    unsigned long i;
+    size_t len;
+    if (key == NULL) return 0;
+    if ((next_name_id+1)*2 > name_map_size)
     {
-    	bp = GET_BLK(tmp);
-#if __MSDOS__
-    	if (((void huge *)tmp) == ((void huge *)p))
-	    break;
-#else
-    	if (tmp == p) break;
-#endif
-    	if (bp->magic != MAGIC) goto error;
-    	else
+    	name_entry *old = name_map;
+    	unsigned long j, oldsize = name_map_size;
+    	name_map_size = oldsize ? oldsize*2 : 256;
+    	name_map = (name_entry *)calloc((size_t)name_map_size, sizeof(name_entry));
+    	assert(name_map);
+    	for (j = 0; j < oldsize; j++)
     	{
-    	    last = tmp;
-    	    tmp = bp->next;
+    	    if (old[j].key)
+    	    {
+    	    	i = name_hash(old[j].key) & (name_map_size-1);
+    	    	while (name_map[i].key)
+    	    	    i = (i+1) & (name_map_size-1);
+    	    	name_map[i] = old[j];
+    	    }
     	}
+    	if (old) free(old);
     }
-    if (tmp)
+    i = name_hash(key) & (name_map_size-1);
+    while (name_map[i].key)
     {
-    	if (!TST_ENDMAGIC(p, bp->nbytes))
-    	    fprintf(logfile,"Block of size %ld allocated at %s, line %d, freed at %s, line %d, has been overrun\n",
-    			bp->nbytes, bp->file, bp->line, f, l);
-	if (((bp->flags&ISFAR)!=0) ^ isfar)
-    	    fprintf(logfile,"Wrong version of free called for this block!\n");
-    	/* Unlink from chain */
-    	if (last==NULL)
-    	    heap_list_head = bp->next;
-    	else
-    	    (GET_BLK(last))->next = bp->next;
-    	/* save who freed */
-    	bp->file = store_name(f);
-    	bp->line = l;
-    	/* trash contents */
-	if (bp->nbytes >= sizeof(long))
-            *((unsigned long far *)GET_DATA(bp)) = MAGIC;
-	return (((bp->flags&ISFAR)!=0) ^ isfar);
+    	if (name_map[i].key == key)
+    	    return name_map[i].id;
+    	i = (i+1) & (name_map_size-1);
     }
-    else bp = GET_BLK(p);
-error:
-    fprintf(logfile,"Bad call to free from file %s, line %d\n",f,l);
-/*#if __MSDOS__*/
-    /* Causes seg violation on UNIX */
-    if (bp && bp->magic==MAGIC)
-    	fprintf(logfile,"Possibly freed before at %s, line %d, size %ld\n",
-    		bp->file, bp->line, bp->nbytes);
-/*#endif*/
-    return -1;
+    name_map[i].key = key;
+    name_map[i].id = next_name_id++;
+    len = strlen(key);
+    putc(GW_E_NAME, fp);
+    put_varint(fp, name_map[i].id);
+    put_varint(fp, (unsigned long)len);
+    fwrite(key, 1, len, fp);
+    return name_map[i].id;
 }
 
-void my_free(void *p, char *f, int l)
+static void write_header(FILE *fp)
 {
-    if (log_free((void far *)p, f, l, 0) == 0)
-#if defined(__TINY__) || defined(__SMALL__) || defined(__MEDIUM__)
-	free(((char *)p) - sizeof(blk_info));
-#else
-        free(GET_BLK(p));
-#endif
+    fwrite(GW_BINLOG_MAGIC, 1, 4, fp);
+    putc(GW_BINLOG_VERSION, fp);
+    putc((int)sizeof(long), fp);
+    put_varint(fp, (unsigned long)time(NULL));
 }
 
-#if __MSDOS__
-void far *my_fcalloc(unsigned long n, char *f, int l)
+static void emit_event(FILE *fp, gw_event *e)
 {
-    /* Allocate the memory with space enough for our info */
-    void far *rtn = farcalloc(BUMPSIZE(n), 1l);
-    log_alloc(rtn, n, f, l, ISFAR);
-    return GET_DATA(rtn);
+    unsigned long name, file, file2;
+    long dt = (long)(e->time - last_time);
+    /* names must be defined before the record that uses them */
+    name = name_id(fp, e->name);
+    file = name_id(fp, e->file);
+    file2 = name_id(fp, e->file2);
+    last_time = e->time;
+    putc(e->type, fp);
+    put_varint(fp, ZIGZAG(dt));
+    put_varint(fp, name);
+    put_varint(fp, file);
+    put_varint(fp, file2);
+    put_varint(fp, ZIGZAG((long)e->line));
+    put_varint(fp, ZIGZAG((long)e->line2));
+    put_varint(fp, (unsigned long)(char huge *)e->ptr);
+    put_varint(fp, ZIGZAG(e->a));
+    put_varint(fp, ZIGZAG(e->b));
 }
 
-void far *my_fmalloc(unsigned long n, char *f, int l)
-{
-    void far *rtn = my_fcalloc(n,f,l);
-    if (n >= sizeof(long))
-	*((unsigned long far *)rtn) = MAGIC; /* mark as unitialised */
-    return rtn;
-}
+#else
 
-void my_ffree(void far *p, char *f, int l)
+#define emit_event(fp, e)	gw_render_event(fp, e)
+
+#endif /* GW_BINARY_LOG */
+
+#ifdef GW_ASYNC_LOG
+
+#ifndef GW_LOG_RING
+#define GW_LOG_RING	256	/* events per ring; a power of two */
+#endif
+
+#ifndef GW_LOG_POLICY
+#define GW_LOG_POLICY	GW_LOG_BLOCK
+#endif
+
+#ifndef GW_LOG_INTERVAL
+#define GW_LOG_INTERVAL	50	/* ms the writer sleeps when idle */
+#endif
+
+/* head is only written by the owning thread and tail only by
+   whoever holds log_lock; each reads the other's with acquire
+   ordering so the record contents are seen before the index. */
+
+typedef struct log_ring
 {
-    if (log_free(p, f, l, 1) == 0)
-	farfree(GET_BLK(p));
-}
+    unsigned long head;
+    unsigned long tail;
+    int owned;		/* a live thread is filling this ring */
+    struct log_ring *next;
+    gw_event ev[GW_LOG_RING];
+} log_ring;
+
+static log_ring *ring_list = NULL;
+static int log_policy = GW_LOG_POLICY;
+static unsigned long log_dropped = 0;
+
+#ifdef GW_THREADS
+static pthread_key_t ring_key;
+static pthread_t log_writer;
 #endif
 
-static blk_info far *my_find_block(void far *p)
+/* Write out everything queued so far. Returns the number of events
+   written. The caller must hold log_lock. */
+
+static int drain_rings(void)
 {
-#ifdef __MSDOS__
-    blk_info far *bp = GET_BLK(p);
-    return (bp->magic==MAGIC) ? bp : NULL;
-#else
-    blk_info *bp = GET_BLK(p);
-    void *tmp = heap_list_head;
-    /* Search the list for the block. We don't just check for the magic
-    	number under UNIX as this can cause a segmentation violation */
-    while (tmp)
+    log_ring *r;
+    int n = 0;
+    if (logfile == NULL) return 0;
+    for (r = LOAD_ACQ(ring_list); r; r = r->next)
     {
-    	if ((void huge *)tmp == (void huge *)p)
-	    return GET_BLK(p);
-    	tmp = GET_BLK(tmp)->next;
+    	unsigned long head = LOAD_ACQ(r->head), tail = r->tail;
+    	while (tail != head)
+    	{
+    	    emit_event(logfile, &r->ev[tail & (GW_LOG_RING-1)]);
+    	    tail++;
+    	    n++;
+    	}
+    	STORE_REL(r->tail, tail);
     }
-    return NULL;
-#endif
+    if (n) fflush(logfile);
+    return n;
 }
 
-static int my_sizehint(void far *p, int size)
+static void flush_log(void)
 {
-    void *tmp;
-    blk_info far *bp;
-    if (p == NULL) return -1;
-    bp = my_find_block(p);
-    if (bp)
+    GW_LOCK(log_lock);
+    drain_rings();
+    if (log_dropped && logfile)
     {
-    	assert(size == sizeof(char *));
-    	return (int)(bp->nbytes);
+    	fprintf(logfile,"%lu log events were dropped\n", log_dropped);
+    	log_dropped = 0;
     }
-    else if (size == sizeof(char *))
-    	return -1; /* no clues */
-    else return size;
+    GW_UNLOCK(log_lock);
 }
 
-/*****************************/
-/* String function debugging */
-/*****************************/
-
-/* flags for additional checks */
-
-#define INIT1	1	/* arg s1 must be initialised */
-#define INIT2	2	/* arg s2 must be initialised */
-#define NULLT	4	/* must be initialised with NUL-terminated strings */
+#ifdef GW_THREADS
 
-/* Validate a single pointer arg */
+static void release_ring(void *arg)
+{
+    /* the writer still empties it; a new thread may then reuse it */
+    STORE_REL(((log_ring *)arg)->owned, 0);
+}
 
-static int my_init_check(char far *p, int space, int nul)
+static log_ring *my_ring(void)
 {
-    blk_info far *bp = my_find_block(p);
-    if (bp)
-    {
-	if (bp->nbytes>=sizeof(long) && *((unsigned long *)p)==MAGIC)
-	    return 0;
-	return 1;
-    }
-    else if (space >= 0 && nul)
+    log_ring *r = (log_ring *)pthread_getspecific(ring_key);
+    if (r == NULL)
     {
-	int i;
-	for (i = 0; i < space; i++)
-	    if (p[i] == 0)
-		return 1;
-	return 0;
+    	/* reuse the ring of a thread that has exited, if any */
+    	GW_LOCK(init_lock);
+    	for (r = ring_list; r; r = r->next)
+    	    if (!LOAD_ACQ(r->owned) && LOAD_ACQ(r->tail) == r->head)
+    	    	break;
+    	if (r == NULL)
+    	{
+    	    r = (log_ring *)calloc(1, sizeof(log_ring));
+    	    assert(r);
+    	    r->next = ring_list;
+    	    STORE_REL(ring_list, r);
+    	}
+    	r->owned = 1;
+    	GW_UNLOCK(init_lock);
+    	pthread_setspecific(ring_key, r);
     }
-    return 1; /* we don't know, so we assume OK */
+    return r;
 }
 
-static int my_validate1(char *name, char *s, int space, char *f, int l,
-	unsigned flags)
+static void *log_writer_main(void *arg)
 {
-    if (s==NULL)
-    {
-    	fprintf(logfile,"%s(NULL) at file %s, line %d\n", name, f, l);
-        return -1;
-    }
-    else if (flags & INIT1)
+    struct timespec ts;
+    GW_ENTER; /* for good */
+    ts.tv_sec = GW_LOG_INTERVAL / 1000;
+    ts.tv_nsec = (GW_LOG_INTERVAL % 1000) * 1000000L;
+    for (;;)
     {
-	if (my_init_check(s, space, (flags&NULLT)!=0) == 0)
-	{
-    	    fprintf(logfile,"%s(uninitialised) at file %s, line %d\n", name, f, l);
-            return -1;
-	}
+    	int n;
+    	GW_LOCK(log_lock);
+    	n = drain_rings();
+    	GW_UNLOCK(log_lock);
+    	if (n == 0)
+    	    nanosleep(&ts, NULL);
     }
-    return 0;
+    return arg;
 }
 
-/* Validate a pair of pointer args */
+#else
+
+static log_ring main_ring;
+
+static log_ring *my_ring(void)
+{
+    if (ring_list == NULL)
+    	ring_list = &main_ring;
+    return &main_ring;
+}
+
+#endif
+
+#endif /* GW_ASYNC_LOG */
+
+void gw_log_policy(int policy)
+{
+#ifdef GW_ASYNC_LOG
+    log_policy = policy;
+#else
+    (void)policy; /* we never buffer, so never need to drop */
+#endif
+}
+
+/* Hand an event to the writer, or write it out now */
+
+static void post_event(gw_event *src)
+{
+#ifdef GW_ASYNC_LOG
+    log_ring *r = my_ring();
+    unsigned long head = r->head;
+    if (head - LOAD_ACQ(r->tail) >= GW_LOG_RING)
+    {
+    	if (log_policy == GW_LOG_DROP)
+    	{
+    	    GW_ATOMIC_INC(log_dropped);
+    	    return;
+    	}
+    	/* do the writer's job ourselves */
+    	GW_LOCK(log_lock);
+    	drain_rings();
+    	GW_UNLOCK(log_lock);
+    }
+    r->ev[head & (GW_LOG_RING-1)] = *src;
+    STORE_REL(r->head, head+1);
+#else
+    GW_LOCK(log_lock);
+    emit_event(logfile, src);
+    GW_UNLOCK(log_lock);
+#endif
+}
+
+static void log_event(int type, char *name, char *f, int l,
+	char *f2, int l2, long a, long b)
+{
+    gw_event e;
+    e.type = type;
+    e.name = name;
+    e.file = f;
+    e.line = l;
+    e.file2 = f2;
+    e.line2 = l2;
+    e.ptr = NULL;
+    e.a = a;
+    e.b = b;
+    e.time = log_clock();
+    post_event(&e);
+}
+
+#ifdef GW_BINARY_LOG
+
+/* Record an allocation, free, open, close or total; the binary log
+   gets these so that gwdecode can rebuild the end-of-program report */
+
+static void log_trace(int type, char *name, void far *p, long a, long b,
+	char *f, int l)
+{
+    gw_event e;
+    e.type = type;
+    e.name = name;
+    e.file = f;
+    e.line = l;
+    e.file2 = NULL;
+    e.line2 = 0;
+    e.ptr = p;
+    e.a = a;
+    e.b = b;
+    e.time = log_clock();
+    post_event(&e);
+}
+
+#endif
+
+/***************/
+/* Stack depot */
+/***************/
+
+/* Under GW_STACKS each wrapper that can allocate notes its own frame
+   on the way in, unless an outer one already has, and log_alloc
+   follows the frame pointers from there to collect the return
+   addresses above it. The walk stops at GW_STACKS frames or the
+   first that doesn't look right (one not further up this thread's
+   stack), so its cost is bounded and it never strays off the stack.
+   Stacks are interned much as sites are, and a block keeps just the
+   id; stack 0 is `unknown'. */
+
+#ifdef GW_STACKS
+
+typedef unsigned int stack_id;
+
+typedef struct
+{
+    unsigned long hash;
+    int		depth;
+    void       *pc[GW_STACKS];
+} stack_info;
+
+#ifndef STACK_CHUNK
+#define STACK_CHUNK	1024	/* stacks per chunk */
+#endif
+
+#ifndef MAX_STACK_CHUNKS
+#define MAX_STACK_CHUNKS	4096
+#endif
+
+/* The hash table is looked up without the lock, so it carries its
+   own size, and an outgrown one is never freed, as a reader may still
+   be probing it; the old ones add up to less than the current one. */
+
+typedef struct
+{
+    unsigned long size;
+    stack_id	ids[1];
+} stack_index;
+
+static stack_index *stack_table = NULL;
+static stack_id next_stack = 1;
+static stack_info *stack_chunks[MAX_STACK_CHUNKS];
+
+#define stack_of(id)	(&stack_chunks[(id) / STACK_CHUNK][(id) % STACK_CHUNK])
+
+static GW_TLS void *stack_base;	/* frame of the outermost wrapper */
+static GW_TLS char *stack_top;	/* frames must lie below this */
+
+static void *stack_enter(void *fp)
+{
+    if (stack_base)
+    	return NULL;
+    stack_base = fp;
+    return fp;
+}
+
+static void stack_leave(void **entry)
+{
+    if (*entry)
+    	stack_base = NULL;
+}
+
+#define STACK_ENTRY	void *stack_entry __attribute__((cleanup(stack_leave))) \
+				= stack_enter(__builtin_frame_address(0))
+
+#ifndef GW_THREADS
+extern void *__libc_stack_end;
+#endif
+
+static char *find_stack_top(void)
+{
+#ifdef GW_THREADS
+    pthread_attr_t attr;
+    void *lo;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    	return (char *)stack_base + 1; /* just our own frame, then */
+    pthread_attr_getstack(&attr, &lo, &size);
+    pthread_attr_destroy(&attr);
+    return (char *)lo + size;
+#else
+    return (char *)__libc_stack_end;
+#endif
+}
+
+static int capture_stack(void **pc)
+{
+    void **fp = (void **)stack_base, **next;
+    int n = 0;
+    if (fp == NULL)
+    	return 0;
+    if (stack_top == NULL)
+    	stack_top = find_stack_top();
+    while (n < GW_STACKS && fp[1])
+    {
+    	pc[n++] = fp[1];
+    	next = (void **)fp[0];
+    	if (next <= fp || next > (void **)stack_top - 2
+    		|| ((unsigned long)next & (sizeof(void *) - 1)))
+    	    break;
+    	fp = next;
+    }
+    return n;
+}
+
+static unsigned long stack_hash(void **pc, int n)
+{
+    unsigned long h = 2166136261UL;
+    while (n--)
+    	h = (h ^ (unsigned long)*pc++) * 16777619UL;
+    return h ^ (h >> 15);
+}
+
+/* Look for a stack in the table, leaving *slot at the empty slot
+   that ends its probe sequence if it isn't there */
+
+static stack_id find_stack(stack_index *t, unsigned long h, void **pc,
+			   int n, unsigned long *slot)
+{
+    unsigned long i, mask = t->size-1;
+    stack_id id;
+    stack_info *st;
+    i = h & mask;
+    while ((id = LOAD_ACQ(t->ids[i])) != 0)
+    {
+    	st = stack_of(id);
+    	if (st->hash == h && st->depth == n
+    		&& memcmp(st->pc, pc, n * sizeof(void *)) == 0)
+    	    return id;
+    	i = (i+1) & mask;
+    }
+    *slot = i;
+    return 0;
+}
+
+/* The id of the stack we're on, interning it if it's new. Stacks
+   seen before are found without the lock; only a new one takes it. */
+
+static stack_id this_stack(void)
+{
+    void *pc[GW_STACKS];
+    unsigned long h, i;
+    stack_id id;
+    stack_info *st;
+    stack_index *t;
+    int n = capture_stack(pc);
+    if (n == 0)
+    	return 0;
+    h = stack_hash(pc, n);
+    t = LOAD_ACQ(stack_table);
+    if (t && (id = find_stack(t, h, pc, n, &i)) != 0)
+    	return id;
+    GW_LOCK(stack_lock);
+    t = stack_table;
+    if (t == NULL || ((unsigned long)next_stack+1)*2 > t->size)
+    {
+    	unsigned long j, mask, size = t ? t->size*2 : 1024;
+    	stack_index *nt = (stack_index *)calloc(1, sizeof(stack_index)
+    				+ (size-1) * sizeof(stack_id));
+    	assert(nt);
+    	nt->size = size;
+    	mask = size-1;
+    	for (j = 0; t && j < t->size; j++)
+    	{
+    	    if (t->ids[j])
+    	    {
+    	    	i = stack_of(t->ids[j])->hash & mask;
+    	    	while (nt->ids[i])
+    	    	    i = (i+1) & mask;
+    	    	nt->ids[i] = t->ids[j];
+    	    }
+    	}
+    	STORE_REL(stack_table, nt);
+    	t = nt;
+    }
+    /* another thread may have added it since we looked */
+    if ((id = find_stack(t, h, pc, n, &i)) != 0)
+    {
+    	GW_UNLOCK(stack_lock);
+    	return id;
+    }
+    id = next_stack;
+    if (id / STACK_CHUNK >= MAX_STACK_CHUNKS)
+    {
+    	GW_UNLOCK(stack_lock);
+    	return 0; /* out of room */
+    }
+    if (stack_chunks[id / STACK_CHUNK] == NULL)
+    {
+    	stack_chunks[id / STACK_CHUNK] =
+    	    (stack_info *)calloc(STACK_CHUNK, sizeof(stack_info));
+    	assert(stack_chunks[id / STACK_CHUNK]);
+    }
+    st = stack_of(id);
+    st->hash = h;
+    st->depth = n;
+    memcpy(st->pc, pc, n * sizeof(void *));
+    STORE_REL(t->ids[i], id);
+    STORE_REL(next_stack, id+1);
+    GW_UNLOCK(stack_lock);
+    return id;
+}
+
+/* Stacks are printed with function names where they can be found.
+   The symbol table of each loaded object (.symtab, or failing that
+   .dynsym) is read the first time one of its addresses comes up,
+   into an array sorted by address, so each lookup is a binary
+   search; and each address is only looked up once, as reports
+   print the same frames over and over. An address in none of the
+   objects we know of sends us looking again, for any loaded since
+   with dlopen. */
+
+typedef struct
+{
+    unsigned long addr;
+    unsigned long size;
+    char       *name;
+} sym_entry;
+
+typedef struct sym_module
+{
+    char       *path;
+    unsigned long bias;		/* load address less link address */
+    unsigned long lo, hi;	/* where its segments are */
+    sym_entry  *syms;
+    unsigned long nsyms;
+    int		loaded;
+    struct sym_module *next;
+} sym_module;
+
+static sym_module *sym_modules = NULL;
+static unsigned long long sym_adds = 0;	/* objects ever loaded, last we looked */
+
+/* Called by dl_iterate_phdr for each loaded object; *first is set
+   for the first of them */
+
+static int add_module(struct dl_phdr_info *info, size_t size, void *first)
+{
+    sym_module *m;
+    unsigned long bias = (unsigned long)info->dlpi_addr, lo = (unsigned long)-1, hi = 0;
+    int i;
+    if (*(int *)first)
+    {
+    	*(int *)first = 0;
+    	/* the C library may count what it has loaded; if it hasn't
+    	   loaded anything since, there is nothing to add */
+    	if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds))
+    	{
+    	    if (sym_modules && info->dlpi_adds == sym_adds)
+    		return 1;
+    	    sym_adds = info->dlpi_adds;
+    	}
+    }
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+    	const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    	unsigned long a = bias + ph->p_vaddr;
+    	if (ph->p_type != PT_LOAD)
+    	    continue;
+    	if (a < lo) lo = a;
+    	if (a + ph->p_memsz > hi) hi = a + ph->p_memsz;
+    }
+    for (m = sym_modules; m; m = m->next)
+    	if (m->lo == lo && m->hi == hi && m->bias == bias)
+    	    return 0; /* seen it */
+    m = (sym_module *)calloc(1, sizeof(sym_module));
+    if (m == NULL)
+    	return 1;
+    if (info->dlpi_name[0])
+    	m->path = strdup(info->dlpi_name);
+    else
+    {
+    	/* the program itself */
+    	char exe[FILENAME_MAX];
+    	ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    	exe[n > 0 ? n : 0] = 0;
+    	m->path = strdup(n > 0 ? exe : "/proc/self/exe");
+    }
+    if (m->path == NULL)
+    {
+    	free(m);
+    	return 1;
+    }
+    m->bias = bias;
+    m->lo = lo;
+    m->hi = hi;
+    m->next = sym_modules;
+    sym_modules = m;
+    return 0;
+}
+
+static int by_sym_addr(const void *a, const void *b)
+{
+    const sym_entry *x = (const sym_entry *)a;
+    const sym_entry *y = (const sym_entry *)b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Read in the function symbols of m from the file it was loaded from */
+
+static void load_symbols(sym_module *m)
+{
+    int fd, pass, i;
+    struct stat st;
+    char *img;
+    const ElfW(Ehdr) *eh;
+    const ElfW(Shdr) *sh;
+    m->loaded = 1;
+    if ((fd = open(m->path, O_RDONLY)) < 0)
+    	return;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr)))
+    {
+    	close(fd);
+    	return;
+    }
+    img = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED)
+    	return;
+    eh = (const ElfW(Ehdr) *)img;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0
+    	    || eh->e_shoff == 0
+    	    || eh->e_shoff + (unsigned long)eh->e_shnum * sizeof(ElfW(Shdr))
+    		> (unsigned long)st.st_size)
+    {
+    	munmap(img, (size_t)st.st_size);
+    	return;
+    }
+    sh = (const ElfW(Shdr) *)(img + eh->e_shoff);
+    /* the full table if it's there, else the dynamic one */
+    for (pass = 0; pass < 2 && m->nsyms == 0; pass++)
+    {
+    	for (i = 0; i < eh->e_shnum; i++)
+    	{
+    	    const ElfW(Sym) *sym;
+    	    const char *names;
+    	    unsigned long n, j;
+    	    if (sh[i].sh_type != (pass ? SHT_DYNSYM : SHT_SYMTAB)
+    		    || sh[i].sh_link >= eh->e_shnum
+    		    || sh[i].sh_offset + sh[i].sh_size > (unsigned long)st.st_size)
+    		continue;
+    	    sym = (const ElfW(Sym) *)(img + sh[i].sh_offset);
+    	    names = img + sh[sh[i].sh_link].sh_offset;
+    	    n = sh[i].sh_size / sizeof(ElfW(Sym));
+    	    m->syms = (sym_entry *)malloc((n ? n : 1) * sizeof(sym_entry));
+    	    if (m->syms == NULL)
+    		break;
+    	    for (j = 0; j < n; j++)
+    	    {
+    		if ((sym[j].st_info & 0xf) != STT_FUNC
+    			|| sym[j].st_shndx == SHN_UNDEF
+    			|| sym[j].st_name >= sh[sh[i].sh_link].sh_size)
+    		    continue;
+    		m->syms[m->nsyms].addr = m->bias + sym[j].st_value;
+    		m->syms[m->nsyms].size = sym[j].st_size;
+    		m->syms[m->nsyms].name = strdup(names + sym[j].st_name);
+    		m->nsyms++;
+    	    }
+    	    break;
+    	}
+    }
+    munmap(img, (size_t)st.st_size);
+    qsort(m->syms, (size_t)m->nsyms, sizeof(sym_entry), by_sym_addr);
+}
+
+/* Describe address pc as function+offset (module), or failing that
+   module+offset as addr2line would want it */
+
+static void describe_pc(void *pc, char *buf, size_t len)
+{
+    unsigned long a = (unsigned long)pc;
+    sym_module *m;
+    char *base;
+    int pass, first;
+    for (pass = 0; pass < 2; pass++)
+    {
+    	for (m = sym_modules; m; m = m->next)
+    	    if (a >= m->lo && a < m->hi)
+    		break;
+    	if (m || pass)
+    	    break;
+    	first = 1;
+    	dl_iterate_phdr(add_module, &first);
+    }
+    if (m == NULL)
+    {
+    	snprintf(buf, len, "?");
+    	return;
+    }
+    base = strrchr(m->path, '/') ? strrchr(m->path, '/') + 1 : m->path;
+    if (!m->loaded)
+    	load_symbols(m);
+    if (m->nsyms)
+    {
+    	/* the last symbol at or below a */
+    	unsigned long lo = 0, hi = m->nsyms;
+    	while (lo < hi)
+    	{
+    	    unsigned long mid = (lo + hi) / 2;
+    	    if (m->syms[mid].addr <= a)
+    		lo = mid + 1;
+    	    else
+    		hi = mid;
+    	}
+    	if (lo && (m->syms[lo-1].size == 0
+    		|| a < m->syms[lo-1].addr + m->syms[lo-1].size))
+    	{
+    	    snprintf(buf, len, "%s+%#lx (%s)", m->syms[lo-1].name,
+    		    a - m->syms[lo-1].addr, base);
+    	    return;
+    	}
+    }
+    snprintf(buf, len, "%s+%#lx", base, a - m->bias);
+}
+
+/* Addresses already described */
+
+#ifndef PC_CACHE
+#define PC_CACHE	4096	/* a power of two */
+#endif
+
+static struct
+{
+    void       *pc;
+    char       *text;
+} pc_cache[PC_CACHE];
+
+static char *symbolize(void *pc)
+{
+    static char spare[256];
+    unsigned long i = ((unsigned long)pc >> 2) * 2654435761UL & (PC_CACHE-1);
+    unsigned long tries;
+    char *text;
+    for (tries = 0; tries < PC_CACHE; tries++, i = (i+1) & (PC_CACHE-1))
+    {
+    	if (pc_cache[i].pc == pc)
+    	    return pc_cache[i].text;
+    	if (pc_cache[i].pc == NULL)
+    	    break;
+    }
+    describe_pc(pc, spare, sizeof(spare));
+    if (tries < PC_CACHE && (text = strdup(spare)) != NULL)
+    {
+    	pc_cache[i].pc = pc;
+    	pc_cache[i].text = text;
+    	return text;
+    }
+    return spare; /* the cache is full */
+}
+
+#else
+#define STACK_ENTRY
+#endif /* GW_STACKS */
+
+/*******************************/
+/* Memory allocation debugging */
+/*******************************/
+
+#define MAGIC			(0x24681357L)
+
+#define ISFAR	1
+#define ISGUARD	2	/* has pages of its own; see guard_alloc */
+#define ISSWEPT	4	/* reported overrun by gw_sweep */
+
+#define SWEPT_MAGIC	(0x13572468L)	/* a header gw_sweep found bad */
+
+/* Freeing a blk_info header will usually result in the memory
+   manager using the first few bytes to store the block on the
+   free list. The fields at the start of blk_info have been
+   chosen to be the ones we don't mind being clobbered.
+*/
+
+typedef struct
+{
+    long	magic;
+    void far   *next;
+    void far   *prev;
+    unsigned long seq;	/* allocation sequence number */
+    long	nbytes;
+    site_id	site;	/* where allocated, or freed once it is */
+    short	flags;	/* ISFAR, ISGUARD */
+#ifdef GW_QUARANTINE
+    site_id	freed_by; /* site keeps where allocated */
+#endif
+#ifdef GW_SHADOW
+    unsigned char *shadow; /* a bit per byte written; NULL if all are */
+#endif
+#ifdef GW_STACKS
+    stack_id	stack;	/* where from, in full */
+#endif
+#ifdef GW_SAMPLE
+    unsigned long weight; /* blocks it stands for, in 1/GW_WEIGHT_ONE */
+#endif
+}
+#if defined(__GNUC__) && !__MSDOS__
+__attribute__((aligned(16)))	/* keep user data as aligned as malloc's */
+#endif
+blk_info;
+
+#ifdef GW_QUARANTINE
+#define FREED_BY(bp)	((bp)->freed_by)
+#else
+#define FREED_BY(bp)	((bp)->site)
+#endif
+
+#define GET_BLKP(p, o)		(( (blk_info huge *)(p) ) + (o))
+#define GET_BLK(p)		(blk_info far *)GET_BLKP(p, -1)
+#define GET_DATA(p)		((void far *)GET_BLKP(p, 1))
+#define BUMPSIZE(n)		((n)+sizeof(blk_info) + sizeof(long))
+/*#define GET_BLK(p)		(blk_info far *)(((char far *)p)-sizeof(blk_info))*/
+#define SET_ENDMAGIC(p,n)	*(long far *)( ((char huge *)p)+n ) = MAGIC
+#define TST_ENDMAGIC(p,n)	(*(long far *)( ((char huge *)p)+n ) == MAGIC)
+
+/* What a tracked block of n bytes and the given weight counts for.
+   A block keeps the weight it was picked with when it is resized,
+   as it was picked for its size then. Under GW_SAMPLE block counts
+   are kept in 1/GW_WEIGHT_ONE blocks, so the fractions add up rather
+   than being rounded away block by block; WHOLE gives whole ones. */
+
+#ifdef GW_SAMPLE
+#define WEIGHT_OF(bp)	((bp)->weight)
+#define ESTIMATE(n,w,c,b) ((c) = (w), \
+	(b) = (unsigned long)((double)(n) * (double)(w) / GW_WEIGHT_ONE + 0.5))
+#define WHOLE(c)	(((c) + GW_WEIGHT_ONE/2) / GW_WEIGHT_ONE)
+
+static unsigned long size_weight(unsigned long n)
+{
+    unsigned long c, b;
+    gw_sample_weight(n, GW_SAMPLE, &c, &b);
+    return c;
+}
+#else
+#define WEIGHT_OF(bp)	0UL
+#define ESTIMATE(n,w,c,b) ((c) = 1, (b) = (n))
+#define WHOLE(c)	(c)
+#endif
+
+/*************************/
+/* Guard-page allocation */
+/*************************/
+
+/* A guarded block is mapped on its own, header and all, so that its
+   last byte is the last byte before a PROT_NONE page:
+
+	| ..unused.. | blk_info | data | slack | guard page |
+
+   The data is aligned to GW_GUARD_ALIGN, so up to GW_GUARD_ALIGN-1
+   bytes of slack can come between it and the guard page; the end
+   marker goes there if it fits. Set GW_GUARD_ALIGN to 1 to catch
+   every overrun, if the program doesn't mind unaligned blocks.
+*/
+
+#ifdef GW_GUARD
+
+#ifndef GW_GUARD_BUDGET
+#define GW_GUARD_BUDGET	(256UL*1024*1024)	/* bytes of address space */
+#endif
+
+#ifndef GW_GUARD_ALIGN
+#define GW_GUARD_ALIGN	16	/* a power of two */
+#endif
+
+static unsigned long guard_used = 0;	/* bytes mapped for guarded blocks */
+static unsigned long page_size = 0;
+
+/* Bytes mapped for a guarded block of n bytes, guard page included */
+
+static unsigned long guard_span(unsigned long n)
+{
+    unsigned long need = n + sizeof(blk_info) + GW_GUARD_ALIGN;
+    return ((need + page_size - 1) & ~(page_size - 1)) + page_size;
+}
+
+/* Room between the end of the data and the guard page */
+
+static unsigned long guard_slack(void far *p, unsigned long n)
+{
+    unsigned long end = (unsigned long)p + n;
+    return (page_size - (end & (page_size - 1))) & (page_size - 1);
+}
+
+/* Returns the header of a new zeroed block, or NULL if it is too
+   small, the budget is spent or the mapping fails */
+
+static blk_info *guard_alloc(unsigned long n)
+{
+    unsigned long span, end;
+    char *base;
+    if (n < GW_GUARD)
+    	return NULL;
+    if (page_size == 0)
+    	page_size = (unsigned long)sysconf(_SC_PAGESIZE);
+    span = guard_span(n);
+    if (GW_ATOMIC_ADD(guard_used, span) > GW_GUARD_BUDGET)
+    {
+    	GW_ATOMIC_SUB(guard_used, span);
+    	return NULL;
+    }
+    base = (char *)mmap(NULL, span, PROT_READ|PROT_WRITE,
+    		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == (char *)MAP_FAILED)
+    {
+    	GW_ATOMIC_SUB(guard_used, span);
+    	return NULL;
+    }
+    end = (unsigned long)base + span - page_size;
+    if (mprotect((void *)end, page_size, PROT_NONE) != 0)
+    {
+    	munmap(base, span);
+    	GW_ATOMIC_SUB(guard_used, span);
+    	return NULL;
+    }
+    return GET_BLK((char *)((end - n) & ~(unsigned long)(GW_GUARD_ALIGN - 1)));
+}
+
+/* The header can be on the mapping's second page (when the slack
+   pushes the data just past a page boundary), so the base is found
+   from the guard page, which starts where the data ends, rounded up */
+
+static void guard_free(blk_info *bp)
+{
+    unsigned long span = guard_span((unsigned long)bp->nbytes);
+    unsigned long end = (unsigned long)GET_DATA(bp) + (unsigned long)bp->nbytes;
+    char *base;
+    end = (end + page_size - 1) & ~(page_size - 1);
+    base = (char *)(end + page_size - span);
+    munmap(base, span);
+    GW_ATOMIC_SUB(guard_used, span);
+}
+
+/* Is the page holding p still mapped? Used before reading the header
+   of something passed to free that we don't know about, which may be
+   a guarded block that has been unmapped. */
+
+static int page_mapped(void far *p)
+{
+    if (page_size == 0)
+    	return 1; /* nothing has been unmapped yet */
+    return msync((void *)((unsigned long)p & ~(page_size - 1)),
+    		page_size, MS_ASYNC) == 0 || errno != ENOMEM;
+}
+
+#define HAS_ENDMAGIC(bp,p) \
+	(!((bp)->flags & ISGUARD) || guard_slack(p, (bp)->nbytes) >= sizeof(long))
+
+#else
+
+#define HAS_ENDMAGIC(bp,p)	1
+
+#endif /* GW_GUARD */
+
+void my_free(void *p, char *f, int l);
+
+#if __MSDOS__
+void my_ffree(void far *p, char *f, int l);
+#endif
+
+/**************************************/
+/* Threads, shards and their counters */
+/**************************************/
+
+/* With GW_THREADS defined live blocks are spread over GW_SHARDS
+   registries, chosen by a hash of the user's pointer, each with
+   its own lock, so threads allocating and freeing different blocks
+   seldom contend. Without GW_THREADS there is a single shard.
+*/
+
+/* Each shard holds a list of its live blocks, newest first, and an
+   open-addressed hash table keyed by user pointer to find them.
+   The table uses linear probing; deleted slots are refilled by
+   shifting later members of the probe run back, so there are no
+   tombstones and lookups stay short. It is kept at most half full.
+*/
+
+#ifndef INDEX_INIT_SIZE
+#define INDEX_INIT_SIZE	1024	/* must be a power of two */
+#endif
+
+typedef struct
+{
+    void far   *list_head;
+    void far  **index;
+    unsigned long index_size;
+    unsigned long index_used;
+    unsigned long seq;		/* of the last block linked in */
+#ifdef GW_THREADS
+    pthread_mutex_t lock;
+#endif
+} heap_shard;
+
+static heap_shard heap_shards[GW_SHARDS];
+
+/* Blocks are numbered as they are linked in, which keeps each shard's
+   list in descending order. Rather than one counter that every
+   allocation would fight over, the numbers are Lamport clocks: a
+   block gets one more than the larger of its shard's last number and
+   its thread's, so each thread's blocks are in order across shards
+   as well, and a single-threaded program's in order overall. */
+
+static GW_TLS unsigned long thread_seq = 0;
+
+static heap_shard *shard_of(void far *p)
+{
+    unsigned long h = (unsigned long)(char huge *)p;
+    return &heap_shards[((h >> 4) ^ (h >> 12)) & (GW_SHARDS-1)];
+}
+
+/* Per-thread counters. Each thread bumps its own set without any
+   locking; readers sum over all of them. The counters of threads
+   that have exited are folded into retired_counts. */
+
+typedef struct thread_counts
+{
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long bytes_allocated;
+    unsigned long bytes_freed;
+#ifdef GW_HISTOGRAMS
+    gw_histograms hist;
+#endif
+#ifdef GW_SAMPLE
+    long sample_left;		/* bytes to go before the next sample */
+    unsigned long rand;		/* random state for the sampler */
+#endif
+    struct thread_counts *next;
+} thread_counts;
+
+static thread_counts retired_counts;
+
+#ifdef GW_HISTOGRAMS
+static void add_histograms(gw_histograms *to, gw_histograms *from);
+#endif
+
+#ifdef GW_THREADS
+
+static thread_counts *thread_count_list = NULL;
+
+static pthread_key_t count_key;
+
+static void retire_counts(void *arg)
+{
+    thread_counts *tc = (thread_counts *)arg, **pp;
+    GW_LOCK(init_lock);
+    for (pp = &thread_count_list; *pp; pp = &(*pp)->next)
+    {
+    	if (*pp == tc)
+    	{
+    	    *pp = tc->next;
+    	    break;
+    	}
+    }
+    retired_counts.allocs += tc->allocs;
+    retired_counts.frees += tc->frees;
+    retired_counts.bytes_allocated += tc->bytes_allocated;
+    retired_counts.bytes_freed += tc->bytes_freed;
+#ifdef GW_HISTOGRAMS
+    add_histograms(&retired_counts.hist, &tc->hist);
+#endif
+    GW_UNLOCK(init_lock);
+    free(tc);
+}
+
+static thread_counts *my_counts(void)
+{
+    thread_counts *tc = (thread_counts *)pthread_getspecific(count_key);
+    if (tc == NULL)
+    {
+    	tc = (thread_counts *)calloc(1, sizeof(thread_counts));
+    	assert(tc);
+    	pthread_setspecific(count_key, tc);
+    	GW_LOCK(init_lock);
+    	tc->next = thread_count_list;
+    	thread_count_list = tc;
+    	GW_UNLOCK(init_lock);
+    }
+    return tc;
+}
+
+#else
+
+static thread_counts main_counts;
+static thread_counts *thread_count_list = &main_counts;
+
+#define my_counts()	(&main_counts)
+
+#endif
+
+/* The totals, with block counts as they are kept (see WHOLE) */
+
+static void sum_counters(gw_counters *c)
+{
+    thread_counts *tc;
+    GW_LOCK(init_lock);
+    c->allocs = retired_counts.allocs;
+    c->frees = retired_counts.frees;
+    c->bytes_allocated = retired_counts.bytes_allocated;
+    c->bytes_freed = retired_counts.bytes_freed;
+    for (tc = thread_count_list; tc; tc = tc->next)
+    {
+    	c->allocs += tc->allocs;
+    	c->frees += tc->frees;
+    	c->bytes_allocated += tc->bytes_allocated;
+    	c->bytes_freed += tc->bytes_freed;
+    }
+    GW_UNLOCK(init_lock);
+}
+
+void gw_get_counters(gw_counters *c)
+{
+    int s;
+    if (!logfile) my_initialise();
+    sum_counters(c);
+    c->allocs = WHOLE(c->allocs);
+    c->frees = WHOLE(c->frees);
+    c->live_blocks = 0;
+    for (s = 0; s < GW_SHARDS; s++)
+    {
+    	GW_LOCK(heap_shards[s].lock);
+    	c->live_blocks += heap_shards[s].index_used;
+    	GW_UNLOCK(heap_shards[s].lock);
+    }
+}
+
+/************/
+/* Sampling */
+/************/
+
+/* Sampled blocks are picked by counting bytes down to a random gap
+   drawn from an exponential distribution with mean GW_SAMPLE, so a
+   block of n bytes is picked with probability 1-exp(-n/GW_SAMPLE).
+   Each picked block then stands for 1/p blocks and n/p bytes. The
+   logarithm and exponential are done here to avoid needing libm. */
+
+#define LN2	0.69314718055994531
+
+static double gw_exp_neg(double y)	/* exp(-y), y >= 0 */
+{
+    double r, term = 1.0, sum = 1.0;
+    int k = (int)(y / LN2), i;
+    if (k > 60) return 0.0;
+    r = y - k * LN2;
+    for (i = 1; i < 12; i++)
+    {
+    	term *= -r / i;
+    	sum += term;
+    }
+    while (k--)
+    	sum *= 0.5;
+    return sum;
+}
+
+void gw_sample_weight(unsigned long n, unsigned long rate,
+	unsigned long *count, unsigned long *bytes)
+{
+    double p;
+    if (rate == 0 || n == 0)
+    {
+    	*count = GW_WEIGHT_ONE;
+    	*bytes = n;
+    	return;
+    }
+    p = 1.0 - gw_exp_neg((double)n / (double)rate);
+    *count = (unsigned long)((double)GW_WEIGHT_ONE / p + 0.5);
+    *bytes = (unsigned long)((double)n / p + 0.5);
+}
+
+#ifdef GW_SAMPLE
+
+static double gw_log(double x)		/* ln(x), 0 < x <= 1 */
+{
+    double t, t2, sum;
+    int k = 0;
+    while (x < 0.5)
+    {
+    	x *= 2.0;
+    	k++;
+    }
+    t = (x - 1.0) / (x + 1.0);
+    t2 = t * t;
+    sum = t * (1.0 + t2 * (1.0/3 + t2 * (1.0/5 + t2 * (1.0/7 + t2 * (1.0/9)))));
+    return 2.0 * sum - k * LN2;
+}
+
+static long sample_gap(thread_counts *tc)
+{
+    unsigned long x = tc->rand;
+    double gap;
+    if (x == 0)
+    	x = ((unsigned long)time(NULL) ^ (unsigned long)(char huge *)tc) | 1;
+    /* xorshift32 */
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    tc->rand = x &= 0xffffffffUL;
+    gap = -gw_log(((double)x + 1.0) / 4294967296.0) * (double)GW_SAMPLE;
+    return (long)gap + 1;
+}
+
+/* Should an allocation of n bytes be tracked? */
+
+static int sample_this(unsigned long n)
+{
+    thread_counts *tc;
+    if (!logfile) my_initialise();
+    tc = my_counts();
+    if (tc->rand == 0)
+    	tc->sample_left = sample_gap(tc);
+    if ((tc->sample_left -= (long)n) > 0)
+    	return 0;
+    tc->sample_left = sample_gap(tc);
+    return 1;
+}
+
+/* How many tracked blocks hash to each slot. A free whose slot is
+   empty can't be of a tracked block, so skips the shard lock. */
+
+#ifndef SAMPLE_FILTER
+#if __MSDOS__
+#define SAMPLE_FILTER	4096	/* a power of two */
+#else
+#define SAMPLE_FILTER	65536
+#endif
+#endif
+
+static unsigned short sample_filter[SAMPLE_FILTER];
+
+#define FILTER_SLOT(p)	(sample_filter[(((unsigned long)(char huge *)(p) >> 4) \
+				* 2654435761UL >> 12) & (SAMPLE_FILTER-1)])
+
+#endif /* GW_SAMPLE */
+
+/*****************/
+/* Shadow bitmap */
+/*****************/
+
+/* Bit i of a block's shadow is set once byte i has been written by
+   one of the wrappers. A byte whose bit is clear is uninitialised
+   only if it still holds UNSET, which malloc filled it with; any
+   other value must have been stored there directly. Blocks without
+   a shadow (from calloc, or when there was no room for one) are
+   initialised throughout. Far blocks keep the old first-word mark. */
+
+#ifdef GW_SHADOW
+
+#define UNSET	0xcd
+
+#define SHADOW_BYTES(n)	((size_t)(((n)+7)/8))
+#define SHADOW_BITS	(8*sizeof(long))	/* bytes covered by a word */
+
+#ifdef GW_THREADS
+#define SHADOW_OR(b,m)	__sync_fetch_and_or(&(b), (unsigned char)(m))
+#define SHADOW_AND(b,m)	__sync_fetch_and_and(&(b), (unsigned char)(m))
+#else
+#define SHADOW_OR(b,m)	((b) |= (unsigned char)(m))
+#define SHADOW_AND(b,m)	((b) &= (unsigned char)(m))
+#endif
+
+/* Mark a new block of n bytes at p as all uninitialised */
+
+static void shadow_new(blk_info far *bp, void far *p, unsigned long n)
+{
+    bp->shadow = (unsigned char *)calloc(SHADOW_BYTES(n), 1);
+    if (bp->shadow)
+    	memset(p, UNSET, (size_t)n);
+}
+
+/* Mark n bytes from offset off as written */
+
+static void shadow_set(blk_info far *bp, unsigned long off, unsigned long n)
+{
+    unsigned char *sp = bp->shadow;
+    if (sp == NULL || off >= (unsigned long)bp->nbytes)
+    	return;
+    if (n > (unsigned long)bp->nbytes - off)
+    	n = (unsigned long)bp->nbytes - off;
+    for (; n && (off & 7); off++, n--)
+    	SHADOW_OR(sp[off>>3], 1 << (off & 7));
+    memset(sp + (off>>3), 0xff, (size_t)(n>>3));
+    off += n & ~7UL;
+    for (n &= 7; n; off++, n--)
+    	SHADOW_OR(sp[off>>3], 1 << (off & 7));
+}
+
+/* Returns the offset of the first uninitialised byte among n from
+   offset off, or -1. Runs of written bytes are passed over a word
+   of the shadow, or a byte of it, at a time. */
+
+static long shadow_unset(blk_info far *bp, void far *p, unsigned long off,
+	unsigned long n)
+{
+    unsigned char *sp = bp->shadow, *cp = (unsigned char *)p;
+    unsigned long end;
+    if (sp == NULL || off >= (unsigned long)bp->nbytes)
+    	return -1;
+    if (n > (unsigned long)bp->nbytes - off)
+    	n = (unsigned long)bp->nbytes - off;
+    for (end = off + n; off < end; )
+    {
+    	if ((off % SHADOW_BITS) == 0 && end - off >= SHADOW_BITS
+    		&& *(unsigned long *)(sp + (off>>3)) == ~0UL)
+    	    off += SHADOW_BITS;
+    	else if ((off & 7) == 0 && end - off >= 8 && sp[off>>3] == 0xff)
+    	    off += 8;
+    	else if (!(sp[off>>3] & (1 << (off & 7))) && cp[off] == UNSET)
+    	    return (long)off;
+    	else
+    	    off++;
+    }
+    return -1;
+}
+
+/* n bytes were copied to offset doff of the block at d, from the
+   start of s (whose header is sbp, or NULL if it isn't ours); carry
+   across which of them were written */
+
+static void shadow_copy(blk_info far *dbp, unsigned long doff,
+	blk_info far *sbp, void far *s, unsigned long n)
+{
+    unsigned long i, j;
+    if (dbp->shadow == NULL)
+    	return;
+    if (sbp == NULL || sbp->shadow == NULL || shadow_unset(sbp, s, 0, n) < 0)
+    {
+    	shadow_set(dbp, doff, n);
+    	return;
+    }
+    if (n > (unsigned long)sbp->nbytes)
+    	n = (unsigned long)sbp->nbytes;
+    if (doff >= (unsigned long)dbp->nbytes)
+    	return;
+    if (n > (unsigned long)dbp->nbytes - doff)
+    	n = (unsigned long)dbp->nbytes - doff;
+    /* a bit at a time, backwards if they may overlap */
+    for (i = 0; i < n; i++)
+    {
+    	j = (dbp == sbp && doff > 0) ? n-1-i : i;
+    	if (sbp->shadow[j>>3] & (1 << (j & 7)))
+    	    SHADOW_OR(dbp->shadow[(doff+j)>>3], 1 << ((doff+j) & 7));
+    	else
+    	    SHADOW_AND(dbp->shadow[(doff+j)>>3], ~(1 << ((doff+j) & 7)));
+    }
+}
+
+/* The block at p has been resized from old bytes to n; anything new
+   is uninitialised */
+
+static void shadow_resize(blk_info far *bp, void far *p, unsigned long old,
+	unsigned long n)
+{
+    unsigned char *sp = bp->shadow;
+    if (bp->flags & ISFAR)
+    	return;
+    if (sp == NULL)
+    {
+    	if (n <= old)
+    	    return;
+    	/* all of the old part was initialised */
+    	if ((sp = (unsigned char *)calloc(SHADOW_BYTES(n), 1)) == NULL)
+    	    return;
+    	bp->shadow = sp;
+    	bp->nbytes = (long)old;
+    	shadow_set(bp, 0, old);
+    	bp->nbytes = (long)n;
+    }
+    else if (SHADOW_BYTES(n) != SHADOW_BYTES(old))
+    {
+    	if ((sp = (unsigned char *)realloc(sp, SHADOW_BYTES(n))) == NULL)
+    	{
+    	    free(bp->shadow);
+    	    bp->shadow = NULL;
+    	    return;
+    	}
+    	bp->shadow = sp;
+    }
+    if (n > old)
+    {
+    	if (old & 7)
+    	    sp[old>>3] &= (unsigned char)((1 << (old & 7)) - 1);
+    	if (SHADOW_BYTES(n) > SHADOW_BYTES(old))
+    	    memset(sp + SHADOW_BYTES(old), 0,
+    	    	SHADOW_BYTES(n) - SHADOW_BYTES(old));
+    	memset((char *)p + old, UNSET, (size_t)(n - old));
+    }
+}
+
+static void shadow_drop(blk_info far *bp)
+{
+    if (bp->shadow)
+    	free(bp->shadow);
+    bp->shadow = NULL;
+}
+
+#endif /* GW_SHADOW */
+
+/********************/
+/* Live block index */
+/********************/
+
+static unsigned long index_hash(void far *p)
+{
+    unsigned long h = (unsigned long)(char huge *)p;
+    h = (h >> 3) * 2654435761UL;
+    return h ^ (h >> 15);
+}
+
+static void index_grow(heap_shard *sh)
+{
+    void far **old = sh->index;
+    unsigned long i, oldsize = sh->index_size, mask;
+    sh->index_size = oldsize ? (oldsize * 2) : INDEX_INIT_SIZE;
+    sh->index = (void far **)calloc((size_t)sh->index_size, sizeof(void far *));
+    assert(sh->index);
+    mask = sh->index_size-1;
+    for (i = 0; i < oldsize; i++)
+    {
+    	if (old[i])
+    	{
+    	    unsigned long j = index_hash(old[i]) & mask;
+    	    while (sh->index[j])
+    	    	j = (j+1) & mask;
+    	    sh->index[j] = old[i];
+    	}
+    }
+    if (old) SYS_FREE(old); /* the shard is locked */
+}
+
+static void index_insert(heap_shard *sh, void far *p)
+{
+    unsigned long i;
+    if ((sh->index_used+1)*2 > sh->index_size)
+    	index_grow(sh);
+    i = index_hash(p) & (sh->index_size-1);
+    while (sh->index[i])
+    	i = (i+1) & (sh->index_size-1);
+    sh->index[i] = p;
+    sh->index_used++;
+}
+
+/* Return the slot holding p, or -1 if p is not a live block */
+
+static long index_find(heap_shard *sh, void far *p)
+{
+    unsigned long i;
+    if (sh->index_size == 0) return -1;
+    i = index_hash(p) & (sh->index_size-1);
+    while (sh->index[i])
+    {
+    	if ((void huge *)sh->index[i] == (void huge *)p)
+    	    return (long)i;
+    	i = (i+1) & (sh->index_size-1);
+    }
+    return -1;
+}
+
+static void index_remove(heap_shard *sh, unsigned long i)
+{
+    unsigned long j = i, mask = sh->index_size-1;
+    for (;;)
+    {
+    	unsigned long k;
+    	j = (j+1) & mask;
+    	if (sh->index[j] == NULL) break;
+    	/* can the entry at j move back to the hole at i? It can
+    	   unless its home slot lies cyclically in (i, j] */
+    	k = index_hash(sh->index[j]) & mask;
+    	if ((j > i) ? (k <= i || k > j) : (k <= i && k > j))
+    	{
+    	    sh->index[i] = sh->index[j];
+    	    i = j;
+    	}
+    }
+    sh->index[i] = NULL;
+    sh->index_used--;
+}
+
+/* Take the block at p out of its shard's chain and index (slot is
+   where index_find found it); the shard is locked */
+
+static void unlink_block(heap_shard *sh, void far *p, long slot)
+{
+    blk_info far *bp = GET_BLK(p);
+    if (bp->prev == NULL)
+    	sh->list_head = bp->next;
+    else
+    	(GET_BLK(bp->prev))->next = bp->next;
+    if (bp->next)
+    	(GET_BLK(bp->next))->prev = bp->prev;
+    index_remove(sh, (unsigned long)slot);
+}
+
+/* Put an unlinked block back, behind any newer ones, as the chain
+   is kept newest first; the shard is locked */
+
+static void relink_block(heap_shard *sh, void far *p)
+{
+    blk_info far *bp = GET_BLK(p);
+    void far *prev = NULL, far *next = sh->list_head;
+    while (next && (GET_BLK(next))->seq > bp->seq)
+    {
+    	prev = next;
+    	next = (GET_BLK(next))->next;
+    }
+    bp->prev = prev;
+    bp->next = next;
+    if (prev)
+    	(GET_BLK(prev))->next = p;
+    else
+    	sh->list_head = p;
+    if (next)
+    	(GET_BLK(next))->prev = p;
+    index_insert(sh, p);
+}
+
+/* Of the blocks p[] points at, one for each shard (all locked), take
+   the newest, moving its shard's pointer on; NULL once all are done */
+
+static blk_info far *take_newest(void far **p)
+{
+    blk_info far *bp = NULL;
+    int s, best = -1;
+    for (s = 0; s < GW_SHARDS; s++)
+    {
+    	if (p[s] && (best < 0 || (GET_BLK(p[s]))->seq > bp->seq))
+    	{
+    	    best = s;
+    	    bp = GET_BLK(p[s]);
+    	}
+    }
+    if (best >= 0)
+    	p[best] = bp->next;
+    return bp;
+}
+
+#if defined(GW_BINARY_LOG) && !defined(GW_BINARY_TRACE)
+
+/* Write out the live blocks, newest first, for gwdecode to report */
+
+static void log_live_blocks(void)
+{
+    void far *p[GW_SHARDS];
+    blk_info far *bp;
+    int s;
+    for (s = 0; s < GW_SHARDS; s++)
+    {
+    	GW_LOCK(heap_shards[s].lock);
+    	p[s] = heap_shards[s].list_head;
+    }
+    while ((bp = take_newest(p)) != NULL)
+    	log_trace(GW_E_ALLOC, NULL, GET_DATA(bp), (long)bp->nbytes,
+    		(long)WEIGHT_OF(bp), SITE_FILE(bp->site), SITE_LINE(bp->site));
+    for (s = GW_SHARDS; s--; )
+    	GW_UNLOCK(heap_shards[s].lock);
+}
+
+#endif
+
+void my_memory_report(int is_last)
+{
+    void far *p[GW_SHARDS];
+    blk_info far *bp;
+    int s, done_heading = 0;
+#ifdef GW_BINARY_LOG
+    if (!logfile) my_initialise();
+#ifndef GW_BINARY_TRACE
+    log_live_blocks();
+#endif
+    /* gwdecode knows what is allocated at this point */
+    log_event(GW_E_REPORT, NULL, NULL, 0, NULL, 0, (long)is_last, 0);
+    return;
+#endif
+    for (s = 0; s < GW_SHARDS; s++)
+    {
+    	GW_LOCK(heap_shards[s].lock);
+    	p[s] = heap_shards[s].list_head;
+    }
+    /* walk dat list... merging the shards newest first */
+    while ((bp = take_newest(p)) != NULL)
+    {
+    	if (!done_heading)
+    	{
+    	    done_heading = 1;
+    	    fprintf(logfile,is_last ? "MEMORY LEAKS:\n" : "Allocated Memory Blocks:\n");
+    	}
+#if __MSDOS__
+    	fprintf(logfile,"\t%s Size %8ld File %16s Line %d\n",
+    		(bp->flags&ISFAR)?"(Far) ":"Near",
+		bp->nbytes, SITE_FILE(bp->site), SITE_LINE(bp->site));
+#elif defined(GW_SAMPLE)
+    	{
+    	    unsigned long c, b;
+    	    ESTIMATE((unsigned long)bp->nbytes, WEIGHT_OF(bp), c, b);
+    	    fprintf(logfile,"\tSize %8ld File %16s Line %d (about %lu blocks, %lu bytes)\n",
+    		    bp->nbytes, SITE_FILE(bp->site), SITE_LINE(bp->site), WHOLE(c), b);
+    	}
+#else
+    	fprintf(logfile,"\tSize %8ld File %16s Line %d\n",
+    		bp->nbytes, SITE_FILE(bp->site), SITE_LINE(bp->site));
+#endif
+    }
+    for (s = GW_SHARDS; s--; )
+    	GW_UNLOCK(heap_shards[s].lock);
+}
+
+#ifdef GW_STACKS
+
+/* The live blocks totalled by the stack they were allocated on */
+
+typedef struct
+{
+    stack_id	stack;
+    site_id	site;	/* of the first block seen */
+    unsigned long blocks;
+    unsigned long bytes;
+} stack_total;
+
+static int by_stack_bytes(const void *a, const void *b)
+{
+    const stack_total *x = (const stack_total *)a;
+    const stack_total *y = (const stack_total *)b;
+    if (x->bytes != y->bytes)
+    	return (x->bytes < y->bytes) ? 1 : -1;
+    if (x->blocks != y->blocks)
+    	return (x->blocks < y->blocks) ? 1 : -1;
+    return (x->stack > y->stack) - (x->stack < y->stack);
+}
+
+/* The live blocks totalled by stack, most bytes first, in a malloced
+   array of *n; NULL if there are none */
+
+static stack_total *stack_totals(unsigned long *n)
+{
+    stack_total *t;
+    unsigned long nstacks, i, used = 0;
+    int s;
+    *n = 0;
+    nstacks = (unsigned long)LOAD_ACQ(next_stack);
+    t = (stack_total *)calloc((size_t)nstacks, sizeof(stack_total));
+    if (t == NULL)
+    	return NULL;
+    for (s = 0; s < GW_SHARDS; s++)
+    {
+    	void far *p;
+    	GW_LOCK(heap_shards[s].lock);
+    	for (p = heap_shards[s].list_head; p; p = (GET_BLK(p))->next)
+    	{
+    	    blk_info far *bp = GET_BLK(p);
+    	    unsigned long c, b;
+    	    stack_id id = bp->stack < nstacks ? bp->stack : 0;
+    	    ESTIMATE((unsigned long)bp->nbytes, WEIGHT_OF(bp), c, b);
+    	    if (t[id].blocks == 0)
+    		t[id].site = bp->site;
+    	    t[id].blocks += c;
+    	    t[id].bytes += b;
+    	}
+    	GW_UNLOCK(heap_shards[s].lock);
+    }
+    for (i = 0; i < nstacks; i++)
+    	if (t[i].blocks)
+    	{
+    	    t[used] = t[i];
+    	    t[used++].stack = (stack_id)i;
+    	}
+    if (used == 0)
+    {
+    	free(t);
+    	return NULL;
+    }
+    qsort(t, (size_t)used, sizeof(stack_total), by_stack_bytes);
+    *n = used;
+    return t;
+}
+
+#ifdef GW_BINARY_LOG
+
+/* gwdecode can't look up symbols in our process, so the stacks go
+   into the binary log with their frames already named */
+
+static void log_stacks(void)
+{
+    unsigned long i, n;
+    stack_total *t = stack_totals(&n);
+    int k, depth;
+    log_trace(GW_E_STACKS, NULL, NULL, (long)n, 0, NULL, 0);
+    for (i = 0; i < n; i++)
+    {
+    	depth = t[i].stack ? stack_of(t[i].stack)->depth : 0;
+    	log_trace(GW_E_STACK, NULL, NULL, (long)t[i].bytes, (long)t[i].blocks,
+    		SITE_FILE(t[i].site), SITE_LINE(t[i].site));
+    	for (k = 0; k < depth; k++)
+    	    log_trace(GW_E_FRAME, store_name(symbolize(stack_of(t[i].stack)->pc[k])),
+    		    stack_of(t[i].stack)->pc[k], 0, 0, NULL, k);
+    }
+    free(t);
+}
+
+#else
+
+static void my_stack_report(FILE *fp)
+{
+    unsigned long i, n;
+    stack_total *t = stack_totals(&n);
+    int k;
+    if (n)
+    {
+    	fprintf(fp,"LEAKS BY STACK (%lu stacks):\n", n);
+    	for (i = 0; i < n; i++)
+    	{
+    	    fprintf(fp,"\tBytes %10lu Blocks %8lu File %16s Line %d\n",
+    		    t[i].bytes, WHOLE(t[i].blocks),
+    		    SITE_FILE(t[i].site), SITE_LINE(t[i].site));
+    	    if (t[i].stack == 0)
+    		fprintf(fp,"\t\t(no stack)\n");
+    	    else
+    		for (k = 0; k < stack_of(t[i].stack)->depth; k++)
+    		    fprintf(fp,"\t\t#%-2d %p %s\n", k, stack_of(t[i].stack)->pc[k],
+    			    symbolize(stack_of(t[i].stack)->pc[k]));
+    	}
+    }
+    free(t);
+}
+
+#endif /* GW_BINARY_LOG */
+
+#endif /* GW_STACKS */
+
+/* Record a new block; weight is what it stands for under GW_SAMPLE
+   (see ESTIMATE), or 0 to weigh it by its size */
+
+static void log_alloc(void far *rtn, unsigned long n,
+	char *f, int l, unsigned flags, unsigned long weight)
+{
+    blk_info far *bp = (blk_info far *)rtn;
+    heap_shard *sh;
+    thread_counts *tc;
+    unsigned long c, b;
+    assert(rtn);
+    if (!logfile) my_initialise();
+    /* Get the pointer that is returned to the user */
+    rtn = GET_DATA(rtn);
+    /* Save the size information */
+    bp->nbytes = n;
+    /* Save where from, and put in bounding magic markers */
+    bp->site = store_site(f, l);
+#ifdef GW_SAMPLE
+    bp->weight = weight ? weight : size_weight(n);
+#else
+    (void)weight;
+#endif
+    ESTIMATE(n, WEIGHT_OF(bp), c, b);
+    count_site_alloc(site_of(bp->site), c, b);
+    bp->magic = MAGIC;
+    bp->flags = flags;
+#ifdef GW_STACKS
+    bp->stack = this_stack();
+#endif
+    if (HAS_ENDMAGIC(bp, rtn))
+    	SET_ENDMAGIC(rtn, n);
+    tc = my_counts();
+    tc->allocs += c;
+    tc->bytes_allocated += b;
+    /* Prepend to front of the shard's heap list */
+    sh = shard_of(rtn);
+    GW_LOCK(sh->lock);
+    bp->seq = (sh->seq > thread_seq ? sh->seq : thread_seq) + 1;
+    sh->seq = thread_seq = bp->seq;
+    bp->next = sh->list_head;
+    bp->prev = NULL;
+    if (sh->list_head)
+    	(GET_BLK(sh->list_head))->prev = rtn;
+    sh->list_head = rtn;
+    index_insert(sh, rtn);
+    GW_UNLOCK(sh->lock);
+#ifdef GW_SAMPLE
+    GW_ATOMIC_INC(FILTER_SLOT(rtn));
+#endif
+#ifdef GW_BINARY_TRACE
+    log_trace(GW_E_ALLOC, NULL, rtn, (long)n, (long)WEIGHT_OF(bp),
+    	    SITE_FILE(bp->site), l);
+#endif
+}
+
+static void *track_calloc(unsigned n, char *f, int l, unsigned long weight)
+{
+    /* Allocate the memory with space enough for our info */
+    void *rtn;
+#ifdef GW_GUARD
+    if ((rtn = guard_alloc((unsigned long)n)) != NULL)
+    {
+    	log_alloc((void far *)rtn, (unsigned long)n, f, l, ISGUARD, weight);
+    	return GET_DATA(rtn);
+    }
+#endif
+    rtn = calloc(BUMPSIZE(n), 1);
+    log_alloc((void far *)rtn, (unsigned long)n, f, l, 0, weight);
+#if defined(__TINY__) || defined(__SMALL__) || defined(__MEDIUM__)
+    return ((char *)rtn)+sizeof(blk_info);
+#else
+    return GET_DATA(rtn);
+#endif
+}
+
+void *my_calloc(unsigned n, char *f, int l)
+{
+    STACK_ENTRY;
+#ifdef GW_SAMPLE
+    if (!sample_this((unsigned long)n))
+    	return calloc(n, 1);
+#endif
+    return track_calloc(n,f,l,0);
+}
+
+void *my_malloc(unsigned n, char *f, int l)
+{
+    void *rtn;
+    STACK_ENTRY;
+#ifdef GW_SAMPLE
+    if (!sample_this((unsigned long)n))
+    	return malloc(n);
+#endif
+    rtn = track_calloc(n,f,l,0);
+#ifdef GW_SHADOW
+    shadow_new(GET_BLK(rtn), rtn, (unsigned long)n);
+#else
+    if (n >= sizeof(long))
+        *((unsigned long *)rtn) = MAGIC; /* mark as unitialised */
+#endif
+    return rtn;
+}
+
+static int log_free(void huge *p, char *f, int l, int isfar)
+{
+    long slot;
+    blk_info far *bp = NULL;
+    heap_shard *sh;
+    if (!logfile) my_initialise();
+#ifdef GW_SAMPLE
+    if (p && !isfar && FILTER_SLOT(p) == 0)
+    	return 2; /* not sampled */
+#endif
+    /* Look the block up in its shard's index */
+    sh = shard_of(p);
+    GW_LOCK(sh->lock);
+    slot = index_find(sh, p);
+    if (slot >= 0)
+    {
+    	thread_counts *tc;
+    	unsigned long c, b;
+    	bp = GET_BLK(p);
+    	if (bp->magic != MAGIC)
+    	{
+    	    GW_UNLOCK(sh->lock);
+    	    goto error;
+    	}
+    	if (HAS_ENDMAGIC(bp, p) && !TST_ENDMAGIC(p, bp->nbytes))
+    	    log_event(GW_E_OVERRUN_FREE, NULL, f, l,
+    		    SITE_FILE(bp->site), SITE_LINE(bp->site), bp->nbytes, 0);
+	if (((bp->flags&ISFAR)!=0) ^ isfar)
+    	    log_event(GW_E_WRONG_FREE, NULL, f, l, NULL, 0, 0, 0);
+    	unlink_block(sh, p, slot);
+    	GW_UNLOCK(sh->lock);
+#ifdef GW_SAMPLE
+    	GW_ATOMIC_SUB(FILTER_SLOT(p), 1);
+#endif
+    	ESTIMATE((unsigned long)bp->nbytes, WEIGHT_OF(bp), c, b);
+    	tc = my_counts();
+    	tc->frees += c;
+    	tc->bytes_freed += b;
+    	count_site_free(site_of(bp->site), c, b);
+#ifdef GW_SHADOW
+    	shadow_drop(bp);
+#endif
+    	/* save who freed */
+    	FREED_BY(bp) = store_site(f, l);
+#ifdef GW_BINARY_TRACE
+    	log_trace(GW_E_FREE, NULL, p, bp->nbytes, 0, SITE_FILE(FREED_BY(bp)), l);
+#endif
+    	/* trash contents */
+	if (bp->nbytes >= sizeof(long))
+            *((unsigned long far *)GET_DATA(bp)) = MAGIC;
+	return (((bp->flags&ISFAR)!=0) ^ isfar);
+    }
+    GW_UNLOCK(sh->lock);
+#ifdef GW_UNTRACKED
+    /* not sampled, or not from us; the caller frees it as it is */
+    if (p && !isfar) return 2;
+#endif
+    bp = GET_BLK(p);
+error:
+    log_event(GW_E_BAD_FREE, NULL, f, l, NULL, 0, 0, 0);
+/*#if __MSDOS__*/
+    /* Causes seg violation on UNIX */
+#ifdef GW_GUARD
+    if (bp && !page_mapped(bp))
+    	bp = NULL;
+#endif
+    if (bp && bp->magic==MAGIC)
+    	log_event(GW_E_FREED_BEFORE, NULL, f, l,
+    		SITE_FILE(FREED_BY(bp)), SITE_LINE(FREED_BY(bp)), bp->nbytes, 0);
+/*#endif*/
+    return -1;
+}
+
+/* Give a block back to whichever allocator it came from */
+
+static void release_block(void far *p)
+{
+#ifdef GW_GUARD
+    if ((GET_BLK(p))->flags & ISGUARD)
+    {
+    	guard_free(GET_BLK(p));
+    	return;
+    }
+#endif
+#if __MSDOS__
+    if ((GET_BLK(p))->flags & ISFAR)
+    {
+    	farfree(GET_BLK(p));
+    	return;
+    }
+#endif
+#if defined(__TINY__) || defined(__SMALL__) || defined(__MEDIUM__)
+    free(((char *)p) - sizeof(blk_info));
+#else
+    SYS_FREE(GET_BLK(p));
+#endif
+}
+
+/**************/
+/* Quarantine */
+/**************/
+
+/* Freed blocks wait here, poisoned, in a FIFO chained through their
+   headers' next fields, until more than GW_QUARANTINE bytes are
+   waiting; the oldest are then checked and released. */
+
+#ifdef GW_QUARANTINE
+
+#define POISON	0xdb
+
+static void far *q_head = NULL;
+static void far *q_tail = NULL;
+static unsigned long q_bytes = 0;
+
+static void poison(void far *p, long n)
+{
+#if __MSDOS__
+    char huge *cp = (char huge *)p;
+    while (n-- > 0)
+    	*cp++ = (char)POISON;
+#else
+    memset(p, POISON, (size_t)n);
+#endif
+}
+
+/* Returns the offset of the first byte that isn't poison, or -1 */
+
+static long poisoned(void far *p, long n)
+{
+    unsigned char huge *cp = (unsigned char huge *)p;
+    long i = 0;
+#if !__MSDOS__
+    unsigned long pat;
+    memset(&pat, POISON, sizeof(pat));
+    for (; i + (long)sizeof(long) <= n; i += sizeof(long))
+    	if (*(unsigned long *)(cp + i) != pat)
+    	    break;
+#endif
+    for (; i < n; i++)
+    	if (cp[i] != POISON)
+    	    return i;
+    return -1;
+}
+
+/* Check and release a chain of blocks taken off the quarantine */
+
+static void release_quarantined(void far *p)
+{
+    while (p)
+    {
+    	blk_info far *bp = GET_BLK(p);
+    	void far *next = bp->next;
+    	long i = poisoned(p, bp->nbytes);
+    	if (i >= 0)
+    	    log_event(GW_E_FREED_WRITE, NULL,
+    		    SITE_FILE(bp->freed_by), SITE_LINE(bp->freed_by),
+    		    SITE_FILE(bp->site), SITE_LINE(bp->site), bp->nbytes, i);
+    	release_block(p);
+    	p = next;
+    }
+}
+
+static void quarantine(void far *p)
+{
+    blk_info far *bp = GET_BLK(p);
+    void far *out = NULL, far *last = NULL;
+    poison(p, bp->nbytes);
+    GW_LOCK(q_lock);
+    bp->next = NULL;
+    if (q_tail)
+    	(GET_BLK(q_tail))->next = p;
+    else
+    	q_head = p;
+    q_tail = p;
+    q_bytes += bp->nbytes;
+    /* Unhook the oldest until we're within budget */
+    while (q_bytes > GW_QUARANTINE)
+    {
+    	void far *old = q_head;
+    	q_head = (GET_BLK(old))->next;
+    	if (q_head == NULL)
+    	    q_tail = NULL;
+    	q_bytes -= (GET_BLK(old))->nbytes;
+    	(GET_BLK(old))->next = NULL;
+    	if (last)
+    	    (GET_BLK(last))->next = old;
+    	else
+    	    out = old;
+    	last = old;
+    }
+    GW_UNLOCK(q_lock);
+    release_quarantined(out);
+}
+
+/* Check everything still held; called at the end */
+
+static void flush_quarantine(void)
+{
+    void far *p;
+    GW_LOCK(q_lock);
+    p = q_head;
+    q_head = q_tail = NULL;
+    q_bytes = 0;
+    GW_UNLOCK(q_lock);
+    release_quarantined(p);
+}
+
+#define FREE_BLOCK(p)	quarantine(p)
+#else
+#define FREE_BLOCK(p)	release_block(p)
+#endif /* GW_QUARANTINE */
+
+/***************/
+/* Heap sweeps */
+/***************/
+
+/* gw_sweep checks live blocks' headers and end markers. Each call
+   carries on from where the last left off, going through a shard's
+   index a batch of slots at a time with only that shard locked, so
+   the program is never held up for long. It stops at the end of the
+   last shard or once the budget (in microseconds; 0 for none) is
+   spent, and returns how many bad blocks it found. Each is reported
+   once: its header is marked, or, if that is what was overwritten,
+   given a magic number of its own. */
+
+#ifndef SWEEP_BATCH
+#define SWEEP_BATCH	64	/* index slots per lock */
+#endif
+
+static int sweep_shard = 0;
+static unsigned long sweep_slot = 0;
+static int sweep_off = 0;	/* set once the log is closed */
+
+static int sweep_block(void far *p)
+{
+    blk_info far *bp = GET_BLK(p);
+    if (bp->magic == SWEPT_MAGIC)
+    	return 0;
+    if (bp->magic != MAGIC)
+    {
+    	log_event(GW_E_SWEEP_HEADER, NULL, NULL, 0, NULL, 0,
+    		(long)(char huge *)p, 0);
+    	bp->magic = SWEPT_MAGIC;
+    	return 1;
+    }
+    if (!(bp->flags & ISSWEPT) && HAS_ENDMAGIC(bp, p)
+    	    && !TST_ENDMAGIC(p, bp->nbytes))
+    {
+    	log_event(GW_E_SWEEP_OVERRUN, NULL, NULL, 0,
+    		SITE_FILE(bp->site), SITE_LINE(bp->site), bp->nbytes, 0);
+    	bp->flags |= ISSWEPT;
+    	return 1;
+    }
+    return 0;
+}
+
+unsigned long gw_sweep(unsigned long budget)
+{
+    unsigned long start, bad = 0;
+    if (!logfile) my_initialise();
+    GW_LOCK(sweep_lock);
+    start = gw_usec();
+    while (!sweep_off)
+    {
+    	heap_shard *sh = &heap_shards[sweep_shard];
+    	unsigned long i, end;
+    	GW_LOCK(sh->lock);
+    	end = sweep_slot + SWEEP_BATCH;
+    	if (end > sh->index_size)
+    	    end = sh->index_size;
+    	for (i = sweep_slot; i < end; i++)
+    	    if (sh->index[i])
+    	    	bad += sweep_block(sh->index[i]);
+    	GW_UNLOCK(sh->lock);
+    	sweep_slot = end;
+    	if (end >= sh->index_size)
+    	{
+    	    /* on to the next shard; after the last, we're done */
+    	    sweep_slot = 0;
+    	    if (++sweep_shard == GW_SHARDS)
+    	    {
+    		sweep_shard = 0;
+    		break;
+    	    }
+    	}
+    	if (budget && gw_usec() - start >= budget)
+    	    break;
+    }
+    GW_UNLOCK(sweep_lock);
+    return bad;
+}
+
+#if defined(GW_SWEEP) && defined(GW_THREADS)
+
+#ifndef GW_SWEEP_BUDGET
+#define GW_SWEEP_BUDGET	1000	/* microseconds per sweep */
+#endif
+
+static void *sweeper_main(void *arg)
+{
+    struct timespec ts;
+    GW_ENTER; /* for good */
+    ts.tv_sec = GW_SWEEP / 1000;
+    ts.tv_nsec = (GW_SWEEP % 1000) * 1000000L;
+    for (;;)
+    {
+    	nanosleep(&ts, NULL);
+    	gw_sweep(GW_SWEEP_BUDGET);
+    }
+    return arg;
+}
+
+#endif
+
+void my_free(void *p, char *f, int l)
+{
+    int rtn = log_free((void far *)p, f, l, 0);
+    if (rtn == 0)
+    	FREE_BLOCK((void far *)p);
+#ifdef GW_UNTRACKED
+    else if (rtn == 2)
+    	free(p);
+#endif
+}
+
+#if __MSDOS__
+void far *my_fcalloc(unsigned long n, char *f, int l)
+{
+    /* Allocate the memory with space enough for our info */
+    void far *rtn = farcalloc(BUMPSIZE(n), 1l);
+    log_alloc(rtn, n, f, l, ISFAR, 0);
+    return GET_DATA(rtn);
+}
+
+void far *my_fmalloc(unsigned long n, char *f, int l)
+{
+    void far *rtn = my_fcalloc(n,f,l);
+    if (n >= sizeof(long))
+	*((unsigned long far *)rtn) = MAGIC; /* mark as unitialised */
+    return rtn;
+}
+
+void my_ffree(void far *p, char *f, int l)
+{
+    if (log_free(p, f, l, 1) == 0)
+	FREE_BLOCK(p);
+}
+#endif
+
+static blk_info far *my_find_block(void far *p)
+{
+#ifdef __MSDOS__
+    blk_info far *bp = GET_BLK(p);
+    return (bp->magic==MAGIC) ? bp : NULL;
+#else
+    /* We don't just check for the magic number under UNIX as
+    	this can cause a segmentation violation */
+    heap_shard *sh = shard_of(p);
+    long slot;
+    GW_LOCK(sh->lock);
+    slot = index_find(sh, p);
+    GW_UNLOCK(sh->lock);
+    return (slot >= 0) ? GET_BLK(p) : NULL;
+#endif
+}
+
+static int my_sizehint(void far *p, int size)
+{
+    blk_info far *bp;
+    if (p == NULL) return -1;
+    bp = my_find_block(p);
+    if (bp)
+    {
+    	assert(size == sizeof(char *));
+    	return (int)(bp->nbytes);
+    }
+    else if (size == sizeof(char *))
+    	return -1; /* no clues */
+    else return size;
+}
+
+/*****************************/
+/* String function debugging */
+/*****************************/
+
+/* Every wrapper finds string ends and characters with scan_byte(),
+   which returns the offset of the first byte equal to c among the n
+   at p, or n if there is none. Pass (size_t)-1 for no bound.
+   copy_str() is the same for a NUL, but copies what it passes over,
+   the NUL included, to d. The vector versions read whole aligned
+   blocks, which never reach into a page the string doesn't touch,
+   but only report a match or copy within the bound. */
+
+static size_t scan_word(const unsigned char far *p, int c, size_t n)
+{
+    size_t i = 0;
+#if !__MSDOS__
+    /* a word at a time, looking for a zero byte in word^pattern */
+    unsigned long ones = ~0UL / 255, pat = ones * (unsigned char)c, w;
+    for (; i < n && ((unsigned long)(p + i) & (sizeof(long)-1)); i++)
+    	if (p[i] == (unsigned char)c)
+    	    return i;
+    for (; n - i >= sizeof(long); i += sizeof(long))
+    {
+    	w = *(const unsigned long *)(p + i) ^ pat;
+    	if ((w - ones) & ~w & (ones << 7))
+    	    break;
+    }
+#endif
+    for (; i < n; i++)
+    	if (p[i] == (unsigned char)c)
+    	    return i;
+    return n;
+}
+
+static size_t copy_word(char far *d, const char far *s, size_t n)
+{
+    size_t i = 0;
+#if !__MSDOS__
+    unsigned long ones = ~0UL / 255, w;
+    for (; i < n && ((unsigned long)(s + i) & (sizeof(long)-1)); i++)
+    	if ((d[i] = s[i]) == 0)
+    	    return i;
+    for (; n - i >= sizeof(long); i += sizeof(long))
+    {
+    	w = *(const unsigned long *)(s + i);
+    	if ((w - ones) & ~w & (ones << 7))
+    	    break;
+    	memcpy(d + i, &w, sizeof(long)); /* d needn't be aligned */
+    }
+#endif
+    for (; i < n; i++)
+    	if ((d[i] = s[i]) == 0)
+    	    return i;
+    return n;
+}
+
+#ifdef GW_SIMD
+
+static size_t scan_sse2(const unsigned char *p, int c, size_t n)
+{
+    __m128i pat = _mm_set1_epi8((char)c);
+    size_t mis = (unsigned long)p & 15, off;
+    const __m128i *q = (const __m128i *)(p - mis);
+    unsigned mask;
+    if (n == 0)
+    	return 0;
+    mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(q), pat)) >> mis;
+    if (mask)
+    	off = __builtin_ctz(mask);
+    else for (off = 16 - mis; off < n; off += 16)
+    {
+    	mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(++q), pat));
+    	if (mask)
+    	{
+    	    off += __builtin_ctz(mask);
+    	    break;
+    	}
+    }
+    return off < n ? off : n;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const unsigned char *p, int c, size_t n)
+{
+    __m256i pat = _mm256_set1_epi8((char)c);
+    size_t mis = (unsigned long)p & 31, off;
+    const __m256i *q = (const __m256i *)(p - mis);
+    unsigned mask;
+    if (n == 0)
+    	return 0;
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(q), pat)) >> mis;
+    if (mask)
+    	off = __builtin_ctz(mask);
+    else for (off = 32 - mis; off < n; off += 32)
+    {
+    	mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(++q), pat));
+    	if (mask)
+    	{
+    	    off += __builtin_ctz(mask);
+    	    break;
+    	}
+    }
+    return off < n ? off : n;
+}
+
+/* Copy n <= 32 bytes with a pair of overlapping moves, all loads
+   first so that it is as safe as memmove when d < s */
+
+static __inline__ __attribute__((always_inline))
+void copy_short(char *d, const char *s, size_t n)
+{
+    if (n >= 16)
+    {
+    	__m128i a = _mm_loadu_si128((const __m128i *)s);
+    	__m128i b = _mm_loadu_si128((const __m128i *)(s + n - 16));
+    	_mm_storeu_si128((__m128i *)d, a);
+    	_mm_storeu_si128((__m128i *)(d + n - 16), b);
+    }
+    else if (n >= 8)
+    {
+    	unsigned long a, b;
+    	memcpy(&a, s, 8);
+    	memcpy(&b, s + n - 8, 8);
+    	memcpy(d, &a, 8);
+    	memcpy(d + n - 8, &b, 8);
+    }
+    else if (n >= 4)
+    {
+    	unsigned a, b;
+    	memcpy(&a, s, 4);
+    	memcpy(&b, s + n - 4, 4);
+    	memcpy(d, &a, 4);
+    	memcpy(d + n - 4, &b, 4);
+    }
+    else
+    {
+    	char a[3];
+    	size_t i;
+    	for (i = 0; i < n; i++)
+    	    a[i] = s[i];
+    	for (i = 0; i < n; i++)
+    	    d[i] = a[i];
+    }
+}
+
+/* The block holding s is looked at whole, the part before s masked
+   off; after that the copy goes a block at a time until the one with
+   the NUL, or the bound, and the rest is moved. Stores needn't be
+   aligned, and as the source is read ahead of them they can't
+   overwrite it before it is read unless d > s. */
+
+static size_t copy_sse2(char *d, const char *s, size_t n)
+{
+    __m128i zero = _mm_setzero_si128(), v, w;
+    size_t mis = (unsigned long)s & 15, i = 16 - mis, k;
+    unsigned mask;
+    if (n == 0)
+    	return 0;
+    mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+    		_mm_load_si128((const __m128i *)(s - mis)), zero)) >> mis;
+    if (mask || i >= n)
+    	i = 0;
+    else
+    {
+    	copy_short(d, s, i);
+    	/* two blocks at a time while neither has a zero byte */
+    	for (; n - i >= 32; i += 32)
+    	{
+    	    v = _mm_load_si128((const __m128i *)(s + i));
+    	    w = _mm_load_si128((const __m128i *)(s + i + 16));
+    	    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, w), zero)))
+    		break;
+    	    _mm_storeu_si128((__m128i *)(d + i), v);
+    	    _mm_storeu_si128((__m128i *)(d + i + 16), w);
+    	}
+    	for (; n - i >= 16; i += 16)
+    	{
+    	    v = _mm_load_si128((const __m128i *)(s + i));
+    	    if ((mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) != 0)
+    		break;
+    	    _mm_storeu_si128((__m128i *)(d + i), v);
+    	}
+    }
+    k = mask ? i + __builtin_ctz(mask) : n;
+    if (k >= n)
+    {
+    	/* no NUL here; the rest of the block may hold one, past n */
+    	k = i + scan_word((const unsigned char *)s + i, 0, n - i);
+    	memmove(d + i, s + i, (k < n ? k+1 : n) - i);
+    	return k;
+    }
+    copy_short(d + i, s + i, k+1 - i);
+    return k;
+}
+
+__attribute__((target("avx2")))
+static size_t copy_avx2(char *d, const char *s, size_t n)
+{
+    __m256i zero = _mm256_setzero_si256(), v, w;
+    size_t mis = (unsigned long)s & 31, i = 32 - mis, k;
+    unsigned mask;
+    if (n == 0)
+    	return 0;
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+    		_mm256_load_si256((const __m256i *)(s - mis)), zero)) >> mis;
+    if (mask || i >= n)
+    	i = 0;
+    else
+    {
+    	copy_short(d, s, i);
+    	for (; n - i >= 64; i += 64)
+    	{
+    	    v = _mm256_load_si256((const __m256i *)(s + i));
+    	    w = _mm256_load_si256((const __m256i *)(s + i + 32));
+    	    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, w), zero)))
+    		break;
+    	    _mm256_storeu_si256((__m256i *)(d + i), v);
+    	    _mm256_storeu_si256((__m256i *)(d + i + 32), w);
+    	}
+    	for (; n - i >= 32; i += 32)
+    	{
+    	    v = _mm256_load_si256((const __m256i *)(s + i));
+    	    if ((mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) != 0)
+    		break;
+    	    _mm256_storeu_si256((__m256i *)(d + i), v);
+    	}
+    }
+    k = mask ? i + __builtin_ctz(mask) : n;
+    if (k >= n)
+    {
+    	k = i + scan_word((const unsigned char *)s + i, 0, n - i);
+    	memmove(d + i, s + i, (k < n ? k+1 : n) - i);
+    	return k;
+    }
+    copy_short(d + i, s + i, k+1 - i);
+    return k;
+}
+
+/* Until my_initialise picks the versions for this processor, the
+   word-at-a-time ones are used */
+
+static size_t (*scan_fn)(const unsigned char *, int, size_t) = scan_word;
+static size_t (*copy_fn)(char *, const char *, size_t) = copy_word;
+
+static void simd_pick(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+    	scan_fn = scan_avx2;
+    	copy_fn = copy_avx2;
+    }
+    else
+    {
+    	scan_fn = scan_sse2;
+    	copy_fn = copy_sse2;
+    }
+}
+
+#define scan_byte(p,c,n)	scan_fn((const unsigned char *)(p), (c), (n))
+#define copy_str(d,s,n)		copy_fn((d), (s), (n))
+#else
+#define scan_byte(p,c,n)	scan_word((const unsigned char far *)(p), (c), (n))
+#define copy_str(d,s,n)		copy_word((d), (s), (n))
+#endif
+
+/* Length of the string at p, looking no further than n bytes */
+
+#define my_strnlen(p,n)		scan_byte((p), 0, (n))
+
+
+/* flags for additional checks */
+
+#define INIT1	1	/* arg s1 must be initialised */
+#define INIT2	2	/* arg s2 must be initialised */
+#define NULLT	4	/* must be initialised with NUL-terminated strings */
+#define ENDS	8	/* but the caller will find where they end */
+
+/* Validate a single pointer arg. If it is to be a string and its
+   end turns up, its length is left in *len for the caller, so the
+   string needn't be scanned again; otherwise *len is -1. */
+
+static int my_init_check(char far *p, int space, int nul, long *len)
+/* nul: 0 for memory, 1 for a string, 2 for one whose end the caller
+   will find (only a shadow check looks for it here) */
+{
+    blk_info far *bp = my_find_block(p);
+    *len = -1;
+    if (bp)
+    {
+#ifdef GW_SHADOW
+	if (!(bp->flags & ISFAR))
+	{
+	    /* is everything up to the end, or the NUL, initialised? */
+	    unsigned long n = (unsigned long)bp->nbytes;
+	    size_t z;
+	    if (space >= 0 && (unsigned long)space < n)
+		n = (unsigned long)space;
+	    if (nul && (z = my_strnlen(p, (size_t)n)) < n)
+	    {
+		*len = (long)z;
+		n = (unsigned long)z + 1;
+	    }
+	    return shadow_unset(bp, p, 0, n) < 0;
+	}
+#endif
+	if (nul == 1)
+	{
+	    size_t z = my_strnlen(p, (size_t)bp->nbytes);
+	    if (z < (size_t)bp->nbytes)
+		*len = (long)z;
+	}
+	if (bp->nbytes>=sizeof(long) && *((unsigned long *)p)==MAGIC)
+	    return 0;
+	return 1;
+    }
+    else if (space >= 0 && nul == 1)
+    {
+	size_t z = my_strnlen(p, (size_t)space);
+	if (z == (size_t)space)
+	    return 0;
+	*len = (long)z;
+	return 1;
+    }
+    return 1; /* we don't know, so we assume OK */
+}
+
+#ifdef GW_SHADOW
+
+/* n bytes at offset off of p have been written; if s is not NULL
+   they came from there. Blocks are only found by their start, so
+   writes through a pointer into the middle of one go unrecorded;
+   that costs little, as shadow_unset only counts a byte unwritten
+   while it still holds UNSET. A source pointer into the middle of
+   a block is taken as all written. */
+
+static void my_written(void far *p, unsigned long off, void far *s,
+	unsigned long n)
+{
+    blk_info far *bp = my_find_block(p);
+    if (bp && bp->shadow)
+    {
+    	if (s)
+    	    shadow_copy(bp, off, my_find_block(s), s, n);
+    	else
+    	    shadow_set(bp, off, n);
+    }
+}
+
+#define WRITTEN(p,off,s,n)	my_written((p), (unsigned long)(off), (s), (unsigned long)(n))
+#else
+#define WRITTEN(p,off,s,n)	((void)0)
+#endif
+
+static int my_validate1(char *name, char *s, int space, char *f, int l,
+	unsigned flags, long *len)
+{
+    long dummy;
+    if (len == NULL) len = &dummy;
+    *len = -1;
+    if (s==NULL)
+    {
+    	log_event(GW_E_NULL_ARG, name, f, l, NULL, 0, 0, 0);
+        return -1;
+    }
+    else if (flags & INIT1)
+    {
+	if (my_init_check(s, space, (flags&NULLT)!=0, len) == 0)
+	{
+    	    log_event(GW_E_UNINIT_ARG, name, f, l, NULL, 0, 0, 0);
+            return -1;
+	}
+    }
+    return 0;
+}
+
+/* Validate a pair of pointer args; *len2 is as for my_init_check
+   on s2 */
 
 static int my_validate2(char *name, char *s1, int siz1, char *s2,
-	int siz2, char *f, int l, unsigned flags)
+	int siz2, char *f, int l, unsigned flags, long *len2)
+{
+    long len1, dummy;
+    if (len2 == NULL) len2 = &dummy;
+    *len2 = -1;
+    /* Just validate arguments */
+    if (s1==NULL && s2==NULL)
+    	log_event(GW_E_NULL_NULL, name, f, l, NULL, 0, 0, 0);
+    else if (s1==NULL)
+    	log_event(GW_E_NULL_1, name, f, l, NULL, 0, 0, 0);
+    else if (s2==NULL)
+    	log_event(GW_E_NULL_2, name, f, l, NULL, 0, 0, 0);
+    else if ((flags&INIT1) && my_init_check(s1, siz1, (flags&NULLT)!=0, &len1) == 0)
+        log_event(GW_E_INVALID_1, name, f, l, NULL, 0, 0, 0);
+    else if ((flags&INIT2) && my_init_check(s2, siz2,
+		(flags&NULLT) ? ((flags&ENDS) ? 2 : 1) : 0, len2) == 0)
+        log_event(GW_E_INVALID_2, name, f, l, NULL, 0, 0, 0);
+    else return 0;
+    return -1;
+}
+
+/* strcpy, stpcpy or strcat, dlen bytes into d, from a source that
+   can't be overwritten before it is read: find its end, check there
+   is room and copy it, all in one pass */
+
+static char *my_fused_copy(char *d, int dlen, int space_avail, char *s,
+	int sspace, int flag, char *f, int l)
+{
+    size_t avail = space_avail >= 0 ? (size_t)(space_avail-dlen) : (size_t)-1;
+    size_t bound = sspace >= 0 ? (size_t)sspace : (size_t)-1;
+    size_t n = avail < bound ? avail : bound, len, limit;
+    len = copy_str(d+dlen, s, n);
+    if (len < n)
+    {
+    	limit = len+1;
+    	if (space_avail >= 0 && sspace >= 0 && (size_t)sspace > avail)
+    	    log_event(GW_E_COPY_POTENTIAL, NULL, f, l, NULL, 0,
+    		    (long)avail, (long)sspace);
+    }
+    else
+    {
+    	/* out of room, or of source; how long is it? */
+    	if (n < bound)
+    	    len = n + my_strnlen(s+n, bound-n);
+    	if (len == bound)
+    	{
+    	    log_event(GW_E_INVALID_2, "String copy", f, l, NULL, 0, 0, 0);
+    	    return d;
+    	}
+    	log_event(GW_E_COPY_OVERRUN, NULL, f, l, NULL, 0,
+    		(long)avail, (long)(len+1));
+    	limit = avail;
+    }
+    WRITTEN(d, dlen, s, limit);
+    return d + ( (flag & 2) ? (limit-1) : 0); /* hax for stpcpy */
+}
+
+/* Handler for strcpy, stpcpy, strncpy, strcat, strncat, memcpy,
+	and memmove */
+
+char *my_copy(char *d, int space_avail, int limit, char *s,
+	int sspace, int flag, char *f, int l, unsigned strflags)
+{
+    char *rtn = d;
+    int space_needed, i, dlen;
+    long slen;
+    if (!logfile) my_initialise();
+    space_avail = my_sizehint(d, space_avail);
+    sspace = my_sizehint(s, sspace);
+    /* only the bytes being copied need be initialised, and a whole
+       string's end is found below */
+    if (my_validate2(strflags?"String copy":"Mem copy", d, space_avail,
+		s, (!strflags && limit && (sspace < 0 || limit < sspace))
+		? limit : sspace, f,l,
+		INIT2|strflags|((strflags && !limit) ? ENDS : 0), &slen))
+	return d;
+    /* Are we cat'ing? If so, how long is the existing stuff? */
+    dlen = (flag&4) ? (int)my_strnlen(d,
+    		space_avail >= 0 ? (size_t)space_avail : (size_t)-1) : 0;
+    /* how much space do we need? */
+    if (strflags && !limit && slen < 0)
+    {
+    	if (s >= d+dlen || (sspace >= 0 && s+sspace <= d+dlen))
+    	    return my_fused_copy(d, dlen, space_avail, s, sspace, flag, f, l);
+    	/* the copy may run into the source; find its end first */
+    	slen = (long)my_strnlen(s, sspace >= 0 ? (size_t)sspace : (size_t)-1);
+    	if (sspace >= 0 && slen == sspace)
+    	{
+    	    log_event(GW_E_INVALID_2, "String copy", f, l, NULL, 0, 0, 0);
+    	    return d;
+    	}
+    }
+    space_needed = limit ? limit : (strflags ? (int)(slen+1) : space_avail);
+    /* space enuf? */
+    limit = space_needed;
+    if (space_avail >= 0 && space_needed > (space_avail-dlen))
+    {
+    	log_event(GW_E_COPY_OVERRUN, NULL, f, l, NULL, 0,
+    		(long)(space_avail-dlen), (long)space_needed);
+    	limit = space_avail-dlen;
+    }
+    else if (space_avail >= 0 && sspace >= 0 && sspace > (space_avail-dlen))
+    	log_event(GW_E_COPY_POTENTIAL, NULL, f, l, NULL, 0,
+    		(long)(space_avail-dlen), (long)sspace);
+    d += dlen;
+    if (s<d && (s+limit)>=d && (flag&1)==0) /* forward copy would clobber source */
+    	log_event(GW_E_COPY_CLOBBER, NULL, f, l, NULL, 0, 0, 0);
+    memmove(d,s,limit);
+    WRITTEN(rtn, dlen, s, limit);
+    return rtn + ( (flag & 2) ? (limit-1) : 0); /* hax for stpcpy */
+}
+
+char *my_memcpy(char *d, int space_avail, int limit, char *s,
+	int sspace, int flag, char *f, int l)
+{
+    return my_copy(d, space_avail, limit, s, sspace, flag, f, l, 0);
+}
+
+char *my_strcpy(char *d, int space_avail, int limit, char *s,
+	int sspace, int flag, char *f, int l)
+{
+    return my_copy(d, space_avail, limit, s, sspace, flag, f, l, NULLT);
+}
+
+char *my_memset(char *d, int space_avail, int limit, char c, char *f, int l)
+{
+    char *rtn = d;
+    int space_needed, i;
+    if (!logfile) my_initialise();
+    /* how much space do we have? */
+    space_avail = my_sizehint(d, space_avail);
+    if (my_validate1("memset", d, space_avail, f, l, 0, NULL)) goto done;
+    /* space enuf? */
+    if (space_avail >= 0 && limit > space_avail)
+    {
+    	log_event(GW_E_MEMSET_OVERRUN, NULL, f, l, NULL, 0,
+    		(long)space_avail, (long)limit);
+    	limit = space_avail;
+    }
+    memset(d,c,limit);
+    WRITTEN(d, 0, NULL, limit);
+done:
+    return rtn;
+}
+
+static int my_compare(char *s1, int siz1, char *s2, int siz2, int n,
+	int flag, char *f, int l, unsigned strflags)
+{
+    if (!logfile) my_initialise();
+    /* Just validate arguments */
+    siz1 = my_sizehint(s1, siz1);
+    siz2 = my_sizehint(s2, siz2);
+    if (!strflags && n > 0)
+    {
+    	/* only the bytes being compared need be initialised */
+    	if (siz1 < 0 || n < siz1) siz1 = n;
+    	if (siz2 < 0 || n < siz2) siz2 = n;
+    }
+    if (my_validate2("memcmp", s1, siz1, s2, siz2, f, l, INIT1|INIT2|strflags, NULL))
+    	return ((s1?1:0)-(s2?1:0));
+    if (n==0) return strcmp(s1,s2);
+    else if (flag) return strncmp(s1,s2,n);
+    else return memcmp(s1,s2,n);
+}
+
+int my_memcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l)
+{
+    return my_compare(s1, siz1, s2, siz2, n, flag, f, l, 0);
+}
+
+int my_strcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l)
+{
+    return my_compare(s1, siz1, s2, siz2, n, flag, f, l, NULLT);
+}
+
+int my_strlen(char *s, int siz, char *f, int l)
+{
+    long len;
+    if (!logfile) my_initialise();
+    siz = my_sizehint(s, siz);
+    if (my_validate1("strlen", s, siz, f, l, INIT1|NULLT, &len))
+    	return 0;
+    return (int)(len >= 0 ? len : (long)my_strnlen(s, (size_t)-1));
+}
+
+char *my_strdup(char *s, int siz, char *f, int l)
+{
+    long len;
+    STACK_ENTRY;
+    if (!logfile) my_initialise();
+    siz = my_sizehint(s, siz);
+    if (my_validate1("strdup", s, siz, f, l, INIT1|NULLT, &len)==0)
+    {
+    	int n = (int)(len >= 0 ? len : (long)my_strnlen(s, (size_t)-1)) + 1;
+    	char *rtn = my_calloc(n,f,l);
+    	assert(rtn);
+    	my_memcpy(rtn, sizeof(char *), n, s, sizeof(char *), 0, f, l);
+    	return rtn;
+    }
+    return NULL;
+}
+
+char *my_strstr(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    siz1 = my_sizehint(s1, siz1);
+    siz2 = my_sizehint(s2, siz2);
+    return my_validate2("strstr", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT, NULL)
+	? NULL : strstr(s1,s2);
+}
+
+char *my_strpbrk(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    siz1 = my_sizehint(s1, siz1);
+    siz2 = my_sizehint(s2, siz2);
+    return my_validate2("strpbrk", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT, NULL)
+	? NULL : strpbrk(s1,s2);
+}
+
+char *my_strchr(char *s, int siz, int c, char *f, int l)
+{
+    long len;
+    size_t i;
+    if (!logfile) my_initialise();
+    siz = my_sizehint(s, siz);
+    if (my_validate1("strchr", s, siz, f, l, INIT1|NULLT, &len))
+    	return NULL;
+    if (len < 0)
+    	return strchr(s,c);
+    /* we know where it ends, so look no further */
+    if ((char)c == 0)
+    	return s + len;
+    i = scan_byte(s, c, (size_t)len);
+    return i < (size_t)len ? s + i : NULL;
+}
+
+char *my_strrchr(char *s, int siz, int c, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    siz = my_sizehint(s, siz);
+    return my_validate1("strrchr", s, siz, f, l, INIT1|NULLT, NULL)
+	? NULL : strrchr(s,c);
+}
+
+int my_strspn(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    siz1 = my_sizehint(s1, siz1);
+    siz2 = my_sizehint(s2, siz2);
+    return my_validate2("strspn", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT, NULL)
+	? 0 : strspn(s1,s2);
+}
+
+int my_strcspn(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    siz1 = my_sizehint(s1, siz1);
+    siz2 = my_sizehint(s2, siz2);
+    return my_validate2("strcspn", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT, NULL)
+	? 0 : strcspn(s1,s2);
+}
+
+/***************************/
+/* File function debugging */
+/***************************/
+
+/* Files are tracked by handle, in a table made of chunks of
+   FILE_CHUNK entries that are only allocated once a handle in their
+   range is used, so a process with a great many descriptors costs no
+   more than it must, and looking one up is still direct. The open
+   ones are also kept on a list, so the report needn't look through
+   the rest. Handles past the end of the table are not tracked. */
+
+#if __MSDOS__
+#define FILE_CHUNK		64
+#define MAX_FILE_CHUNKS		4
+#endif
+
+#ifndef FILE_CHUNK
+#define FILE_CHUNK		1024	/* handles per chunk */
+#endif
+
+#ifndef MAX_FILE_CHUNKS
+#define MAX_FILE_CHUNKS		4096	/* so up to 4M handles */
+#endif
+
+typedef struct
+{
+    char *name;
+    site_id site;	/* where last opened or closed */
+    int open;
+    int kind;		/* GW_FD_FILE, GW_FD_SOCKET... */
+    FILE *fp;
+    int next, prev;	/* on the open list, if open */
+#ifdef GW_IO_STATS
+    struct io_stats *io;	/* since last opened */
+#endif
+} file_info_t;
+
+static file_info_t *file_chunks[MAX_FILE_CHUNKS];
+static file_info_t no_file;	/* what untracked handles look like */
+static int open_files = -1;	/* the open list, latest first */
+static int open_count = 0;	/* and how long it is */
+
+/* The entry for handle h, with file_lock held. Handles that have
+   never been seen get no_file, unless make is set, when their chunk
+   is allocated if need be; NULL means h can't be tracked. */
+
+static file_info_t *file_slot(int h, int make)
+{
+    file_info_t **cp, *chunk;
+    if (h < 0 || h / FILE_CHUNK >= MAX_FILE_CHUNKS)
+    	return make ? NULL : &no_file;
+    cp = &file_chunks[h / FILE_CHUNK];
+    if (*cp == NULL)
+    {
+    	if (!make)
+    	    return &no_file;
+    	if ((chunk = (file_info_t *)calloc(FILE_CHUNK, sizeof(file_info_t))) == NULL)
+    	    return NULL;
+    	STORE_REL(*cp, chunk); /* io_file looks without file_lock */
+    }
+    return &(*cp)[h % FILE_CHUNK];
+}
+
+#define FILE_INFO(h)	(&file_chunks[(h) / FILE_CHUNK][(h) % FILE_CHUNK])
+
+/* Record handle h as open, or closed */
+
+static void file_opened(int h, file_info_t *fi, char *name, int kind,
+	site_id site, FILE *fp)
+{
+    if (!fi->open)
+    {
+    	fi->next = open_files;
+    	fi->prev = -1;
+    	if (open_files >= 0)
+    	    FILE_INFO(open_files)->prev = h;
+    	open_files = h;
+    	open_count++;
+    }
+    fi->name = name;
+    fi->site = site;
+    fi->open = 1;
+    fi->kind = kind;
+    fi->fp = fp;
+#ifdef GW_IO_STATS
+    fi->io = NULL;
+#endif
+#ifdef GW_BINARY_TRACE
+    log_trace(GW_E_FILE_OPEN, name, NULL, (long)h, (long)kind,
+    	    SITE_FILE(site), SITE_LINE(site));
+#endif
+}
+
+static void file_closed(int h, file_info_t *fi, site_id site)
+{
+    if (fi->open)
+    {
+    	if (fi->prev >= 0)
+    	    FILE_INFO(fi->prev)->next = fi->next;
+    	else
+    	    open_files = fi->next;
+    	if (fi->next >= 0)
+    	    FILE_INFO(fi->next)->prev = fi->prev;
+    	open_count--;
+    }
+    fi->site = site;
+    fi->open = 0;
+#ifdef GW_BINARY_TRACE
+    log_trace(GW_E_FILE_CLOSE, NULL, NULL, (long)h, 0,
+    	    SITE_FILE(site), SITE_LINE(site));
+#else
+    (void)h;
+#endif
+}
+
+/* Record a new descriptor h of the given kind, made by name (or
+   opening the file name) at f, l */
+
+static void fd_made(int h, int kind, char *name, char *f, int l)
+{
+    file_info_t *fi;
+    GW_LOCK(file_lock);
+    if ((fi = file_slot(h, 1)) != NULL)
+    {
+    	if (fi->open)
+    	    /* shouldn't happen unless the system is broken */
+    	    log_event(GW_E_OPEN_REOPEN, store_name(name), f, l,
+    		    SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, 0);
+#ifdef GW_TRACE
+    	else
+    	    log_event(GW_E_OPEN_TRACE, store_name(name), f, l, NULL, 0, (long)h, 0);
+#endif
+    	file_opened(h, fi, store_name(name), kind, store_site(f, l), NULL);
+    }
+    GW_UNLOCK(file_lock);
+}
+
+static void fd_failed(char *name, char *f, int l)
+{
+    int err = errno;
+    log_event(GW_E_OPEN_FAIL, store_name(name), f, l, NULL, 0, 0, (long)err);
+    errno = err;
+}
+
+/* Streams are kept in a hash table keyed on the FILE pointer, so
+   finding one costs the same however many are open. Each points to
+   the descriptor under it, if any, and a descriptor's entry to its
+   stream. A closed stream stays in the table, so closing it again
+   can say where it was closed, until the table is next rebuilt,
+   which keeps only the open ones. */
+
+#ifndef STREAM_START
+#define STREAM_START	64	/* a power of two */
+#endif
+
+typedef struct
+{
+    FILE *fp;		/* NULL for an empty slot */
+    char *name;
+    site_id site;	/* where opened, or closed */
+    int fd;		/* -1 if none, or closed from under it */
+    int how;		/* GW_S_FOPEN... */
+    int open;
+} stream_info;
+
+static stream_info *streams = NULL;
+static unsigned long stream_room = 0, stream_used = 0, stream_count = 0;
+
+static unsigned long stream_hash(FILE *fp)
+{
+    unsigned long h = (unsigned long)fp;
+    h = (h >> 3) * 2654435761UL;
+    return h ^ (h >> 15);
+}
+
+/* Rebuild the table, big enough for four times the open streams */
+
+static int stream_grow(void)
+{
+    unsigned long n = STREAM_START, i, j;
+    stream_info *t;
+    while (n < (stream_count + 1) * 4)
+    	n *= 2;
+    if ((t = (stream_info *)calloc((size_t)n, sizeof(stream_info))) == NULL)
+    	return 0;
+    for (i = 0; i < stream_room; i++)
+    	if (streams[i].fp && streams[i].open)
+    	{
+    	    for (j = stream_hash(streams[i].fp) & (n-1); t[j].fp; j = (j+1) & (n-1))
+    		;
+    	    t[j] = streams[i];
+    	}
+    free(streams);
+    streams = t;
+    stream_room = n;
+    stream_used = stream_count;
+    return 1;
+}
+
+/* The entry for fp, with file_lock held; if there is none, NULL,
+   or if make is set, a new empty one */
+
+static stream_info *stream_find(FILE *fp, int make)
+{
+    unsigned long i, mask = stream_room - 1;
+    if (stream_room)
+    	for (i = stream_hash(fp) & mask; streams[i].fp; i = (i+1) & mask)
+    	    if (streams[i].fp == fp)
+    		return &streams[i];
+    if (!make)
+    	return NULL;
+    if ((stream_used + 1) * 4 > stream_room * 3)
+    {
+    	if (!stream_grow())
+    	    return NULL;
+    	mask = stream_room - 1;
+    }
+    for (i = stream_hash(fp) & mask; streams[i].fp; i = (i+1) & mask)
+    	;
+    memset(&streams[i], 0, sizeof(stream_info));
+    streams[i].fp = fp;
+    stream_used++;
+    return &streams[i];
+}
+
+/* Record a new stream fp, opened by how on name at f, l; unless it
+   was made by fdopen, its descriptor (of the given kind) is new too */
+
+static void stream_made(FILE *fp, int how, char *name, int kind,
+	char *f, int l)
+{
+    int h = (how == GW_S_MEMSTREAM) ? -1 : fileno(fp);
+    site_id site = store_site(f, l);
+    file_info_t *fi;
+    stream_info *st;
+    name = store_name(name);
+    GW_LOCK(file_lock);
+    if (how == GW_S_FDOPEN)
+    {
+    	if ((fi = file_slot(h, 0))->open)
+    	{
+    	    fi->fp = fp;
+    	    name = fi->name;
+    	}
+    }
+    else if (h >= 0 && (fi = file_slot(h, 1)) != NULL)
+    {
+    	if (fi->open)
+    	    /* shouldn't happen unless the C library is broken */
+    	    log_event(GW_E_FOPEN_REOPEN, name, f, l,
+    		    SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, 0);
+#ifdef GW_TRACE
+    	else
+    	    log_event(GW_E_OPEN_TRACE, name, f, l, NULL, 0, (long)h, 0);
+#endif
+    	file_opened(h, fi, name, kind, site, fp);
+    }
+    if ((st = stream_find(fp, 1)) != NULL)
+    {
+    	if (!st->open)
+    	    stream_count++;
+    	st->name = name;
+    	st->site = site;
+    	st->fd = h;
+    	st->how = how;
+    	st->open = 1;
+    }
+    GW_UNLOCK(file_lock);
+}
+
+/* fp is being closed by fclose or pclose (how is GW_S_FOPEN or
+   GW_S_POPEN) at f, l; returns 0 if it was already */
+
+static int stream_closing(FILE *fp, int how, char *f, int l)
+{
+    site_id site = store_site(f, l);
+    stream_info *st;
+    file_info_t *fi;
+    int ok = 1;
+    GW_LOCK(file_lock);
+    if ((st = stream_find(fp, 0)) == NULL)
+    {
+    	/* not one of ours, though its descriptor may be */
+    	int h = fileno(fp);
+    	if (h >= 0 && h / FILE_CHUNK < MAX_FILE_CHUNKS)
+    	{
+    	    if (!(fi = file_slot(h, 0))->open)
+    	    {
+    		log_event(GW_E_FCLOSE_BAD, NULL, f, l,
+    			SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, 0);
+    		ok = 0;
+    	    }
+    	    else if (fi->fp == NULL)
+    		file_closed(h, fi, site);
+    	}
+    }
+    else if (!st->open)
+    {
+    	log_event(GW_E_FCLOSE_BAD, NULL, f, l,
+    		SITE_FILE(st->site), SITE_LINE(st->site), (long)st->fd, 0);
+    	ok = 0;
+    }
+    else
+    {
+    	if ((st->how == GW_S_POPEN) != (how == GW_S_POPEN))
+    	    log_event(GW_E_STREAM_MISMATCH, how == GW_S_POPEN ? "pclose" : "fclose", f, l,
+    		    SITE_FILE(st->site), SITE_LINE(st->site), (long)st->how, 0);
+#ifdef GW_TRACE
+    	log_event(GW_E_FCLOSE_TRACE, st->name, f, l,
+    		SITE_FILE(st->site), SITE_LINE(st->site), (long)st->fd, 0);
+#endif
+    	if (st->fd >= 0 && (fi = file_slot(st->fd, 0))->open && fi->fp == fp)
+    	    file_closed(st->fd, fi, site);
+    	st->site = site;
+    	st->open = 0;
+    	stream_count--;
+    }
+    GW_UNLOCK(file_lock);
+    return ok;
+}
+
+/* Descriptor h is being closed at f, l from under its stream, with
+   file_lock held */
+
+static void stream_lost(int h, file_info_t *fi, char *f, int l)
+{
+    stream_info *st = stream_find(fi->fp, 0);
+    if (st && st->open && st->fd == h)
+    {
+    	log_event(GW_E_CLOSE_STREAM, st->name, f, l,
+    		SITE_FILE(st->site), SITE_LINE(st->site), (long)h, 0);
+    	st->fd = -1;
+    }
+    fi->fp = NULL;
+}
+
+/* I/O accounting. Each read or write counts against the site that
+   made it and against the file, as opened (a handle that is opened
+   again starts afresh). Only read() and write() can be tiny: the
+   stdio calls go through a buffer. The counts are bumped atomically,
+   and found without file_lock once they exist, so threads doing I/O
+   don't queue for it. */
+
+#ifdef GW_IO_STATS
+
+#ifndef GW_TINY_IO
+#define GW_TINY_IO	64	/* bytes */
+#endif
+
+#ifndef GW_TINY_CALLS
+#define GW_TINY_CALLS	100	/* tiny calls a site must make to be listed */
+#endif
+
+#ifndef IO_CHUNK
+#define IO_CHUNK	1024	/* sites per chunk */
+#endif
+
+#ifndef MAX_IO_CHUNKS
+#define MAX_IO_CHUNKS	4096
+#endif
+
+#define IO_BUCKETS	16	/* sizes 0, 1, 2-3, 4-7, ... 16K and up */
+
+enum { IO_READ, IO_WRITE };
+
+typedef struct io_stats
+{
+    unsigned long calls[2], bytes[2];	/* by IO_READ or IO_WRITE; calls
+    					   are only totalled for reports */
+    unsigned long tiny[2];
+    unsigned long sizes[2][IO_BUCKETS];	/* sizes asked for */
+    char *name;			/* a file's name, if opened here */
+    int handle;			/* and handle; -1 for a site */
+    site_id site;		/* where opened, or the site */
+    struct io_stats *next;	/* all the files' stats */
+} io_stats;
+
+static io_stats *io_site_chunks[MAX_IO_CHUNKS];	/* by site id */
+static io_stats *io_files = NULL;
+static unsigned long io_nfiles = 0;
+
+static io_stats *io_new(char *name, int h, site_id site)
+{
+    io_stats *io = (io_stats *)calloc(1, sizeof(io_stats));
+    if (io)
+    {
+    	io->name = name;
+    	io->handle = h;
+    	io->site = site;
+    }
+    return io;
+}
+
+static io_stats *io_site(site_id site)
+{
+    io_stats **cp, *chunk;
+    unsigned long i;
+    if (site / IO_CHUNK >= MAX_IO_CHUNKS)
+    	return NULL;
+    cp = &io_site_chunks[site / IO_CHUNK];
+    if ((chunk = LOAD_ACQ(*cp)) == NULL)
+    {
+    	GW_LOCK(file_lock);
+    	if ((chunk = *cp) == NULL
+    		&& (chunk = (io_stats *)calloc(IO_CHUNK, sizeof(io_stats))) != NULL)
+    	{
+    	    for (i = 0; i < IO_CHUNK; i++)
+    	    {
+    		chunk[i].handle = -1;
+    		chunk[i].site = (site_id)(site - site % IO_CHUNK + i);
+    	    }
+    	    STORE_REL(*cp, chunk);
+    	}
+    	GW_UNLOCK(file_lock);
+    	if (chunk == NULL)
+    	    return NULL;
+    }
+    return &chunk[site % IO_CHUNK];
+}
+
+/* A reader racing a reopen of h may count against the file as it
+   was; the I/O raced the close, so either is right */
+
+static io_stats *io_file(int h)
+{
+    file_info_t *chunk, *fi;
+    io_stats *io = NULL;
+    if (h < 0 || h / FILE_CHUNK >= MAX_FILE_CHUNKS)
+    	return NULL;
+    if ((chunk = LOAD_ACQ(file_chunks[h / FILE_CHUNK])) != NULL
+    	    && (io = LOAD_ACQ(chunk[h % FILE_CHUNK].io)) != NULL)
+    	return io;
+    GW_LOCK(file_lock);
+    if ((fi = file_slot(h, 1)) != NULL && (io = fi->io) == NULL)
+    {
+    	/* handles we didn't see opened (stdin, say) have no name */
+    	if ((io = io_new(fi->open ? fi->name : NULL, h,
+    		fi->open ? fi->site : 0)) != NULL)
+    	{
+    	    io->next = io_files;
+    	    io_files = io;
+    	    io_nfiles++;
+    	    STORE_REL(fi->io, io);
+    	}
+    }
+    GW_UNLOCK(file_lock);
+    return io;
+}
+
+static void io_count(io_stats *io, int dir, unsigned long asked, long got,
+	int raw)
+{
+    int b = 0;
+    while (b < IO_BUCKETS-1 && (asked >> b) != 0)
+    	b++;
+    if (got > 0)
+    	GW_ATOMIC_ADD(io->bytes[dir], (unsigned long)got);
+    GW_ATOMIC_INC(io->sizes[dir][b]);
+    if (raw && asked < GW_TINY_IO)
+    	GW_ATOMIC_INC(io->tiny[dir]);
+}
+
+/* A copy of io with its calls totalled from the sizes, for a report;
+   false if it has seen none */
+
+static int io_copy(io_stats *to, const io_stats *io)
+{
+    int d, b;
+    *to = *io;
+    for (d = IO_READ; d <= IO_WRITE; d++)
+    	for (to->calls[d] = 0, b = 0; b < IO_BUCKETS; b++)
+    	    to->calls[d] += to->sizes[d][b];
+    return to->calls[IO_READ] + to->calls[IO_WRITE] != 0;
+}
+
+/* Count a transfer of asked bytes, of which got were moved, on
+   handle h; raw is set for read() and write() */
+
+static void io_account(int h, int dir, unsigned long asked, long got,
+	int raw, char *f, int l)
+{
+    io_stats *io;
+    if ((io = io_site(store_site(f, l))) != NULL)
+    	io_count(io, dir, asked, got, raw);
+    if ((io = io_file(h)) != NULL)
+    	io_count(io, dir, asked, got, raw);
+}
+
+#define IO_COUNT(h,dir,asked,got,raw,f,l) \
+	io_account((h), (dir), (unsigned long)(asked), (long)(got), (raw), (f), (l))
+#else
+#define IO_COUNT(h,dir,asked,got,raw,f,l)
+#endif /* GW_IO_STATS */
+
+#include <fcntl.h>
+
+FILE *my_fopen(char *n, char *m, char *f, int l)
+{
+    FILE *rtn;
+    if (!logfile) my_initialise();
+    rtn = fopen(n,m);
+    if (rtn)
+    	stream_made(rtn, GW_S_FOPEN, n, GW_FD_FILE, f, l);
+    else
+    	log_event(GW_E_FOPEN_FAIL, store_name(n), f, l, NULL, 0, 0, 0);
+    return rtn;
+}
+
+int my_fclose(FILE *fp, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    if (fp == NULL)
+    {
+    	log_event(GW_E_FCLOSE_NULL, NULL, f, l, NULL, 0, 0, 0);
+    	return 0;
+    }
+    return stream_closing(fp, GW_S_FOPEN, f, l) ? fclose(fp) : 0;
+}
+
+FILE *my_fdopen(int h, char *m, char *f, int l)
+{
+    FILE *rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = fdopen(h, m)) != NULL)
+    	stream_made(rtn, GW_S_FDOPEN, "fdopen", GW_FD_FILE, f, l);
+    else
+    	fd_failed("fdopen", f, l);
+    return rtn;
+}
+
+/* freopen closes the stream's descriptor whether or not it can open
+   the new file; it keeps the stream if it can. The standard streams
+   are left untracked. */
+
+FILE *my_freopen(char *n, char *m, FILE *fp, char *f, int l)
+{
+    FILE *rtn;
+    stream_info *st;
+    file_info_t *fi;
+    int h, err;
+    if (!logfile) my_initialise();
+    if (fp == NULL || fp == stdin || fp == stdout || fp == stderr)
+    	return freopen(n, m, fp);
+    h = fileno(fp);
+    rtn = freopen(n, m, fp);
+    err = errno;
+    GW_LOCK(file_lock);
+    if ((st = stream_find(fp, 0)) != NULL && st->open)
+    {
+    	if (n == NULL)
+    	    n = st->name; /* just a change of mode */
+    	st->open = 0;
+    	stream_count--;
+    }
+    if (h >= 0 && (fi = file_slot(h, 0))->open && fi->fp == fp)
+    	file_closed(h, fi, store_site(f, l));
+    GW_UNLOCK(file_lock);
+    if (rtn)
+    	stream_made(rtn, GW_S_FREOPEN, n ? n : "freopen", GW_FD_FILE, f, l);
+    else
+    {
+    	errno = err;
+    	fd_failed(n ? n : "freopen", f, l);
+    }
+    return rtn;
+}
+
+FILE *my_tmpfile(char *f, int l)
+{
+    FILE *rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = tmpfile()) != NULL)
+    	stream_made(rtn, GW_S_TMPFILE, "tmpfile", GW_FD_FILE, f, l);
+    else
+    	fd_failed("tmpfile", f, l);
+    return rtn;
+}
+
+#if !__MSDOS__
+
+FILE *my_popen(char *c, char *m, char *f, int l)
+{
+    FILE *rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = popen(c, m)) != NULL)
+    	stream_made(rtn, GW_S_POPEN, c, GW_FD_PIPE, f, l);
+    else
+    	fd_failed(c, f, l);
+    return rtn;
+}
+
+int my_pclose(FILE *fp, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    if (fp == NULL)
+    {
+    	log_event(GW_E_FCLOSE_NULL, NULL, f, l, NULL, 0, 0, 0);
+    	return -1;
+    }
+    return stream_closing(fp, GW_S_POPEN, f, l) ? pclose(fp) : -1;
+}
+
+/* The buffer is the C library's, not ours; it should be given back
+   with the library's free (or left to leak), not through the
+   wrapper, which won't know it */
+
+FILE *my_open_memstream(char **p, size_t *n, char *f, int l)
+{
+    FILE *rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = open_memstream(p, n)) != NULL)
+    	stream_made(rtn, GW_S_MEMSTREAM, "memstream", GW_FD_FILE, f, l);
+    else
+    	fd_failed("open_memstream", f, l);
+    return rtn;
+}
+
+#endif /* !__MSDOS__ */
+
+int my_open(char *n, int m, int a, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    rtn = open(n,m,a);
+    if (rtn >= 0)
+    	fd_made(rtn, GW_FD_FILE, n, f, l);
+    else
+    	fd_failed(n, f, l);
+    return rtn;
+}
+
+int my_close(int h, char *f, int l)
+{
+    if (!logfile) my_initialise();
+    if (h / FILE_CHUNK >= MAX_FILE_CHUNKS)
+    	return close(h); /* beyond our table */
+    if (h>=0)
+    {
+    	file_info_t *fi;
+    	GW_LOCK(file_lock);
+    	fi = file_slot(h, 0);
+    	if (!fi->open)
+    	    log_event(GW_E_CLOSE_BAD, NULL, f, l,
+    	    	SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, 0);
+    	else
+    	{
+    	    if (fi->fp)
+    		stream_lost(h, fi, f, l);
+#ifdef GW_TRACE
+    	    log_event(GW_E_CLOSE_TRACE, fi->name, f, l,
+    	    	    SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, 0);
+#endif
+    	    file_closed(h, fi, store_site(f, l));
+    	    GW_UNLOCK(file_lock);
+    	    return close(h);
+    	}
+    	GW_UNLOCK(file_lock);
+    }
+    else log_event(GW_E_CLOSE_ILLEGAL, NULL, f, l, NULL, 0, (long)h, 0);
+    return 0;
+}
+
+/* Descriptors 0 to 2 are open from the start but left untracked, as
+   nobody closes them; a copy of one is tracked under these names */
+
+static char *std_names[] = { "stdin", "stdout", "stderr" };
+
+/* Record rtn as a copy of h, which it replaced if it was open, with
+   file_lock held; unless track is set, rtn is left untracked */
+
+static void fd_copied(int h, file_info_t *fi, int rtn, int track, char *f, int l)
+{
+    file_info_t *nfi;
+    if (rtn == h || (nfi = file_slot(rtn, track)) == NULL)
+    	return;
+    if (nfi->open)
+    {
+    	if (nfi->fp)
+    	    stream_lost(rtn, nfi, f, l);
+    	file_closed(rtn, nfi, store_site(f, l));
+    }
+    if (!track)
+    	return;
+    if (fi->open)
+    {
+#ifdef GW_TRACE
+    	log_event(GW_E_DUP_TRACE, fi->name, f, l,
+    		SITE_FILE(fi->site), SITE_LINE(fi->site), (long)h, (long)rtn);
+#endif
+    	file_opened(rtn, nfi, fi->name, fi->kind, store_site(f, l), NULL);
+    }
+    else if (h >= 0 && h <= 2)
+    	file_opened(rtn, nfi, std_names[h], GW_FD_FILE, store_site(f, l), NULL);
+}
+
+/* dup and dup2 of a handle that isn't open are refused, as close is,
+   except that dup2 onto 0 to 2 goes ahead: that is how programs
+   point their standard handles somewhere else, and those are left
+   untracked */
+
+int my_dup(int h, char *f, int l)
+{
+    int rtn = -1;
+    if (!logfile) my_initialise();
+    if (h / FILE_CHUNK >= MAX_FILE_CHUNKS)
+    	return dup(h); /* beyond our table */
+    if (h>=0)
+    {
+    	file_info_t *fi;
+    	GW_LOCK(file_lock);
+    	fi = file_slot(h, 0);
+    	if (!fi->open && h > 2)
+    	{
+    	    log_event(GW_E_DUP_ILLEGAL, NULL, f, l, NULL, 0, (long)h, 0);
+    	    errno = EBADF;
+    	}
+    	else
+    	{
+    	    rtn = dup(h);
+    	    if (rtn < 0)
+    		log_event(GW_E_DUP_FAIL, NULL, f, l, NULL, 0, (long)h, (long)errno);
+    	    else
+    		fd_copied(h, fi, rtn, 1, f, l);
+    	}
+    	GW_UNLOCK(file_lock);
+    }
+    else
+    {
+    	log_event(GW_E_DUP_ILLEGAL, NULL, f, l, NULL, 0, (long)h, 0);
+    	errno = EBADF;
+    }
+    return rtn;
+}
+
+int my_dup2(int h, int h2, char *f, int l)
+{
+    int rtn;
+    file_info_t *fi;
+    if (!logfile) my_initialise();
+    GW_LOCK(file_lock);
+    fi = file_slot(h, 0);
+    if (!fi->open && (h < 0 || h > 2) && h / FILE_CHUNK < MAX_FILE_CHUNKS
+    	    && (h2 < 0 || h2 > 2))
+    {
+    	GW_UNLOCK(file_lock);
+    	log_event(GW_E_DUP_ILLEGAL, NULL, f, l, NULL, 0, (long)h, 0);
+    	errno = EBADF;
+    	return -1;
+    }
+    rtn = dup2(h, h2);
+    if (rtn < 0)
+    	log_event(GW_E_DUP_FAIL, NULL, f, l, NULL, 0, (long)h, (long)errno);
+    else
+    	fd_copied(h, fi, rtn, rtn > 2, f, l);
+    GW_UNLOCK(file_lock);
+    return rtn;
+}
+
+#if !__MSDOS__
+
+int my_socket(int domain, int type, int protocol, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = socket(domain, type, protocol)) >= 0)
+    	fd_made(rtn, GW_FD_SOCKET, "socket", f, l);
+    else
+    	fd_failed("socket", f, l);
+    return rtn;
+}
+
+/* A listener running out of connections isn't news */
+
+#define ACCEPT_FAILED(err) \
+	((err) != EAGAIN && (err) != EWOULDBLOCK && (err) != EINTR)
+
+int my_accept(int h, void *a, socklen_t *n, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = accept(h, (struct sockaddr *)a, n)) >= 0)
+    	fd_made(rtn, GW_FD_SOCKET, "socket", f, l);
+    else if (ACCEPT_FAILED(errno))
+    	fd_failed("accept", f, l);
+    return rtn;
+}
+
+int my_pipe(int *fds, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = pipe(fds)) == 0)
+    {
+    	fd_made(fds[0], GW_FD_PIPE, "pipe", f, l);
+    	fd_made(fds[1], GW_FD_PIPE, "pipe", f, l);
+    }
+    else
+    	fd_failed("pipe", f, l);
+    return rtn;
+}
+
+#ifdef __linux__
+
+int my_accept4(int h, void *a, socklen_t *n, int flags, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = accept4(h, (struct sockaddr *)a, n, flags)) >= 0)
+    	fd_made(rtn, GW_FD_SOCKET, "socket", f, l);
+    else if (ACCEPT_FAILED(errno))
+    	fd_failed("accept4", f, l);
+    return rtn;
+}
+
+int my_pipe2(int *fds, int flags, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = pipe2(fds, flags)) == 0)
+    {
+    	fd_made(fds[0], GW_FD_PIPE, "pipe", f, l);
+    	fd_made(fds[1], GW_FD_PIPE, "pipe", f, l);
+    }
+    else
+    	fd_failed("pipe2", f, l);
+    return rtn;
+}
+
+int my_epoll_create1(int flags, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = epoll_create1(flags)) >= 0)
+    	fd_made(rtn, GW_FD_EPOLL, "epoll", f, l);
+    else
+    	fd_failed("epoll", f, l);
+    return rtn;
+}
+
+int my_eventfd(unsigned n, int flags, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    if ((rtn = eventfd(n, flags)) >= 0)
+    	fd_made(rtn, GW_FD_EVENT, "eventfd", f, l);
+    else
+    	fd_failed("eventfd", f, l);
+    return rtn;
+}
+
+#endif /* __linux__ */
+
+#endif /* !__MSDOS__ */
+
+static int my_bufcheck(char *name, const void *buf, unsigned len, int space_avail, char *f, int l)
+{
+    if (buf==NULL)
+    {
+    	log_event(GW_E_READ_NULL, name, f, l, NULL, 0, 0, 0);
+    	return 0;
+    }
+    space_avail = my_sizehint((void *)buf, space_avail);
+    if (space_avail >= 0 && space_avail < len)
+    {
+    	log_event(GW_E_READ_OVER, name, f, l, NULL, 0,
+    		(long)len, (long)space_avail);
+    	return space_avail;
+    }
+    else return len;
+}
+
+int my_read(int h, void *buf, unsigned len, int space_avail, char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    len = my_bufcheck("read", buf, len, space_avail, f, l);
+    rtn = len ? read(h,buf,len) : 0;
+    if (rtn > 0)
+    	WRITTEN(buf, 0, NULL, rtn);
+    IO_COUNT(h, IO_READ, len, rtn, 1, f, l);
+    return rtn;
+}
+
+size_t my_fread(void *buf, size_t size, size_t n, FILE *fp, int space_avail, char *f, int l)
+{
+    size_t want;
+    if (!logfile) my_initialise();
+    if (size==0)
+    {
+    	log_event(GW_E_FREAD_ZERO, NULL, f, l, NULL, 0, 0, 0);
+    	return 0;
+    }
+    want = my_bufcheck("fread", buf, n*size, space_avail, f, l) / size;
+    n = want ? fread(buf,size,want,fp) : 0;
+    if (n)
+    	WRITTEN(buf, 0, NULL, n*size);
+    IO_COUNT(fp ? fileno(fp) : -1, IO_READ, want*size, n*size, 0, f, l);
+    return n;
+}
+
+char *my_fgets(void *buf, int n, FILE *fp, int space_avail, char *f, int l)
+{
+    char *rtn;
+    if (!logfile) my_initialise();
+    n = my_bufcheck("fgets", buf, n, space_avail, f, l);
+    if (n == 0)
+    	return buf;
+    rtn = fgets(buf,n,fp);
+    if (rtn)
+    	WRITTEN(buf, 0, NULL, strlen(rtn)+1);
+    IO_COUNT(fp ? fileno(fp) : -1, IO_READ, n, rtn ? strlen(rtn) : 0, 0, f, l);
+    return rtn;
+}
+
+int my_write(int h, const void *buf, unsigned len, int space_avail,
+	char *f, int l)
+{
+    int rtn;
+    if (!logfile) my_initialise();
+    len = my_bufcheck("write", buf, len, space_avail, f, l);
+    rtn = len ? write(h,buf,len) : 0;
+    IO_COUNT(h, IO_WRITE, len, rtn, 1, f, l);
+    return rtn;
+}
+
+size_t my_fwrite(const void *buf, size_t size, size_t n, FILE *fp,
+	int space_avail, char *f, int l)
+{
+    size_t want;
+    if (!logfile) my_initialise();
+    if (size==0)
+    	return 0;
+    want = my_bufcheck("fwrite", buf, n*size, space_avail, f, l) / size;
+    n = want ? fwrite(buf,size,want,fp) : 0;
+    IO_COUNT(fp ? fileno(fp) : -1, IO_WRITE, want*size, n*size, 0, f, l);
+    return n;
+}
+
+int my_fputs(const char *s, int siz, FILE *fp, char *f, int l)
+{
+    long len;
+    int rtn;
+    if (!logfile) my_initialise();
+    siz = my_sizehint((void *)s, siz);
+    if (my_validate1("fputs", (char *)s, siz, f, l, INIT1|NULLT, &len))
+    	return EOF;
+    if (len < 0)
+    	len = (long)strlen(s);
+    rtn = fputs(s, fp);
+    IO_COUNT(fp ? fileno(fp) : -1, IO_WRITE, len, rtn == EOF ? 0 : len, 0, f, l);
+    return rtn;
+}
+
+static char *fd_kinds[GW_FD_KINDS] =
+{
+    "File", "Socket", "Pipe", "Epoll", "Eventfd"
+};
+
+static char *fd_kind(int kind)
+{
+    return (kind >= 0 && kind < GW_FD_KINDS) ? fd_kinds[kind] : "?";
+}
+
+static char *stream_hows[GW_S_KINDS] =
+{
+    "fopen", "fdopen", "freopen", "tmpfile", "popen", "open_memstream"
+};
+
+static char *stream_how(int how)
+{
+    return (how >= 0 && how < GW_S_KINDS) ? stream_hows[how] : "?";
+}
+
+static int by_handle(const void *a, const void *b)
+{
+    return ((const gw_fd_info *)a)->handle - ((const gw_fd_info *)b)->handle;
+}
+
+static int by_kind_site(const gw_fd_info *x, const gw_fd_info *y)
+{
+    int c;
+    if (x->kind != y->kind)
+    	return x->kind - y->kind;
+    c = strcmp(x->file, y->file);
+    return c ? c : x->line - y->line;
+}
+
+static int by_fd_site(const void *a, const void *b)
+{
+    return by_kind_site((const gw_fd_info *)a, (const gw_fd_info *)b);
+}
+
+/* Groups are in the handle field, by count */
+
+static int by_fd_group(const void *a, const void *b)
+{
+    const gw_fd_info *x = (const gw_fd_info *)a, *y = (const gw_fd_info *)b;
+    if (x->kind != y->kind)
+    	return x->kind - y->kind;
+    if (x->handle != y->handle)
+    	return y->handle - x->handle;
+    return by_kind_site(x, y);
+}
+
+void gw_fd_report(FILE *fp, gw_fd_info *fds, unsigned long n, int is_last)
+{
+    unsigned long i, j, groups = 0;
+    if (n == 0)
+    	return;
+    qsort(fds, (size_t)n, sizeof(gw_fd_info), by_handle);
+    if (is_last)
+    	fprintf(fp,"FILE LEAKS:\n");
+    for (i = 0; i < n; i++)
+    	if (fds[i].kind == GW_FD_FILE)
+    	    fprintf(fp,"\tFile `%s' (handle %d) opened at %s, line %d\n",
+    		    fds[i].name, fds[i].handle, fds[i].file, fds[i].line);
+    	else
+    	    fprintf(fp,"\t%s (handle %d) opened at %s, line %d\n",
+    		    fd_kind(fds[i].kind), fds[i].handle, fds[i].file, fds[i].line);
+    /* then how many of each kind each site has open */
+    qsort(fds, (size_t)n, sizeof(gw_fd_info), by_fd_site);
+    for (i = 0; i < n; i = j)
+    {
+    	for (j = i + 1; j < n && by_kind_site(&fds[i], &fds[j]) == 0; j++)
+    	    ;
+    	fds[groups] = fds[i];
+    	fds[groups++].handle = (int)(j - i);
+    }
+    qsort(fds, (size_t)groups, sizeof(gw_fd_info), by_fd_group);
+    fprintf(fp,"\nOPEN DESCRIPTORS BY KIND AND SITE:\n");
+    for (i = 0; i < groups; i++)
+    	fprintf(fp,"\t%-8s %6d File %16s Line %d\n", fd_kind(fds[i].kind),
+    		fds[i].handle, fds[i].file, fds[i].line);
+}
+
+static void my_file_report(FILE *fp, int is_last)
+{
+    gw_fd_info *fds;
+    unsigned long n = 0;
+    int h;
+    GW_LOCK(file_lock);
+    fds = (gw_fd_info *)malloc((size_t)(open_count ? open_count : 1) * sizeof(gw_fd_info));
+    if (fds)
+    	for (h = open_files; h >= 0; h = FILE_INFO(h)->next)
+    	{
+    	    file_info_t *fi = FILE_INFO(h);
+    	    fds[n].handle = h;
+    	    fds[n].kind = fi->kind;
+    	    fds[n].name = fi->name;
+    	    fds[n].file = SITE_FILE(fi->site);
+    	    fds[n].line = SITE_LINE(fi->site);
+    	    n++;
+    	}
+    GW_UNLOCK(file_lock);
+    if (fds)
+    	gw_fd_report(fp, fds, n, is_last);
+    free(fds);
+}
+
+#if defined(GW_BINARY_LOG) && !defined(GW_BINARY_TRACE)
+
+/* Write out the open descriptors, for gwdecode to report */
+
+static void log_open_files(void)
+{
+    int h;
+    GW_LOCK(file_lock);
+    for (h = open_files; h >= 0; h = FILE_INFO(h)->next)
+    {
+    	file_info_t *fi = FILE_INFO(h);
+    	log_trace(GW_E_FILE_OPEN, fi->name, NULL, (long)h, (long)fi->kind,
+    		SITE_FILE(fi->site), SITE_LINE(fi->site));
+    }
+    GW_UNLOCK(file_lock);
+}
+
+#endif
+
+static int by_stream(const void *a, const void *b)
+{
+    const gw_stream_info *x = (const gw_stream_info *)a, *y = (const gw_stream_info *)b;
+    int c;
+    if (x->handle != y->handle)
+    	return x->handle - y->handle;
+    c = strcmp(x->file, y->file);
+    return c ? c : x->line - y->line;
+}
+
+void gw_stream_report(FILE *fp, gw_stream_info *s, unsigned long n, int is_last)
+{
+    unsigned long i;
+    if (n == 0)
+    	return;
+    qsort(s, (size_t)n, sizeof(gw_stream_info), by_stream);
+    if (is_last)
+    	fprintf(fp,"STREAM LEAKS:\n");
+    for (i = 0; i < n; i++)
+    {
+    	fprintf(fp,"\tStream `%s' from %s", s[i].name, stream_how(s[i].how));
+    	if (s[i].handle >= 0)
+    	    fprintf(fp," (handle %d)", s[i].handle);
+    	fprintf(fp," opened at %s, line %d", s[i].file, s[i].line);
+    	if (s[i].pending > 0)
+    	    fprintf(fp,", %ld bytes unflushed", s[i].pending);
+    	fprintf(fp,"\n");
+    }
+}
+
+/* The open streams, in a malloced array of *n; NULL if none */
+
+static gw_stream_info *stream_list(unsigned long *n)
+{
+    gw_stream_info *s = NULL;
+    unsigned long i;
+    *n = 0;
+    GW_LOCK(file_lock);
+    if (stream_count &&
+    	(s = (gw_stream_info *)malloc((size_t)stream_count * sizeof(gw_stream_info))) != NULL)
+    	for (i = 0; i < stream_room; i++)
+    	    if (streams[i].fp && streams[i].open)
+    	    {
+    		stream_info *st = &streams[i];
+    		s[*n].name = st->name;
+    		s[*n].how = st->how;
+    		s[*n].handle = st->fd;
+#ifdef GW_FPENDING
+    		s[*n].pending = (long)__fpending(st->fp);
+#else
+    		s[*n].pending = -1L;
+#endif
+    		s[*n].file = SITE_FILE(st->site);
+    		s[*n].line = SITE_LINE(st->site);
+    		(*n)++;
+    	    }
+    GW_UNLOCK(file_lock);
+    return s;
+}
+
+static void my_stream_report(FILE *fp, int is_last)
+{
+    unsigned long n;
+    gw_stream_info *s = stream_list(&n);
+    if (s)
+    {
+    	if (is_last)
+    	    fprintf(fp,"\n");
+    	gw_stream_report(fp, s, n, is_last);
+    	free(s);
+    }
+}
+
+#ifdef GW_IO_STATS
+
+static unsigned long io_calls(const io_stats *io)
+{
+    return io->calls[IO_READ] + io->calls[IO_WRITE];
+}
+
+static unsigned long io_bytes(const io_stats *io)
+{
+    return io->bytes[IO_READ] + io->bytes[IO_WRITE];
+}
+
+/* Sites by calls, files by bytes; then by place */
+
+static int by_io_place(const io_stats *x, const io_stats *y)
+{
+    int c;
+    if (x->handle != y->handle)
+    	return x->handle - y->handle;
+    c = strcmp(SITE_FILE(x->site), SITE_FILE(y->site));
+    return c ? c : SITE_LINE(x->site) - SITE_LINE(y->site);
+}
+
+static int by_io_calls(const void *a, const void *b)
+{
+    const io_stats *x = (const io_stats *)a, *y = (const io_stats *)b;
+    if (io_calls(x) != io_calls(y))
+    	return (io_calls(x) < io_calls(y)) ? 1 : -1;
+    if (io_bytes(x) != io_bytes(y))
+    	return (io_bytes(x) < io_bytes(y)) ? 1 : -1;
+    return by_io_place(x, y);
+}
+
+static int by_io_bytes(const void *a, const void *b)
+{
+    const io_stats *x = (const io_stats *)a, *y = (const io_stats *)b;
+    if (io_bytes(x) != io_bytes(y))
+    	return (io_bytes(x) < io_bytes(y)) ? 1 : -1;
+    if (io_calls(x) != io_calls(y))
+    	return (io_calls(x) < io_calls(y)) ? 1 : -1;
+    return by_io_place(x, y);
+}
+
+static void print_io_sizes(FILE *fp, const io_stats *io)
+{
+    static char *dirs[2] = { "read", "write" };
+    int d, b;
+    for (d = IO_READ; d <= IO_WRITE; d++)
+    {
+    	if (io->calls[d] == 0)
+    	    continue;
+    	fprintf(fp,"\t    %s sizes:", dirs[d]);
+    	for (b = 0; b < IO_BUCKETS; b++)
+    	{
+    	    if (io->sizes[d][b] == 0)
+    		continue;
+    	    if (b == 0)
+    		fprintf(fp," 0:%lu", io->sizes[d][b]);
+    	    else if (b == IO_BUCKETS-1)
+    		fprintf(fp," %lu+:%lu", 1UL << (b-1), io->sizes[d][b]);
+    	    else
+    		fprintf(fp," %lu-%lu:%lu", 1UL << (b-1), (1UL << b) - 1,
+    			io->sizes[d][b]);
+    	}
+    	fprintf(fp,"\n");
+    }
+}
+
+static void print_io(FILE *fp, const io_stats *io)
+{
+    fprintf(fp,"\tReads %8lu (%lu bytes) Writes %8lu (%lu bytes) ",
+    	    io->calls[IO_READ], io->bytes[IO_READ],
+    	    io->calls[IO_WRITE], io->bytes[IO_WRITE]);
+    if (io->handle < 0)
+    	fprintf(fp,"File %16s Line %d\n", SITE_FILE(io->site), SITE_LINE(io->site));
+    else if (io->name)
+    	fprintf(fp,"File `%s' (handle %d) opened at %s, line %d\n", io->name,
+    		io->handle, SITE_FILE(io->site), SITE_LINE(io->site));
+    else
+    	fprintf(fp,"Handle %d\n", io->handle);
+    print_io_sizes(fp, io);
+}
+
+static void my_io_report(FILE *fp)
+{
+    io_stats *s, *io;
+    unsigned long i, k, n = 0, nsites = 0, nfiles = 0, tiny = 0;
+    int top;
+    GW_LOCK(file_lock);
+    for (i = 0; i < MAX_IO_CHUNKS; i++)
+    	if (io_site_chunks[i])
+    	    nsites += IO_CHUNK;
+    s = (io_stats *)malloc((size_t)(nsites + io_nfiles + 1) * sizeof(io_stats));
+    if (s)
+    {
+    	for (i = 0; i < MAX_IO_CHUNKS; i++)
+    	    if ((io = io_site_chunks[i]) != NULL)
+    		for (k = 0; k < IO_CHUNK; k++)
+    		    if (io[k].site && io_copy(&s[n], &io[k]))
+    			n++;
+    	for (io = io_files; io; io = io->next)
+    	    io_copy(&s[n + nfiles++], io);
+    }
+    GW_UNLOCK(file_lock);
+    if (s == NULL || n == 0)
+    {
+    	free(s);
+    	return;
+    }
+    qsort(s, (size_t)n, sizeof(io_stats), by_io_calls);
+    top = (n < GW_TOP_SITES) ? (int)n : GW_TOP_SITES;
+    fprintf(fp,"TOP I/O SITES BY CALLS (%d of %lu):\n", top, n);
+    for (i = 0; i < (unsigned long)top; i++)
+    	print_io(fp, &s[i]);
+    for (i = 0; i < n; i++)
+    	if (s[i].tiny[IO_READ] + s[i].tiny[IO_WRITE] >= GW_TINY_CALLS)
+    	{
+    	    if (tiny++ == 0)
+    		fprintf(fp,"\nSITES MAKING MANY SMALL read()/write() CALLS (under %d bytes):\n",
+    			GW_TINY_IO);
+    	    fprintf(fp,"\tSmall reads %8lu of %lu, small writes %8lu of %lu File %16s Line %d\n",
+    		    s[i].tiny[IO_READ], s[i].calls[IO_READ],
+    		    s[i].tiny[IO_WRITE], s[i].calls[IO_WRITE],
+    		    SITE_FILE(s[i].site), SITE_LINE(s[i].site));
+    	}
+    if (nfiles)
+    {
+    	qsort(s + n, (size_t)nfiles, sizeof(io_stats), by_io_bytes);
+    	top = (nfiles < GW_TOP_SITES) ? (int)nfiles : GW_TOP_SITES;
+    	fprintf(fp,"\nTOP FILES BY BYTES (%d of %lu):\n", top, nfiles);
+    	for (i = 0; i < (unsigned long)top; i++)
+    	    print_io(fp, &s[n + i]);
+    }
+    fprintf(fp,"\n\n");
+    free(s);
+}
+
+#endif /* GW_IO_STATS */
+
+/***************************/
+/* Mapped memory debugging */
+/***************************/
+
+/* Mappings are kept in a treap ordered by address, so a program
+   holding many of them doesn't pay for each new one with a move of
+   all the rest. They never overlap, so the one holding an address
+   is found by a descent; munmap() may take any part of any number of
+   them, so each it touches is trimmed, split or dropped. Trimming
+   leaves a mapping between its neighbours, so it keeps its place.
+   The last MAP_HISTORY
+   ranges unmapped are remembered so that unmapping one again can
+   say where it went. Mapped bytes are totalled by site apart from
+   the heap's. */
+
+#if !__MSDOS__
+
+#ifndef MAP_HISTORY
+#define MAP_HISTORY	64
+#endif
+
+typedef struct map_info
+{
+    unsigned long start, len;	/* len is a whole number of pages */
+    site_id site;
+    unsigned long prio;		/* above those of its children */
+    struct map_info *left, *right;
+} map_info;
+
+typedef struct
+{
+    unsigned long maps;		/* mappings made here */
+    unsigned long bytes;	/* bytes mapped here */
+    unsigned long live_bytes;	/* of those, still mapped */
+    unsigned long peak_bytes;	/* most live_bytes ever */
+} map_site;
+
+static map_info *map_root = NULL;
+static unsigned long nmaps = 0;
+static unsigned long map_rand = 1;	/* for priorities */
+static map_info map_gone[MAP_HISTORY];	/* site is where unmapped */
+static unsigned long next_gone = 0;
+static map_site *map_sites = NULL;	/* by site id */
+static unsigned long map_nsites = 0;
+static unsigned long map_page = 0;
+
+static unsigned long map_round(unsigned long n)
+{
+    if (map_page == 0)
+    	map_page = (unsigned long)sysconf(_SC_PAGESIZE);
+    return (n + map_page - 1) & ~(map_page - 1);
+}
+
+/* The first mapping that ends after address a, or NULL; so all of
+   them, in order, are for (m = map_first(0); m; m = map_next(m)) */
+
+static map_info *map_first(unsigned long a)
+{
+    map_info *t = map_root, *m = NULL;
+    while (t)
+    {
+    	if (t->start + t->len <= a)
+    	    t = t->right;
+    	else
+    	{
+    	    m = t;
+    	    t = t->left;
+    	}
+    }
+    return m;
+}
+
+#define map_next(m)	map_first((m)->start + (m)->len)
+
+/* Split t into the mappings below key and the rest */
+
+static void map_split(map_info *t, unsigned long key, map_info **lo,
+	map_info **hi)
+{
+    if (t == NULL)
+    	*lo = *hi = NULL;
+    else if (t->start < key)
+    {
+    	map_split(t->right, key, &t->right, hi);
+    	*lo = t;
+    }
+    else
+    {
+    	map_split(t->left, key, lo, &t->left);
+    	*hi = t;
+    }
+}
+
+static map_info *map_join(map_info *lo, map_info *hi)
+{
+    if (lo == NULL)
+    	return hi;
+    if (hi == NULL)
+    	return lo;
+    if (lo->prio > hi->prio)
+    {
+    	lo->right = map_join(lo->right, hi);
+    	return lo;
+    }
+    hi->left = map_join(lo, hi->left);
+    return hi;
+}
+
+static map_info *map_insert(map_info *t, map_info *m)
+{
+    if (t == NULL || m->prio > t->prio)
+    {
+    	map_split(t, m->start, &m->left, &m->right);
+    	return m;
+    }
+    if (m->start < t->start)
+    	t->left = map_insert(t->left, m);
+    else
+    	t->right = map_insert(t->right, m);
+    return t;
+}
+
+static map_info *map_delete(map_info *t, unsigned long start)
+{
+    if (t == NULL)
+    	return NULL;
+    if (start < t->start)
+    	t->left = map_delete(t->left, start);
+    else if (start > t->start)
+    	t->right = map_delete(t->right, start);
+    else
+    	return map_join(t->left, t->right);
+    return t;
+}
+
+/* Register pages a to a+n, with map_lock held; 0 if out of memory */
+
+static int map_link(unsigned long a, unsigned long n, site_id site)
+{
+    map_info *m = (map_info *)malloc(sizeof(map_info));
+    if (m == NULL)
+    	return 0;
+    m->start = a;
+    m->len = n;
+    m->site = site;
+    map_rand = map_rand * 1103515245UL + 12345;
+    m->prio = map_rand >> 8;
+    m->left = m->right = NULL;
+    map_root = map_insert(map_root, m);
+    nmaps++;
+    return 1;
+}
+
+static void map_unlink(map_info *m)
+{
+    map_root = map_delete(map_root, m->start);
+    free(m);
+    nmaps--;
+}
+
+static map_site *map_site_of(site_id site)
+{
+    if (site >= map_nsites)
+    {
+    	unsigned long n = map_nsites ? map_nsites : 64;
+    	map_site *ms;
+    	while (n <= site)
+    	    n *= 2;
+    	if ((ms = (map_site *)realloc(map_sites, n * sizeof(map_site))) == NULL)
+    	    return NULL;
+    	memset(ms + map_nsites, 0, (n - map_nsites) * sizeof(map_site));
+    	map_sites = ms;
+    	map_nsites = n;
+    }
+    return &map_sites[site];
+}
+
+/* Take the pages from a to a+n out of the registry, with map_lock
+   held, and return how many of those bytes were mapped. If warn is
+   set, leaving part of a mapping behind is reported. */
+
+static unsigned long map_cut(unsigned long a, unsigned long n,
+	char *f, int l, int warn)
+{
+    unsigned long end = a + n, total = 0;
+    map_info *m;
+    while ((m = map_first(a)) != NULL && m->start < end)
+    {
+    	unsigned long mstart = m->start, mend = m->start + m->len;
+    	unsigned long lo = (mstart > a) ? mstart : a;
+    	unsigned long hi = (mend < end) ? mend : end;
+    	site_id site = m->site;
+    	if (warn && hi - lo < m->len)
+    	    log_event(GW_E_MUNMAP_PARTIAL, NULL, f, l, SITE_FILE(site),
+    		    SITE_LINE(site), (long)m->len, (long)(hi - lo));
+#ifdef GW_BINARY_TRACE
+    	log_trace(GW_E_UNMAP, NULL, (void *)lo, (long)(hi - lo), 0, f, l);
+#endif
+    	if (lo > mstart && hi < mend && !map_link(hi, mend - hi, site))
+    	    hi = mend; /* can't split it, so stop tracking the rest */
+    	map_sites[site].live_bytes -= hi - lo;
+    	total += hi - lo;
+    	if (lo > mstart)
+    	    m->len = lo - mstart;
+    	else if (hi < mend)
+    	{
+    	    m->start = hi;
+    	    m->len = mend - hi;
+    	}
+    	else
+    	    map_unlink(m);
+    	a = hi;
+    }
+    return total;
+}
+
+/* Add a mapping, with map_lock held. Whatever it replaced (as with
+   MAP_FIXED) is gone without a word. old is how many bytes it had
+   before it was moved or resized, or 0 if it is new. */
+
+static void map_add(unsigned long a, unsigned long n, site_id site,
+	unsigned long old, char *f, int l)
+{
+    map_site *ms;
+    unsigned long i;
+    map_cut(a, n, f, l, 0);
+    for (i = 0; i < MAP_HISTORY; i++)
+    	if (map_gone[i].start < a + n && a < map_gone[i].start + map_gone[i].len)
+    	    map_gone[i].len = 0;
+    if ((ms = map_site_of(site)) == NULL || !map_link(a, n, site))
+    	return;
+    if (old == 0)
+    	ms->maps++;
+    if (n > old)
+    	ms->bytes += n - old;
+    if ((ms->live_bytes += n) > ms->peak_bytes)
+    	ms->peak_bytes = ms->live_bytes;
+#ifdef GW_BINARY_TRACE
+    log_trace(GW_E_MAP, NULL, (void *)a, (long)n, (long)old,
+    	    SITE_FILE(site), SITE_LINE(site));
+#endif
+}
+
+static void map_forget(unsigned long a, unsigned long n, site_id site)
+{
+    map_gone[next_gone].start = a;
+    map_gone[next_gone].len = n;
+    map_gone[next_gone].site = site;
+    next_gone = (next_gone + 1) % MAP_HISTORY;
+}
+
+/* Report a range that isn't mapped, with map_lock held */
+
+static void map_unknown(char *name, unsigned long a, unsigned long n,
+	char *f, int l)
+{
+    unsigned long i;
+    for (i = 0; i < MAP_HISTORY; i++)
+    	if (map_gone[i].start < a + n && a < map_gone[i].start + map_gone[i].len)
+    	{
+    	    log_event(GW_E_MUNMAP_TWICE, name, f, l,
+    		    SITE_FILE(map_gone[i].site), SITE_LINE(map_gone[i].site),
+    		    (long)a, (long)n);
+    	    return;
+    	}
+    log_event(GW_E_MUNMAP_UNKNOWN, name, f, l, NULL, 0, (long)a, (long)n);
+}
+
+void *my_mmap(void *a, size_t n, int prot, int flags, int fd, off_t off,
+	char *f, int l)
+{
+    void *rtn;
+    if (!logfile) my_initialise();
+    rtn = mmap(a, n, prot, flags, fd, off);
+    if (rtn == MAP_FAILED)
+    {
+    	int err = errno;
+    	log_event(GW_E_MMAP_FAIL, "mmap", f, l, NULL, 0, (long)n, (long)err);
+    	errno = err;
+    }
+    else if (n)
+    {
+    	site_id site = store_site(f, l);
+    	GW_LOCK(map_lock);
+    	map_add((unsigned long)rtn, map_round(n), site, 0, f, l);
+    	GW_UNLOCK(map_lock);
+    }
+    return rtn;
+}
+
+int my_munmap(void *a, size_t n, char *f, int l)
+{
+    unsigned long p = (unsigned long)a, len = map_round(n);
+    int rtn;
+    if (!logfile) my_initialise();
+    if (n == 0 || (p & (map_page - 1)))
+    	return munmap(a, n); /* it will fail */
+    /* map_lock is held across the call, so no one can be given these
+       pages and register them before they are out of the registry;
+       the kernel serialises the two calls anyway */
+    GW_LOCK(map_lock);
+    if ((rtn = munmap(a, n)) == 0)
+    {
+    	if (map_cut(p, len, f, l, 1))
+    	    map_forget(p, len, store_site(f, l));
+    	else
+    	    map_unknown("munmap", p, len, f, l);
+    }
+    GW_UNLOCK(map_lock);
+    return rtn;
+}
+
+#ifdef __linux__
+
+/* A mapping that is moved or resized stays with the site that made
+   it; only a new one, made from shared pages with a length of 0, or
+   one we didn't know of, goes to the caller */
+
+void *my_mremap(void *a, size_t n, size_t m, int flags, void *na,
+	char *f, int l)
+{
+    unsigned long p = (unsigned long)a, len = map_round(n), old;
+    map_info *mp;
+    site_id site;
+    void *rtn;
+    if (!logfile) my_initialise();
+    GW_LOCK(map_lock); /* as for munmap */
+    mp = map_first(p);
+    if (mp == NULL || mp->start > p)
+    {
+    	map_unknown("mremap", p, len, f, l);
+    	site = store_site(f, l);
+    }
+    else
+    	site = n ? mp->site : store_site(f, l);
+    rtn = mremap(a, n, m, flags, na);
+    if (rtn == MAP_FAILED)
+    {
+    	int err = errno;
+    	log_event(GW_E_MMAP_FAIL, "mremap", f, l, NULL, 0, (long)m, (long)err);
+    	errno = err;
+    }
+    else
+    {
+    	old = n ? map_cut(p, len, f, l, 0) : 0;
+    	if (old && rtn != a)
+    	    map_forget(p, len, store_site(f, l));
+    	map_add((unsigned long)rtn, map_round(m), site, old, f, l);
+    }
+    GW_UNLOCK(map_lock);
+    return rtn;
+}
+
+#endif /* __linux__ */
+
+#if defined(GW_BINARY_LOG) && !defined(GW_BINARY_TRACE)
+
+/* Write out the mappings still there and the totals by site, for
+   gwdecode to report */
+
+static void log_maps(void)
+{
+    unsigned long i;
+    map_info *m;
+    GW_LOCK(map_lock);
+    for (m = map_first(0); m; m = map_next(m))
+    	log_trace(GW_E_MAP, NULL, (void *)m->start, (long)m->len, 0,
+    		SITE_FILE(m->site), SITE_LINE(m->site));
+    for (i = 1; i < map_nsites; i++)
+    	if (map_sites[i].maps)
+    	    log_trace(GW_E_MAP_SITE, NULL, (void *)map_sites[i].peak_bytes,
+    		    (long)map_sites[i].maps, (long)map_sites[i].bytes,
+    		    SITE_FILE(i), SITE_LINE(i));
+    GW_UNLOCK(map_lock);
+}
+
+#endif
+
+typedef struct
+{
+    map_site st;
+    char *file;
+    int line;
+} map_row;
+
+static int by_mapped(const void *a, const void *b)
+{
+    const map_row *x = (const map_row *)a;
+    const map_row *y = (const map_row *)b;
+    int c;
+    if (x->st.live_bytes != y->st.live_bytes)
+    	return (x->st.live_bytes < y->st.live_bytes) ? 1 : -1;
+    if (x->st.bytes != y->st.bytes)
+    	return (x->st.bytes < y->st.bytes) ? 1 : -1;
+    c = strcmp(x->file, y->file);
+    return c ? c : x->line - y->line;
+}
+
+/* The mappings still there, then the totals by site */
+
+static void my_map_report(FILE *fp, int is_last)
+{
+    unsigned long i, n = 0;
+    map_info *m;
+    map_row *r;
+    GW_LOCK(map_lock);
+    if (nmaps)
+    {
+    	fprintf(fp, is_last ? "MAPPING LEAKS:\n" : "Mapped Regions:\n");
+    	for (m = map_first(0); m; m = map_next(m))
+    	    fprintf(fp,"\tMapping %#lx Size %8lu mapped at %s, line %d\n",
+    		    m->start, m->len, SITE_FILE(m->site), SITE_LINE(m->site));
+    	fprintf(fp,"\n\n");
+    }
+    r = (map_row *)malloc((size_t)(map_nsites ? map_nsites : 1) * sizeof(map_row));
+    if (r)
+    	for (i = 1; i < map_nsites; i++)
+    	    if (map_sites[i].maps)
+    	    {
+    		r[n].st = map_sites[i];
+    		r[n].file = SITE_FILE(i);
+    		r[n].line = SITE_LINE(i);
+    		n++;
+    	    }
+    GW_UNLOCK(map_lock);
+    if (n)
+    {
+    	qsort(r, (size_t)n, sizeof(map_row), by_mapped);
+    	fprintf(fp,"MAPPED MEMORY BY SITE:\n");
+    	for (i = 0; i < n; i++)
+    	    fprintf(fp,"\tLive %10lu (peak %lu) Mapped %10lu in %6lu maps File %16s Line %d\n",
+    		    r[i].st.live_bytes, r[i].st.peak_bytes, r[i].st.bytes,
+    		    r[i].st.maps, r[i].file, r[i].line);
+    	fprintf(fp,"\n\n");
+    }
+    free(r);
+}
+
+#endif /* !__MSDOS__ */
+
+/*************************/
+/* Building on the past! */
+/*************************/
+
+/* Resize a live block with the C library's realloc and move its
+   registry entry to wherever the block ends up. Returns 0 if done,
+   1 if out of memory (the block is untouched), -1 if p is not a
+   live block of the right kind, or -2 if it is a guarded block,
+   which can't be resized (both also untouched). */
+
+static int log_realloc(void far **pp, unsigned long n, char *f, int l,
+	int isfar)
+{
+    void far *p = *pp;
+    blk_info far *bp, far *nbp;
+    heap_shard *sh;
+    thread_counts *tc;
+    unsigned long c, b, oldsize;
+    site_id oldsite;
+    long slot;
+    if (!logfile) my_initialise();
+    sh = shard_of(p);
+    GW_LOCK(sh->lock);
+    slot = index_find(sh, p);
+    bp = GET_BLK(p);
+    if (slot < 0 || bp->magic != MAGIC || ((bp->flags&ISFAR)!=0) != isfar)
+    {
+    	GW_UNLOCK(sh->lock);
+    	return -1;
+    }
+    if (bp->flags & ISGUARD)
+    {
+    	GW_UNLOCK(sh->lock);
+    	return -2; /* not from malloc; the caller moves it */
+    }
+    if (!TST_ENDMAGIC(p, bp->nbytes))
+    	log_event(GW_E_OVERRUN_FREE, NULL, f, l,
+    		SITE_FILE(bp->site), SITE_LINE(bp->site), bp->nbytes, 0);
+    oldsize = (unsigned long)bp->nbytes;
+    oldsite = bp->site;
+    /* Take it out while the C library moves it, so no report walks
+       through the old header after it is gone, and no shard waits
+       on the C library */
+    unlink_block(sh, p, slot);
+    GW_UNLOCK(sh->lock);
+#if __MSDOS__
+    if (isfar)
+    	nbp = (blk_info far *)farrealloc(bp, BUMPSIZE(n));
+    else
+#endif
+#if defined(__TINY__) || defined(__SMALL__) || defined(__MEDIUM__)
+    nbp = (blk_info far *)realloc(((char *)p) - sizeof(blk_info),
+    		(size_t)BUMPSIZE(n));
+#else
+    nbp = (blk_info far *)SYS_REALLOC(bp, (size_t)BUMPSIZE(n));
+#endif
+    if (nbp == NULL)
+    {
+    	GW_LOCK(sh->lock);
+    	relink_block(sh, p);
+    	GW_UNLOCK(sh->lock);
+    	return 1;
+    }
+#ifdef GW_SAMPLE
+    GW_ATOMIC_SUB(FILTER_SLOT(p), 1);
+#endif
+    /* Count it as a free of the old block and an allocation here */
+    ESTIMATE(oldsize, WEIGHT_OF(nbp), c, b);
+    tc = my_counts();
+    tc->frees += c;
+    tc->bytes_freed += b;
+    count_site_free(site_of(oldsite), c, b);
+#ifdef GW_BINARY_TRACE
+    log_trace(GW_E_FREE, NULL, p, (long)oldsize, 0, store_name(f), l);
+#endif
+    log_alloc(nbp, n, f, l, nbp->flags & ~ISSWEPT, WEIGHT_OF(nbp));
+    *pp = GET_DATA(nbp);
+#ifdef GW_SHADOW
+    shadow_resize(nbp, *pp, oldsize, n);
+#endif
+    return 0;
+}
+
+void *my_realloc(void *p, unsigned n, char *f, int l)
+{
+    void far *rtn = p;
+    STACK_ENTRY;
+    if (p == NULL)
+    	return my_calloc(n,f,l);
+#ifdef GW_SAMPLE
+    if (FILTER_SLOT(p) == 0 || my_find_block(p) == NULL)
+    	return realloc(p, n);
+#elif defined(GW_UNTRACKED)
+    if (my_find_block(p) == NULL)
+    	return realloc(p, n);
+#endif
+    switch (log_realloc(&rtn, (unsigned long)n, f, l, 0))
+    {
+    case 0:
+    	return (void *)rtn;
+    case 1:
+    	return NULL;
+#ifdef GW_GUARD
+    case -2:
+    	rtn = track_calloc(n,f,l,WEIGHT_OF(GET_BLK(p)));
+    	{
+    	    long old = (GET_BLK(p))->nbytes;
+    	    size_t keep = (size_t)((long)n < old ? (long)n : old);
+#ifdef GW_SHADOW
+    	    shadow_new(GET_BLK(rtn), rtn, (unsigned long)n);
+#endif
+    	    memcpy(rtn, p, keep);
+#ifdef GW_SHADOW
+    	    shadow_copy(GET_BLK(rtn), 0, GET_BLK(p), p, (unsigned long)keep);
+#endif
+    	}
+    	my_free(p,f,l);
+    	return (void *)rtn;
+#endif
+    }
+    /* Not ours; say so, and give them a fresh block */
+    my_free(p,f,l);
+    return my_calloc(n,f,l);
+}
+
+#if __MSDOS__
+void far *my_frealloc(void far *p, unsigned long n, char *f, int l)
+{
+    void far *rtn = p;
+    if (p == NULL)
+    	return my_fcalloc(n,f,l);
+    switch (log_realloc(&rtn, n, f, l, 1))
+    {
+    case 0:
+    	return rtn;
+    case 1:
+    	return NULL;
+    }
+    my_ffree(p,f,l);
+    return my_fcalloc(n,f,l);
+}
+#endif
+
+/*******************************/
+/* Managed name and site store */
+/*******************************/
+
+/* Names (file names, and the names of files opened) are kept once
+   each, in an open-addressed hash table keyed by their contents, so
+   the pointers store_name returns are stable and can be compared.
+   Call sites are (name, line) pairs, handed out consecutive ids and
+   kept in chunks that never move, so site_of needs no lock; a second
+   hash table finds the id for a pair. Both tables are kept at most
+   half full and grow as needed.
+*/
+
+#ifndef SITE_CHUNK
+#define SITE_CHUNK	1024	/* sites per chunk */
+#endif
+
+#ifndef MAX_SITE_CHUNKS
+#define MAX_SITE_CHUNKS	4096
+#endif
+
+static char **name_table = NULL;
+static unsigned long name_table_size = 0;
+static unsigned long name_table_used = 0;
+
+static site_id *site_table = NULL;
+static unsigned long site_table_size = 0;
+static site_id next_site = 1;
+
+static site_info *site_chunks[MAX_SITE_CHUNKS];
+static site_info unknown_site = { "unknown", 0, 0, 0, 0, 0, 0, 0 };
+
+static unsigned long str_hash(char *s)
+{
+    unsigned long h = 2166136261UL;
+    while (*s)
+    	h = (h ^ (unsigned char)*s++) * 16777619UL;
+    return h;
+}
+
+static unsigned long site_hash(char *name, int line)
+{
+    unsigned long h = ((unsigned long)(char huge *)name >> 3) + (unsigned long)line;
+    h *= 2654435761UL;
+    return h ^ (h >> 15);
+}
+
+static site_info *site_of(site_id id)
+{
+    /* ids read back from freed memory may be junk */
+    if (id == 0 || id >= LOAD_ACQ(next_site))
+    	return &unknown_site;
+    return &site_chunks[id / SITE_CHUNK][id % SITE_CHUNK];
+}
+
+/* store_name without the lock */
+
+static char *intern_name(char *name)
+{
+    unsigned long i, mask;
+    char *copy;
+    if ((name_table_used+1)*2 > name_table_size)
+    {
+    	char **old = name_table;
+    	unsigned long j, oldsize = name_table_size;
+    	name_table_size = oldsize ? oldsize*2 : 256;
+    	name_table = (char **)calloc((size_t)name_table_size, sizeof(char *));
+    	assert(name_table);
+    	mask = name_table_size-1;
+    	for (j = 0; j < oldsize; j++)
+    	{
+    	    if (old[j])
+    	    {
+    	    	i = str_hash(old[j]) & mask;
+    	    	while (name_table[i])
+    	    	    i = (i+1) & mask;
+    	    	name_table[i] = old[j];
+    	    }
+    	}
+    	if (old) free(old);
+    }
+    mask = name_table_size-1;
+    i = str_hash(name) & mask;
+    while (name_table[i])
+    {
+    	if (strcmp(name_table[i], name) == 0)
+    	    return name_table[i];
+    	i = (i+1) & mask;
+    }
+    copy = (char *)malloc(strlen(name)+1);
+    assert(copy);
+    strcpy(copy, name);
+    name_table[i] = copy;
+    name_table_used++;
+    return copy;
+}
+
+static char *store_name(char *name)
+{
+    char *rtn;
+    if (name == NULL) return NULL;
+    GW_LOCK(name_lock);
+    rtn = intern_name(name);
+    GW_UNLOCK(name_lock);
+    return rtn;
+}
+
+/* store_site without the cache */
+
+static site_id lookup_site(char *file, int line)
+{
+    unsigned long i, mask;
+    site_id id;
+    site_info *sp;
+    GW_LOCK(name_lock);
+    file = intern_name(file);
+    if (((unsigned long)next_site+1)*2 > site_table_size)
+    {
+    	site_id *old = site_table;
+    	unsigned long j, oldsize = site_table_size;
+    	site_table_size = oldsize ? oldsize*2 : 1024;
+    	site_table = (site_id *)calloc((size_t)site_table_size, sizeof(site_id));
+    	assert(site_table);
+    	mask = site_table_size-1;
+    	for (j = 0; j < oldsize; j++)
+    	{
+    	    if (old[j])
+    	    {
+    	    	sp = site_of(old[j]);
+    	    	i = site_hash(sp->file, sp->line) & mask;
+    	    	while (site_table[i])
+    	    	    i = (i+1) & mask;
+    	    	site_table[i] = old[j];
+    	    }
+    	}
+    	if (old) free(old);
+    }
+    mask = site_table_size-1;
+    i = site_hash(file, line) & mask;
+    while ((id = site_table[i]) != 0)
+    {
+    	sp = site_of(id);
+    	if (sp->file == file && sp->line == line)
+    	{
+    	    GW_UNLOCK(name_lock);
+    	    return id;
+    	}
+    	i = (i+1) & mask;
+    }
+    id = next_site;
+    if (id / SITE_CHUNK >= MAX_SITE_CHUNKS)
+    {
+    	GW_UNLOCK(name_lock);
+    	return 0; /* out of room; report it as unknown */
+    }
+    if (site_chunks[id / SITE_CHUNK] == NULL)
+    {
+    	site_chunks[id / SITE_CHUNK] =
+    	    (site_info *)calloc(SITE_CHUNK, sizeof(site_info));
+    	assert(site_chunks[id / SITE_CHUNK]);
+    }
+    sp = &site_chunks[id / SITE_CHUNK][id % SITE_CHUNK];
+    sp->file = file;
+    sp->line = line;
+    site_table[i] = id;
+    STORE_REL(next_site, id+1);
+    GW_UNLOCK(name_lock);
+    return id;
+}
+
+/* Each thread remembers the sites it looked up last, by the name
+   pointer it was given and the line, so most calls find theirs
+   without name_lock or hashing the name. The name is compared as
+   well, in case the pointer was to a buffer since reused. */
+
+#ifndef SITE_CACHE
+#define SITE_CACHE	32	/* a power of two */
+#endif
+
+typedef struct
+{
+    char *file;		/* as passed to store_site */
+    int line;
+    site_id id;
+} site_cache_entry;
+
+static GW_TLS site_cache_entry site_cache[SITE_CACHE];
+
+static site_id store_site(char *file, int line)
+{
+    site_cache_entry *ce;
+    site_id id;
+    if (file == NULL) return 0;
+    ce = &site_cache[site_hash(file, line) & (SITE_CACHE-1)];
+    if (ce->id && ce->file == file && ce->line == line)
+    {
+    	char *name = site_of(ce->id)->file;
+    	if (name == file || strcmp(name, file) == 0)
+    	    return ce->id;
+    }
+    if ((id = lookup_site(file, line)) != 0)
+    {
+    	ce->file = file;
+    	ce->line = line;
+    	ce->id = id;
+    }
+    return id;
+}
+
+/* Per-site totals. These are bumped without a lock (atomically under
+   GW_THREADS), so a report taken while other threads run is only
+   approximately consistent. */
+
+static void count_site_alloc(site_info *sp, unsigned long count,
+	unsigned long bytes)
+{
+    unsigned long lb;
+    GW_ATOMIC_ADD(sp->allocs, count);
+    GW_ATOMIC_ADD(sp->bytes, bytes);
+    GW_ATOMIC_ADD(sp->live, count);
+    lb = GW_ATOMIC_ADD(sp->live_bytes, bytes);
+#ifdef GW_THREADS
+    {
+    	unsigned long pk = __atomic_load_n(&sp->peak_bytes, __ATOMIC_RELAXED);
+    	while (lb > pk && !__atomic_compare_exchange_n(&sp->peak_bytes, &pk, lb,
+    		0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    	    ;
+    }
+#else
+    if (lb > sp->peak_bytes)
+    	sp->peak_bytes = lb;
+#endif
+}
+
+static void count_site_free(site_info *sp, unsigned long count,
+	unsigned long bytes)
+{
+    GW_ATOMIC_ADD(sp->frees, count);
+    GW_ATOMIC_SUB(sp->live, count);
+    GW_ATOMIC_SUB(sp->live_bytes, bytes);
+}
+
+/* Ties are broken by place so reports don't depend on table order */
+
+static int by_place(const gw_site_stats *x, const gw_site_stats *y)
+{
+    int c = strcmp(x->file, y->file);
+    return c ? c : x->line - y->line;
+}
+
+static int by_bytes(const void *a, const void *b)
+{
+    const gw_site_stats *x = (const gw_site_stats *)a;
+    const gw_site_stats *y = (const gw_site_stats *)b;
+    if (x->bytes != y->bytes)
+    	return (x->bytes < y->bytes) ? 1 : -1;
+    if (x->allocs != y->allocs)
+    	return (x->allocs < y->allocs) ? 1 : -1;
+    return by_place(x, y);
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const gw_site_stats *x = (const gw_site_stats *)a;
+    const gw_site_stats *y = (const gw_site_stats *)b;
+    if (x->allocs != y->allocs)
+    	return (x->allocs < y->allocs) ? 1 : -1;
+    if (x->bytes != y->bytes)
+    	return (x->bytes < y->bytes) ? 1 : -1;
+    return by_place(x, y);
+}
+
+static void print_sites(FILE *fp, gw_site_stats *s, unsigned long n)
+{
+    unsigned long i;
+    for (i = 0; i < n; i++)
+    	fprintf(fp,"\tBytes %10lu Allocs %8lu Frees %8lu Live %6lu (%lu bytes, peak %lu) File %16s Line %d\n",
+    		s[i].bytes, s[i].allocs, s[i].frees, s[i].live,
+    		s[i].live_bytes, s[i].peak_bytes, s[i].file, s[i].line);
+}
+
+void gw_site_report(FILE *fp, gw_site_stats *s, unsigned long n, int top)
+{
+    unsigned long i, used = 0;
+    /* leave out sites that only ever opened files */
+    for (i = 0; i < n; i++)
+    	if (s[i].allocs)
+    	    s[used++] = s[i];
+    if (used == 0 || top <= 0)
+    	return;
+    if ((unsigned long)top > used)
+    	top = (int)used;
+    qsort(s, (size_t)used, sizeof(gw_site_stats), by_bytes);
+    fprintf(fp,"TOP ALLOCATION SITES BY BYTES (%d of %lu):\n", top, used);
+    print_sites(fp, s, (unsigned long)top);
+    qsort(s, (size_t)used, sizeof(gw_site_stats), by_count);
+    fprintf(fp,"\nTOP ALLOCATION SITES BY COUNT (%d of %lu):\n", top, used);
+    print_sites(fp, s, (unsigned long)top);
+}
+
+/* A site's totals, in whole blocks */
+
+static void copy_site(gw_site_stats *to, site_id id)
+{
+    *to = *site_of(id);
+    to->allocs = WHOLE(to->allocs);
+    to->frees = WHOLE(to->frees);
+    to->live = WHOLE(to->live);
+}
+
+#if defined(GW_BINARY_LOG) && !defined(GW_BINARY_TRACE)
+
+/* Write out the totals of the sites that have allocated, and the
+   overall totals, for gwdecode to report; it works out the frees
+   from the live blocks, which must come first */
+
+static void log_sites(void)
+{
+    gw_site_stats *s;
+    gw_counters c;
+    unsigned long i, n;
+    GW_LOCK(name_lock);
+    n = (unsigned long)next_site - 1;
+    s = (gw_site_stats *)malloc((size_t)(n ? n : 1) * sizeof(gw_site_stats));
+    if (s)
+    	for (i = 1; i <= n; i++)
+    	    s[i-1] = *site_of((site_id)i);
+    GW_UNLOCK(name_lock);
+    for (i = 0; s && i < n; i++)
+    	if (s[i].allocs)
+    	    log_trace(GW_E_SITE, NULL, (void *)s[i].peak_bytes,
+    		    (long)s[i].allocs, (long)s[i].bytes, s[i].file, s[i].line);
+    free(s);
+    sum_counters(&c);
+    log_trace(GW_E_COUNTS, NULL, NULL, (long)c.allocs,
+    	    (long)c.bytes_allocated, NULL, 0);
+}
+
+#endif
+
+static void my_site_report(FILE *fp)
 {
-    /* Just validate arguments */
-    if (s1==NULL && s2==NULL)
-    	fprintf(logfile,"%s(NULL,NULL) at file %s, line %d\n",
-    		name, f, l);
-    else if (s1==NULL)
-    	fprintf(logfile,"%s(NULL,...) at file %s, line %d\n", name, f, l);
-    else if (s2==NULL)
-    	fprintf(logfile,"%s(...,NULL) at file %s, line %d\n", name, f, l);
-    else if ((flags&INIT1) && my_init_check(s1, siz1, (flags&NULLT)!=0) == 0)
-        fprintf(logfile,"%s(invalid,...) at file %s, line %d\n", name, f, l);
-    else if ((flags&INIT2) && my_init_check(s2, siz2, (flags&NULLT)!=0) == 0)
-        fprintf(logfile,"%s(...,invalid) at file %s, line %d\n", name, f, l);
-    else return 0;
-    return -1;
+    gw_site_stats *s;
+    unsigned long i, n;
+    GW_LOCK(name_lock);
+    n = (unsigned long)next_site - 1;
+    s = (gw_site_stats *)malloc((size_t)(n ? n : 1) * sizeof(gw_site_stats));
+    if (s)
+    	for (i = 1; i <= n; i++)
+    	    copy_site(&s[i-1], (site_id)i);
+    GW_UNLOCK(name_lock);
+    if (s == NULL)
+    	return;
+    gw_site_report(fp, s, n, GW_TOP_SITES);
+    free(s);
 }
 
-/* Handler for strcpy, stpcpy, strncpy, strcat, strncat, memcpy,
-	and memmove */
+/******************/
+/* Heap snapshots */
+/******************/
 
-char *my_copy(char *d, int space_avail, int limit, char *s,
-	int sspace, int flag, char *f, int l, unsigned strflags)
+/* A snapshot is a block number: the highest in any shard, which
+   every shard is then brought up to, so the blocks linked in before
+   it are numbered no higher and those after it higher. Each shard's
+   list is in descending order, so the live blocks allocated between
+   two snapshots are found by walking each list from the head until
+   an older block turns up, and the work done is in proportion to
+   those blocks rather than the whole heap. A realloc'ed block counts
+   as new. */
+
+unsigned long gw_snapshot(void)
 {
-    char *rtn = d;
-    int space_needed, i, dlen;
+    unsigned long seq = 0;
+    int s;
     if (!logfile) my_initialise();
-    space_avail = my_sizehint(d, space_avail);
-    sspace = my_sizehint(s, sspace);
-    if (my_validate2(strflags?"String copy":"Mem copy", d, space_avail,
-		s, sspace, f,l,INIT2|strflags))
-	return d;
-    /* how much space do we need? */
-    space_needed = limit ? limit : (strflags ? (strlen(s)+1) : space_avail);
-    /* Are we cat'ing? If so, how long is the existing stuff? */
-    dlen = (flag&4) ? strlen(d) : 0;
-    /* space enuf? */
-    limit = space_needed;
-    if (space_avail >= 0 && space_needed > (space_avail-dlen))
+    for (s = 0; s < GW_SHARDS; s++)
     {
-    	fprintf(logfile,"String/memory copy overrun at file %s, line %d - truncating\n\ttarget space %d, source length %d\n",
-    		f, l, (space_avail-dlen), space_needed);
-    	limit = space_avail-dlen;
+    	GW_LOCK(heap_shards[s].lock);
+    	if (heap_shards[s].seq > seq)
+    	    seq = heap_shards[s].seq;
     }
-    else if (space_avail >= 0 && sspace >= 0 && sspace > (space_avail-dlen))
-    	fprintf(logfile,"Potential string/memory copy overrun at file %s, line %d\n\ttarget space %d, source size %d\n",
-    		f, l, (space_avail-dlen), sspace);
-    d += dlen;
-    if (s<d && (s+limit)>=d && (flag&1)==0) /* forward copy would clobber source */
-    	fprintf(logfile,"String/memory copy clobber in %s, line %d\n", f, l);
-    memmove(d,s,limit);
-    return rtn + ( (flag & 2) ? (limit-1) : 0); /* hax for stpcpy */
+    for (s = GW_SHARDS; s--; )
+    {
+    	heap_shards[s].seq = seq;
+    	GW_UNLOCK(heap_shards[s].lock);
+    }
+    return seq;
+}
+
+/* Print the live blocks allocated after snapshot a and no later
+   than snapshot b to fp, by site, most bytes first; returns how
+   many there are. With fp NULL, the text log is used. */
+
+unsigned long gw_snapshot_diff(unsigned long a, unsigned long b, FILE *fp)
+{
+    unsigned long nsites, *touched, ntouched = 0, blocks = 0, bytes = 0, i;
+    gw_site_stats *counts, *sites;
+    int sh;
+    if (!logfile) my_initialise();
+    if (b <= a)
+    	return 0;
+    /* the blocks we'll see got their sites before they were linked */
+    nsites = (unsigned long)LOAD_ACQ(next_site);
+    GW_ENTER;
+    counts = (gw_site_stats *)calloc((size_t)nsites, sizeof(gw_site_stats));
+    touched = (unsigned long *)malloc((size_t)nsites * sizeof(unsigned long));
+    if (counts == NULL || touched == NULL)
+    {
+    	free(counts);
+    	free(touched);
+    	GW_LEAVE;
+    	return 0;
+    }
+    for (sh = 0; sh < GW_SHARDS; sh++)
+    {
+    	void far *p;
+    	GW_LOCK(heap_shards[sh].lock);
+    	for (p = heap_shards[sh].list_head; p; p = (GET_BLK(p))->next)
+    	{
+    	    blk_info far *bp = GET_BLK(p);
+    	    unsigned long id = (unsigned long)bp->site, c, n;
+    	    if (bp->seq > b)
+    	    	continue;
+    	    if (bp->seq <= a)
+    	    	break;
+    	    if (id >= nsites)
+    	    	id = 0;
+    	    ESTIMATE((unsigned long)bp->nbytes, WEIGHT_OF(bp), c, n);
+    	    if (counts[id].allocs == 0)
+    	    	touched[ntouched++] = id;
+    	    counts[id].allocs += c;
+    	    counts[id].bytes += n;
+    	    blocks += c;
+    	    bytes += n;
+    	}
+    	GW_UNLOCK(heap_shards[sh].lock);
+    }
+    /* gather up the sites that came up */
+    sites = (gw_site_stats *)malloc((size_t)(ntouched ? ntouched : 1)
+    		* sizeof(gw_site_stats));
+    for (i = 0; sites && i < ntouched; i++)
+    {
+    	site_info *sp = site_of((site_id)touched[i]);
+    	sites[i] = counts[touched[i]];
+    	sites[i].file = sp->file;
+    	sites[i].line = sp->line;
+    }
+#ifndef GW_BINARY_LOG
+    if (fp == NULL)
+    	fp = logfile;
+#endif
+    if (fp && sites && ntouched)
+    {
+    	qsort(sites, (size_t)ntouched, sizeof(gw_site_stats), by_bytes);
+    	fprintf(fp,"LIVE BLOCKS ALLOCATED SINCE SNAPSHOT %lu (TO %lu): %lu blocks, %lu bytes\n",
+    		a, b, WHOLE(blocks), bytes);
+    	for (i = 0; i < ntouched; i++)
+    	    fprintf(fp,"\tBytes %10lu Blocks %8lu File %16s Line %d\n",
+    		    sites[i].bytes, WHOLE(sites[i].allocs),
+    		    sites[i].file, sites[i].line);
+    	fprintf(fp,"\n");
+    	fflush(fp);
+    }
+    free(sites);
+    free(counts);
+    free(touched);
+    GW_LEAVE;
+    return WHOLE(blocks);
+}
+
+/****************/
+/* Live reports */
+/****************/
+
+/* A report on a running program can't walk the live list, as that
+   would hold up every thread that allocates until it was done.
+   Instead it goes by the per-site totals, which are kept up to date
+   without locks, and the file table; each is locked only long
+   enough to copy. */
+
+static int by_live(const void *a, const void *b)
+{
+    const gw_site_stats *x = (const gw_site_stats *)a;
+    const gw_site_stats *y = (const gw_site_stats *)b;
+    if (x->live_bytes != y->live_bytes)
+    	return (x->live_bytes < y->live_bytes) ? 1 : -1;
+    if (x->live != y->live)
+    	return (x->live < y->live) ? 1 : -1;
+    return by_place(x, y);
+}
+
+void gw_live_report(FILE *fp)
+{
+    time_t tm = time(NULL);
+    gw_counters c;
+    gw_site_stats *s;
+    unsigned long i, n, used = 0;
+    if (!logfile) my_initialise();
+#ifndef GW_BINARY_LOG
+    if (fp == NULL)
+    	fp = logfile;
+#endif
+    if (fp == NULL)
+    	return;
+    GW_ENTER;
+    gw_get_counters(&c);
+    fprintf(fp,"\n================ LIVE DEBUG REPORT ===================\n");
+    fprintf(fp,"Report date: %s\n", ctime(&tm));
+    fprintf(fp,"%lu allocations (%lu bytes), %lu frees (%lu bytes), %lu blocks live\n\n",
+    		c.allocs, c.bytes_allocated, c.frees, c.bytes_freed,
+    		c.live_blocks);
+    GW_LOCK(name_lock);
+    n = (unsigned long)next_site - 1;
+    s = (gw_site_stats *)malloc((size_t)(n ? n : 1) * sizeof(gw_site_stats));
+    if (s)
+    	for (i = 1; i <= n; i++)
+    	    copy_site(&s[i-1], (site_id)i);
+    GW_UNLOCK(name_lock);
+    if (s)
+    {
+    	for (i = 0; i < n; i++)
+    	    if (s[i].live)
+    		s[used++] = s[i];
+    	if (used)
+    	{
+    	    qsort(s, (size_t)used, sizeof(gw_site_stats), by_live);
+    	    fprintf(fp,"LIVE MEMORY BY SITE:\n");
+    	    for (i = 0; i < used; i++)
+    		fprintf(fp,"\tLive %8lu (%lu bytes, peak %lu) File %16s Line %d\n",
+    			s[i].live, s[i].live_bytes, s[i].peak_bytes,
+    			s[i].file, s[i].line);
+    	    fprintf(fp,"\n\n");
+    	}
+    	free(s);
+    }
+#if !__MSDOS__
+    my_map_report(fp, 0);
+#endif
+    my_site_report(fp);
+#ifdef GW_HISTOGRAMS
+    fprintf(fp,"\n\n");
+    my_hist_report(fp);
+#endif
+#ifdef GW_IO_STATS
+    fprintf(fp,"\n\n");
+    my_io_report(fp);
+#endif
+    fprintf(fp,"\n\nOPEN FILES:\n");
+    my_file_report(fp, 0);
+    fprintf(fp,"\n\nOPEN STREAMS:\n");
+    my_stream_report(fp, 0);
+    fprintf(fp,"\n================ END OF LIVE REPORT ===================\n");
+    fflush(fp);
+    GW_LEAVE;
+}
+
+#ifdef GW_REPORT_SIGNAL
+
+/* The handler only writes a byte to a pipe; the reporter thread
+   waits on the other end and does the rest. */
+
+static int report_pipe[2] = { -1, -1 };
+static char report_name[FILENAME_MAX];
+
+static void report_signal(int sig)
+{
+    int e = errno;
+    char b = (char)sig;
+    if (write(report_pipe[1], &b, 1) < 0)
+    {
+    	/* one is already pending */
+    }
+    errno = e;
+}
+
+static void *reporter_main(void *arg)
+{
+    char b;
+    GW_ENTER; /* for good */
+    for (;;)
+    {
+    	FILE *fp;
+    	if (read(report_pipe[0], &b, 1) <= 0)
+    	{
+    	    if (errno == EINTR)
+    		continue;
+    	    break;
+    	}
+    	fp = report_name[0] ? fopen(report_name, "a") : stderr;
+    	if (fp == NULL)
+    	    continue;
+    	gw_live_report(fp);
+    	if (fp != stderr)
+    	    fclose(fp);
+    }
+    return arg;
+}
+
+static void start_reporter(char *log_name)
+{
+    struct sigaction sa;
+    pthread_t t;
+    pthread_attr_t attr;
+    if (log_name)
+    	sprintf(report_name, "%.*s.live", FILENAME_MAX - 6, log_name);
+    /* not to be inherited across an exec */
+#if defined(__linux__) && defined(O_CLOEXEC)
+    if (pipe2(report_pipe, O_CLOEXEC) < 0)
+    	return;
+#else
+    if (pipe(report_pipe) < 0)
+    	return;
+    fcntl(report_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(report_pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
+    /* a signal that finds the pipe full has a report coming anyway */
+    fcntl(report_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&t, &attr, reporter_main, NULL);
+    pthread_attr_destroy(&attr);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = report_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(GW_REPORT_SIGNAL, &sa, NULL);
+}
+
+#endif /* GW_REPORT_SIGNAL */
+
+/********************************/
+/* Generate a report at the end */
+/********************************/
+
+void my_report(void)
+{
+    time_t tm = time(NULL);
+#ifndef GW_BINARY_LOG
+    gw_counters c;
+#endif
+    GW_ENTER;
+    if (!logfile) my_initialise();
+#ifdef GW_QUARANTINE
+    flush_quarantine();
+#endif
+#ifdef GW_SWEEP
+    /* from the start, whatever was left to do */
+    GW_LOCK(sweep_lock);
+    sweep_shard = 0;
+    sweep_slot = 0;
+    GW_UNLOCK(sweep_lock);
+    gw_sweep(0);
+#endif
+#ifdef GW_BINARY_LOG
+#ifndef GW_BINARY_TRACE
+    /* gwdecode produces the report from what is still live */
+    log_live_blocks();
+#if !__MSDOS__
+    log_maps();
+#endif
+    log_open_files();
+    log_sites();
+#endif
+#ifdef GW_STACKS
+    log_stacks();
+#endif
+    /* it can't see what the streams still hold, though */
+    {
+    	unsigned long i, n;
+    	gw_stream_info *s = stream_list(&n);
+    	for (i = 0; i < n; i++)
+    	    log_event(GW_E_STREAM, s[i].name, s[i].file, s[i].line,
+    		    NULL, s[i].how, (long)s[i].handle, s[i].pending);
+    	free(s);
+    }
+    log_event(GW_E_END, NULL, NULL, 0, NULL, 0, (long)tm, 0);
+#endif
+#ifdef GW_ASYNC_LOG
+    flush_log();
+#endif
+#ifndef GW_BINARY_LOG
+    gw_get_counters(&c);
+    fprintf(logfile,"\n\n================ END-OF-PROGRAM DEBUG LOG ===================\n");
+    fprintf(logfile,"Log date: %s\n\n", ctime(&tm));
+    fprintf(logfile,"%lu allocations (%lu bytes), %lu frees (%lu bytes)\n\n",
+    		c.allocs, c.bytes_allocated, c.frees, c.bytes_freed);
+#ifdef GW_SAMPLE
+    fprintf(logfile,"(estimated from a sample of one allocation per %lu bytes)\n\n",
+    		(unsigned long)GW_SAMPLE);
+#endif
+    my_memory_report(1);
+    fprintf(logfile,"\n\n");
+#if !__MSDOS__
+    my_map_report(logfile, 1);
+#endif
+#ifdef GW_STACKS
+    my_stack_report(logfile);
+    fprintf(logfile,"\n\n");
+#endif
+    my_site_report(logfile);
+    fprintf(logfile,"\n\n");
+#ifdef GW_HISTOGRAMS
+    my_hist_report(logfile);
+    fprintf(logfile,"\n\n");
+#endif
+#ifdef GW_IO_STATS
+    my_io_report(logfile);
+#endif
+    my_file_report(logfile, 1);
+    my_stream_report(logfile, 1);
+    fprintf(logfile,"\n\n================ END OF LOG ===================\n\n");
+#endif
+    GW_LOCK(sweep_lock);
+    sweep_off = 1;
+    GW_UNLOCK(sweep_lock);
+#ifdef GW_ASYNC_LOG
+    GW_LOCK(log_lock); /* keep the writer off the log while we close it */
+#endif
+#ifdef GW_PRELOAD
+    /* the C library may still free our blocks after this; leave
+       the log open so that doesn't start a new one */
+    fflush(logfile);
+#else
+#ifdef DEBUG_LOG
+    fclose(logfile);
+#endif
+    logfile=NULL;
+#endif
+#ifdef GW_ASYNC_LOG
+    GW_UNLOCK(log_lock);
+#endif
+    GW_LEAVE;
+}
+
+/*****************************/
+/* First-time initialisation */
+/*****************************/
+
+void my_initialise(void)
+{
+    FILE *fp;
+#ifdef DEBUG_LOG
+    char *log_name = DEBUG_LOG;
+#ifdef GW_PRELOAD
+    if (getenv("GWDEBUG_LOG"))
+    	log_name = getenv("GWDEBUG_LOG");
+#endif
+#endif
+#ifdef GW_THREADS
+    static int threads_ready = 0;
+#endif
+    GW_LOCK(init_lock);
+    if (logfile)
+    {
+    	/* another thread got here first */
+    	GW_UNLOCK(init_lock);
+    	return;
+    }
+#ifdef GW_THREADS
+    if (!threads_ready)
+    {
+    	int s;
+    	for (s = 0; s < GW_SHARDS; s++)
+    	    pthread_mutex_init(&heap_shards[s].lock, NULL);
+    	pthread_key_create(&count_key, retire_counts);
+#ifdef GW_ASYNC_LOG
+    	pthread_key_create(&ring_key, release_ring);
+#endif
+    	threads_ready = 1;
+    }
+#endif
+#ifdef GW_SIMD
+    simd_pick();
+#endif
+    atexit(my_report);
+#ifdef GW_BINARY_LOG
+    fp = fopen(log_name,"wb");
+    assert(fp);
+    write_header(fp);
+#ifdef GW_SAMPLE
+    {
+    	/* gwdecode needs this to scale its report */
+    	gw_event e;
+    	memset(&e, 0, sizeof(e));
+    	e.type = GW_E_SAMPLE;
+    	e.a = (long)GW_SAMPLE;
+    	e.time = log_clock();
+    	emit_event(fp, &e);
+    }
+#endif
+#ifdef GW_BINARY_TRACE
+    {
+    	/* gwdecode needs this to know it sees every allocation */
+    	gw_event e;
+    	memset(&e, 0, sizeof(e));
+    	e.type = GW_E_TRACING;
+    	e.time = log_clock();
+    	emit_event(fp, &e);
+    }
+#endif
+#elif defined(DEBUG_LOG)
+    fp = fopen(log_name,"w");
+    assert(fp);
+#else
+    fp = stderr;
+#endif
+#ifdef GW_THREADS
+    /* make sure the locks are visible before logfile is */
+    __sync_synchronize();
+#endif
+    logfile = fp;
+#if defined(GW_THREADS) && defined(GW_ASYNC_LOG)
+    if (threads_ready == 1)
+    {
+    	pthread_attr_t attr;
+    	pthread_attr_init(&attr);
+    	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    	pthread_create(&log_writer, &attr, log_writer_main, NULL);
+    	pthread_attr_destroy(&attr);
+    	threads_ready = 2;
+    }
+#endif
+#ifdef GW_REPORT_SIGNAL
+    if (report_pipe[0] < 0)
+#ifdef DEBUG_LOG
+    	start_reporter(log_name);
+#else
+    	start_reporter(NULL);
+#endif
+#endif
+#if defined(GW_SWEEP) && defined(GW_THREADS)
+    {
+    	static int sweeping = 0;
+    	if (!sweeping)
+    	{
+    	    pthread_t t;
+    	    pthread_attr_t attr;
+    	    pthread_attr_init(&attr);
+    	    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    	    pthread_create(&t, &attr, sweeper_main, NULL);
+    	    pthread_attr_destroy(&attr);
+    	    sweeping = 1;
+    	}
+    }
+#endif
+    GW_UNLOCK(init_lock);
+}
+
+/*****************/
+/* Wrapper timing */
+/*****************/
+
+/* Sizes and times are counted by powers of two, per thread, and
+   added up when asked for. Times are in whatever the cheapest clock
+   counts: processor cycles on x86, else nanoseconds. A wrapper's
+   time includes the C library call it wraps. */
+
+#ifdef GW_HISTOGRAMS
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define wrap_clock()	((unsigned long)__builtin_ia32_rdtsc())
+#define WRAP_UNIT	"cycles"
+#else
+static unsigned long wrap_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#define WRAP_UNIT	"ns"
+#endif
+
+static char *wrapper_names[GW_W_COUNT] =
+{
+    "malloc", "calloc", "realloc", "free",
+    "memcpy", "strcpy", "memset", "memcmp", "strcmp",
+    "strlen", "strdup", "strstr", "strpbrk", "strchr",
+    "strrchr", "strspn", "strcspn",
+    "fopen", "fclose", "fdopen", "freopen", "tmpfile", "popen", "pclose",
+    "open_memstream", "open", "close", "dup", "dup2",
+    "socket", "accept", "accept4", "pipe", "pipe2",
+    "epoll_create1", "eventfd",
+    "read", "fread", "fgets", "write", "fwrite", "fputs",
+    "mmap", "munmap", "mremap"
+};
+
+static int hist_bucket(unsigned long v)
+{
+    int b = 0;
+#ifdef __GNUC__
+    if (v)
+    	b = (int)(8 * sizeof(long)) - __builtin_clzl(v);
+#else
+    while (v)
+    {
+    	b++;
+    	v >>= 1;
+    }
+#endif
+    return b < GW_HIST_BUCKETS ? b : GW_HIST_BUCKETS-1;
+}
+
+static void hist_add(gw_hist *h, unsigned long v)
+{
+    h->count++;
+    h->total += v;
+    h->bucket[hist_bucket(v)]++;
+}
+
+static void add_histograms(gw_histograms *to, gw_histograms *from)
+{
+    int w, i;
+    for (w = -1; w < GW_W_COUNT; w++)
+    {
+    	gw_hist *t = w < 0 ? &to->sizes : &to->times[w];
+    	gw_hist *f = w < 0 ? &from->sizes : &from->times[w];
+    	t->count += f->count;
+    	t->total += f->total;
+    	for (i = 0; i < GW_HIST_BUCKETS; i++)
+    	    t->bucket[i] += f->bucket[i];
+    }
+}
+
+#define count_size(n)	hist_add(&my_counts()->hist.sizes, (n))
+
+static void wrap_time(int w, unsigned long t0)
+{
+    hist_add(&my_counts()->hist.times[w], wrap_clock() - t0);
+}
+
+#undef my_malloc
+#undef my_calloc
+#undef my_realloc
+#undef my_free
+#undef my_memcpy
+#undef my_strcpy
+#undef my_memset
+#undef my_memcmp
+#undef my_strcmp
+#undef my_strlen
+#undef my_strdup
+#undef my_strstr
+#undef my_strpbrk
+#undef my_strchr
+#undef my_strrchr
+#undef my_strspn
+#undef my_strcspn
+#undef my_fopen
+#undef my_fclose
+#undef my_fdopen
+#undef my_freopen
+#undef my_tmpfile
+#undef my_open
+#undef my_close
+#undef my_dup
+#undef my_dup2
+#undef my_socket
+#undef my_accept
+#undef my_pipe
+#undef my_popen
+#undef my_pclose
+#undef my_open_memstream
+#undef my_accept4
+#undef my_pipe2
+#undef my_epoll_create1
+#undef my_eventfd
+#undef my_read
+#undef my_fread
+#undef my_fgets
+#undef my_write
+#undef my_fwrite
+#undef my_fputs
+#undef my_mmap
+#undef my_munmap
+#undef my_mremap
+
+/* my_name times body_name, the wrapper proper. The allocating ones
+   also note their frame for GW_STACKS, then do entry. */
+
+#define TIMED(type, name, w, params, args) \
+type my_##name params \
+{ \
+    type rtn; \
+    unsigned long t0 = wrap_clock(); \
+    rtn = body_##name args; \
+    wrap_time(w, t0); \
+    return rtn; \
+}
+
+#define TIMED_ALLOC(type, name, w, params, args, entry) \
+type my_##name params \
+{ \
+    type rtn; \
+    unsigned long t0 = wrap_clock(); \
+    STACK_ENTRY; \
+    entry; \
+    rtn = body_##name args; \
+    wrap_time(w, t0); \
+    return rtn; \
+}
+
+TIMED_ALLOC(void *, malloc, GW_W_MALLOC,
+	(unsigned n, char *f, int l),
+	(n, f, l),
+	count_size((unsigned long)n))
+
+TIMED_ALLOC(void *, calloc, GW_W_CALLOC,
+	(unsigned n, char *f, int l),
+	(n, f, l),
+	count_size((unsigned long)n))
+
+TIMED_ALLOC(void *, realloc, GW_W_REALLOC,
+	(void *p, unsigned n, char *f, int l),
+	(p, n, f, l),
+	count_size((unsigned long)n))
+
+void my_free(void *p, char *f, int l)
+{
+    unsigned long t0 = wrap_clock();
+    body_free(p, f, l);
+    wrap_time(GW_W_FREE, t0);
 }
 
-char *my_memcpy(char *d, int space_avail, int limit, char *s,
-	int sspace, int flag, char *f, int l)
-{
-    return my_copy(d, space_avail, limit, s, sspace, flag, f, l, 0);
-}
+TIMED(char *, memcpy, GW_W_MEMCPY,
+	(char *d, int space_avail, int limit, char *s, int sspace, int flag,
+	 char *f, int l),
+	(d, space_avail, limit, s, sspace, flag, f, l))
+
+TIMED(char *, strcpy, GW_W_STRCPY,
+	(char *d, int space_avail, int limit, char *s, int sspace, int flag,
+	 char *f, int l),
+	(d, space_avail, limit, s, sspace, flag, f, l))
+
+TIMED(char *, memset, GW_W_MEMSET,
+	(char *d, int space_avail, int limit, char c, char *f, int l),
+	(d, space_avail, limit, c, f, l))
+
+TIMED(int, memcmp, GW_W_MEMCMP,
+	(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f,
+	 int l),
+	(s1, siz1, s2, siz2, n, flag, f, l))
+
+TIMED(int, strcmp, GW_W_STRCMP,
+	(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f,
+	 int l),
+	(s1, siz1, s2, siz2, n, flag, f, l))
+
+TIMED(int, strlen, GW_W_STRLEN,
+	(char *s, int siz, char *f, int l),
+	(s, siz, f, l))
+
+TIMED_ALLOC(char *, strdup, GW_W_STRDUP,
+	(char *s, int siz, char *f, int l),
+	(s, siz, f, l),
+	(void)0)
+
+TIMED(char *, strstr, GW_W_STRSTR,
+	(char *s1, int siz1, char *s2, int siz2, char *f, int l),
+	(s1, siz1, s2, siz2, f, l))
+
+TIMED(char *, strpbrk, GW_W_STRPBRK,
+	(char *s1, int siz1, char *s2, int siz2, char *f, int l),
+	(s1, siz1, s2, siz2, f, l))
+
+TIMED(char *, strchr, GW_W_STRCHR,
+	(char *s, int siz, int c, char *f, int l),
+	(s, siz, c, f, l))
+
+TIMED(char *, strrchr, GW_W_STRRCHR,
+	(char *s, int siz, int c, char *f, int l),
+	(s, siz, c, f, l))
+
+TIMED(int, strspn, GW_W_STRSPN,
+	(char *s1, int siz1, char *s2, int siz2, char *f, int l),
+	(s1, siz1, s2, siz2, f, l))
+
+TIMED(int, strcspn, GW_W_STRCSPN,
+	(char *s1, int siz1, char *s2, int siz2, char *f, int l),
+	(s1, siz1, s2, siz2, f, l))
+
+TIMED(FILE *, fopen, GW_W_FOPEN,
+	(char *n, char *m, char *f, int l),
+	(n, m, f, l))
+
+TIMED(int, fclose, GW_W_FCLOSE,
+	(FILE *fp, char *f, int l),
+	(fp, f, l))
+
+TIMED(FILE *, fdopen, GW_W_FDOPEN,
+	(int h, char *m, char *f, int l),
+	(h, m, f, l))
+
+TIMED(FILE *, freopen, GW_W_FREOPEN,
+	(char *n, char *m, FILE *fp, char *f, int l),
+	(n, m, fp, f, l))
+
+TIMED(FILE *, tmpfile, GW_W_TMPFILE,
+	(char *f, int l),
+	(f, l))
+
+TIMED(int, open, GW_W_OPEN,
+	(char *n, int m, int a, char *f, int l),
+	(n, m, a, f, l))
+
+TIMED(int, close, GW_W_CLOSE,
+	(int h, char *f, int l),
+	(h, f, l))
+
+TIMED(int, dup, GW_W_DUP,
+	(int h, char *f, int l),
+	(h, f, l))
+
+TIMED(int, dup2, GW_W_DUP2,
+	(int h, int h2, char *f, int l),
+	(h, h2, f, l))
+
+TIMED(int, socket, GW_W_SOCKET,
+	(int domain, int type, int protocol, char *f, int l),
+	(domain, type, protocol, f, l))
+
+TIMED(int, accept, GW_W_ACCEPT,
+	(int h, void *a, socklen_t *n, char *f, int l),
+	(h, a, n, f, l))
+
+TIMED(int, pipe, GW_W_PIPE,
+	(int *fds, char *f, int l),
+	(fds, f, l))
+
+TIMED(FILE *, popen, GW_W_POPEN,
+	(char *c, char *m, char *f, int l),
+	(c, m, f, l))
+
+TIMED(int, pclose, GW_W_PCLOSE,
+	(FILE *fp, char *f, int l),
+	(fp, f, l))
+
+TIMED(FILE *, open_memstream, GW_W_OPEN_MEMSTREAM,
+	(char **p, size_t *n, char *f, int l),
+	(p, n, f, l))
+
+#ifdef __linux__
+TIMED(int, accept4, GW_W_ACCEPT4,
+	(int h, void *a, socklen_t *n, int flags, char *f, int l),
+	(h, a, n, flags, f, l))
+
+TIMED(int, pipe2, GW_W_PIPE2,
+	(int *fds, int flags, char *f, int l),
+	(fds, flags, f, l))
+
+TIMED(int, epoll_create1, GW_W_EPOLL_CREATE1,
+	(int flags, char *f, int l),
+	(flags, f, l))
+
+TIMED(int, eventfd, GW_W_EVENTFD,
+	(unsigned n, int flags, char *f, int l),
+	(n, flags, f, l))
+#endif
+
+TIMED(int, read, GW_W_READ,
+	(int h, void *buf, unsigned len, int space_avail, char *f, int l),
+	(h, buf, len, space_avail, f, l))
+
+TIMED(size_t, fread, GW_W_FREAD,
+	(void *buf, size_t size, size_t n, FILE *fp, int space_avail, char *f,
+	 int l),
+	(buf, size, n, fp, space_avail, f, l))
+
+TIMED(char *, fgets, GW_W_FGETS,
+	(void *buf, int n, FILE *fp, int space_avail, char *f, int l),
+	(buf, n, fp, space_avail, f, l))
+
+TIMED(int, write, GW_W_WRITE,
+	(int h, const void *buf, unsigned len, int space_avail, char *f,
+	 int l),
+	(h, buf, len, space_avail, f, l))
+
+TIMED(size_t, fwrite, GW_W_FWRITE,
+	(const void *buf, size_t size, size_t n, FILE *fp, int space_avail,
+	 char *f, int l),
+	(buf, size, n, fp, space_avail, f, l))
+
+TIMED(int, fputs, GW_W_FPUTS,
+	(const char *s, int siz, FILE *fp, char *f, int l),
+	(s, siz, fp, f, l))
 
-char *my_strcpy(char *d, int space_avail, int limit, char *s,
-	int sspace, int flag, char *f, int l)
-{
-    return my_copy(d, space_avail, limit, s, sspace, flag, f, l, NULLT);
-}
+TIMED(void *, mmap, GW_W_MMAP,
+	(void *a, size_t n, int prot, int flags, int fd, off_t off, char *f,
+	 int l),
+	(a, n, prot, flags, fd, off, f, l))
 
-char *my_memset(char *d, int space_avail, int limit, char c, char *f, int l)
-{
-    char *rtn = d;
-    int space_needed, i;
-    if (!logfile) my_initialise();
-    /* how much space do we have? */
-    space_avail = my_sizehint(d, space_avail);
-    if (my_validate1("memset", d, space_avail, f, l, 0)) goto done;
-    /* space enuf? */
-    if (space_avail >= 0 && limit > space_avail)
-    {
-    	fprintf(logfile,"memset overrun at file %s, line %d - truncating\n\ttarget length %d, source length %d\n",
-    		f, l, space_avail, limit);
-    	limit = space_avail;
-    }
-    memset(d,limit,c);
-done:
-    return rtn;
-}
+TIMED(int, munmap, GW_W_MUNMAP,
+	(void *a, size_t n, char *f, int l),
+	(a, n, f, l))
 
-static int my_compare(char *s1, int siz1, char *s2, int siz2, int n,
-	int flag, char *f, int l, unsigned strflags)
+#ifdef __linux__
+TIMED(void *, mremap, GW_W_MREMAP,
+	(void *a, size_t n, size_t m, int flags, void *na, char *f, int l),
+	(a, n, m, flags, na, f, l))
+#endif
+
+#endif /* GW_HISTOGRAMS */
+
+void gw_get_histograms(gw_histograms *h)
 {
+#ifdef GW_HISTOGRAMS
+    thread_counts *tc;
+#endif
+    memset(h, 0, sizeof(*h));
+#ifdef GW_HISTOGRAMS
     if (!logfile) my_initialise();
-    /* Just validate arguments */
-    siz1 = my_sizehint(s1, siz1);
-    siz2 = my_sizehint(s2, siz2);
-    if (my_validate2("memcmp", s1, siz1, s2, siz2, f, l, INIT1|INIT2|strflags))
-    	return ((s1?1:0)-(s2?1:0));
-    if (n==0) return strcmp(s1,s2);
-    else if (flag) return strncmp(s1,s2,n);
-    else return memcmp(s1,s2,n);
+    GW_LOCK(init_lock);
+    add_histograms(h, &retired_counts.hist);
+    for (tc = thread_count_list; tc; tc = tc->next)
+    	add_histograms(h, &tc->hist);
+    GW_UNLOCK(init_lock);
+    h->time_unit = WRAP_UNIT;
+#else
+    h->time_unit = "";
+#endif
 }
 
-int my_memcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l)
-{
-    return my_compare(s1, siz1, s2, siz2, n, flag, f, l, 0);
-}
+#ifdef GW_HISTOGRAMS
 
-int my_strcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l)
-{
-    return my_compare(s1, siz1, s2, siz2, n, flag, f, l, NULLT);
-}
+/* The value below which a fraction pct of those counted in h fall,
+   to within the bucket */
 
-int my_strlen(char *s, int siz, char *f, int l)
+static unsigned long hist_upto(gw_hist *h, int pct)
 {
-    if (!logfile) my_initialise();
-    siz = my_sizehint(s, siz);
-    return my_validate1("strlen", s, siz, f, l, INIT1|NULLT) ? 0 : strlen(s);
+    unsigned long want = (h->count * pct + 99) / 100, seen = 0;
+    int i;
+    for (i = 0; i < GW_HIST_BUCKETS; i++)
+    	if ((seen += h->bucket[i]) >= want)
+    	    break;
+    return i ? (2UL << (i-1)) - 1 : 0;
 }
 
-char *my_strdup(char *s, int siz, char *f, int l)
+static void my_hist_report(FILE *fp)
 {
-    if (!logfile) my_initialise();
-    siz = my_sizehint(s, siz);
-    if (my_validate1("strdup", s, siz, f, l, INIT1|NULLT)==0)
+    gw_histograms h;
+    int i;
+    gw_get_histograms(&h);
+    if (h.sizes.count)
     {
-    	int n = strlen(s)+1;
-    	char *rtn = my_calloc(n,f,l);
-    	assert(rtn);
-    	my_memcpy(rtn, n, n, s, n, 0, f, l);
-    	return rtn;
+    	fprintf(fp,"ALLOCATION SIZES (%lu allocations, average %lu bytes):\n",
+    		h.sizes.count, h.sizes.total / h.sizes.count);
+    	for (i = 0; i < GW_HIST_BUCKETS; i++)
+    	    if (h.sizes.bucket[i])
+    		fprintf(fp,"\t%10lu to %10lu bytes %10lu (%lu%%)\n",
+    			i ? 1UL << (i-1) : 0UL, i ? (2UL << (i-1)) - 1 : 0UL,
+    			h.sizes.bucket[i],
+    			h.sizes.bucket[i] * 100 / h.sizes.count);
+    	fprintf(fp,"\n");
+    }
+    fprintf(fp,"TIME IN WRAPPERS (%s):\n", h.time_unit);
+    for (i = 0; i < GW_W_COUNT; i++)
+    {
+    	gw_hist *t = &h.times[i];
+    	if (t->count)
+    	    fprintf(fp,"\t%-14s Calls %10lu Total %12lu Average %8lu Median < %8lu 99%% < %8lu\n",
+    		    wrapper_names[i], t->count, t->total, t->total / t->count,
+    		    hist_upto(t, 50) + 1, hist_upto(t, 99) + 1);
     }
-    return NULL;
 }
 
-char *my_strstr(char *s1, int siz1, char *s2, int siz2, char *f, int l)
-{
-    if (!logfile) my_initialise();
-    siz1 = my_sizehint(s1, siz1);
-    siz2 = my_sizehint(s2, siz2);
-    return my_validate2("strstr", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT)
-	? NULL : strstr(s1,s2);
-}
+#endif
 
-char *my_strpbrk(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+char *gw_wrapper_name(int w)
 {
-    if (!logfile) my_initialise();
-    siz1 = my_sizehint(s1, siz1);
-    siz2 = my_sizehint(s2, siz2);
-    return my_validate2("strpbrk", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT)
-	? NULL : strpbrk(s1,s2);
+#ifdef GW_HISTOGRAMS
+    if (w >= 0 && w < GW_W_COUNT)
+    	return wrapper_names[w];
+#else
+    (void)w;
+#endif
+    return "?";
 }
 
-char *my_strchr(char *s, int siz, int c, char *f, int l)
-{
-    if (!logfile) my_initialise();
-    siz = my_sizehint(s, siz);
-    return my_validate1("strchr", s, siz, f, l, INIT1|NULLT)
-	? NULL : strchr(s,c);
-}
+/****************************/
+/* Run-time interposition   */
+/****************************/
 
-char *my_strrchr(char *s, int siz, int c, char *f, int l)
+#ifdef GW_PRELOAD
+
+/* The C library's versions, found with dlsym. dlsym may itself want
+   memory before we have them; that comes from a small static arena
+   and is never freed. */
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static size_t (*real_usable_size)(void *);
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static FILE *(*real_fopen)(const char *, const char *);
+static int (*real_fclose)(FILE *);
+
+static char boot_heap[8192];
+static size_t boot_used = 0;
+static int resolving = 0;
+
+#define IS_BOOT(p)	((char *)(p) >= boot_heap && (char *)(p) < boot_heap + sizeof(boot_heap))
+
+static void *boot_alloc(size_t n)
 {
-    if (!logfile) my_initialise();
-    siz = my_sizehint(s, siz);
-    return my_validate1("strrchr", s, siz, f, l, INIT1|NULLT)
-	? NULL : strrchr(s,c);
+    void *p;
+    n = (n + 15) & ~(size_t)15;
+    if (boot_used + n > sizeof(boot_heap))
+    	return NULL;
+    p = boot_heap + boot_used;
+    boot_used += n;
+    return p;
 }
 
-int my_strspn(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+static void resolve(void)
 {
-    if (!logfile) my_initialise();
-    siz1 = my_sizehint(s1, siz1);
-    siz2 = my_sizehint(s2, siz2);
-    return my_validate2("strspn", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT)
-	? 0 : strspn(s1,s2);
+    resolving = 1;
+    real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+    real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+    real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+    real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+    real_usable_size = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+    real_open = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+    real_close = (int (*)(int))dlsym(RTLD_NEXT, "close");
+    real_fopen = (FILE *(*)(const char *, const char *))dlsym(RTLD_NEXT, "fopen");
+    real_fclose = (int (*)(FILE *))dlsym(RTLD_NEXT, "fclose");
+    resolving = 0;
 }
 
-int my_strcspn(char *s1, int siz1, char *s2, int siz2, char *f, int l)
+static void preload_init(void) __attribute__((constructor));
+
+static void preload_init(void)
 {
-    if (!logfile) my_initialise();
-    siz1 = my_sizehint(s1, siz1);
-    siz2 = my_sizehint(s2, siz2);
-    return my_validate2("strcspn", s1, siz1, s2, siz2, f, l, INIT1|INIT2|NULLT)
-	? 0 : strcspn(s1,s2);
+    if (!real_malloc) resolve();
 }
 
-/***************************/
-/* File function debugging */
-/***************************/
+/* Name a call site by its return address, as module+offset. The
+   names are cached by address, most recent per slot. A slot is read
+   without the lock: its address is cleared while it is rewritten,
+   so one that reads the same before and after its name is whole. */
 
-#ifndef MAX_FILES
-#define MAX_FILES		64
+#ifndef CALLER_CACHE
+#define CALLER_CACHE	4096	/* a power of two */
 #endif
 
-typedef struct
-{
-    char *name;
-    char *fname;
-    int line;
-    FILE *fp;
-} file_info_t;
-
-static file_info_t file_info[MAX_FILES];
-
-#include <fcntl.h>
+static void *caller_addr[CALLER_CACHE];
+static char *caller_names[CALLER_CACHE];
 
-FILE *my_fopen(char *n, char *m, char *f, int l)
+static char *caller_name(void *ra)
 {
-    FILE *rtn;
-    if (!logfile) my_initialise();
-    rtn = fopen(n,m);
-    if (rtn)
+    unsigned long h = ((unsigned long)ra >> 2) * 2654435761UL;
+    char buf[64], *name;
+    Dl_info info;
+    h = (h >> 16) & (CALLER_CACHE-1);
+    if (LOAD_ACQ(caller_addr[h]) == ra)
     {
-    	int h = fileno(rtn);
-    	if (file_info[h].line>0)
-    	    /* shouldn't happen unless system fopen is broken */
-    	    fprintf(logfile,"%2d (%s) fopened at %s, line %d was already opened at %s, line %d\n",
-    	    	h, n, f, l, file_info[h].fname, file_info[h].line);
-#ifdef GW_TRACE
-    	else
-    	    fprintf(logfile,"File %2d (%s) fopened at %s, line %d\n", h, n, f, l);
-#endif
-    	file_info[h].name = store_name(n);
-    	file_info[h].fname = store_name(f);
-    	file_info[h].line = l;
-    	file_info[h].fp = rtn;
+    	name = LOAD_ACQ(caller_names[h]);
+    	if (LOAD_ACQ(caller_addr[h]) == ra)
+    	    return name;
     }
-    else fprintf(logfile,"fopen of %s at %s, line %d failed!\n", n, f, l);
-    return rtn;
-}
-
-int my_fclose(FILE *fp, char *f, int l)
-{
-    if (!logfile) my_initialise();
-    if (fp)
+    if (dladdr(ra, &info) && info.dli_fname && info.dli_fname[0])
     {
-    	int h = fileno(fp);
-    	if (file_info[h].line <= 0)
-    	    fprintf(logfile,"Bad close(%d) at %s, line %d; already closed at %s, line %d\n",
-    	    	    h, f, l, file_info[h].fname, -file_info[h].line);
-    	else
-    	{
-#ifdef GW_TRACE
-    	    fprintf(logfile,"File %2d (%s) opened at %s, line %d fclosed at %s, line %d\n",
-    	    			h, file_info[h].name, file_info[h].fname,
-    	    			file_info[h].line, f, l);
-#endif
-    	    file_info[h].fname = store_name(f);
-    	    file_info[h].line = -l;
-    	    return fclose(fp);
-    	}
+    	char *base = strrchr(info.dli_fname, '/');
+    	sprintf(buf, "%.40s+0x%lx", base ? base+1 : info.dli_fname,
+    		(unsigned long)((char *)ra - (char *)info.dli_fbase));
     }
-    else fprintf(logfile,"Illegal fclose(NULL) by %s line %d\n",
-			 f, l);
-    return 0;
+    else
+    	sprintf(buf, "0x%lx", (unsigned long)ra);
+    name = store_name(buf);
+    GW_LOCK(name_lock);
+    STORE_REL(caller_addr[h], NULL);
+    STORE_REL(caller_names[h], name);
+    STORE_REL(caller_addr[h], ra);
+    GW_UNLOCK(name_lock);
+    return name;
 }
 
-int my_open(char *n, int m, int a, char *f, int l)
-{
-    int rtn;
-    if (!logfile) my_initialise();
-    rtn = open(n,m,a);
-    if (rtn >= 0)
-    {
-    	if (file_info[rtn].line>0)
-    	    /* shouldn't happen unless system fopen is broken */
-    	    fprintf(logfile,"%2d (%s) fopened at %s, line %d was already open at %s, line %d\n",
-    	    	rtn, n, f, l, file_info[rtn].fname, file_info[rtn].line);
-#ifdef GW_TRACE
-    	else
-    	    fprintf(logfile,"File %2d (%s) fopened at %s, line %d\n", rtn, n, f, l);
-#endif
-    	file_info[rtn].name = store_name(n);
-    	file_info[rtn].fname = store_name(f);
-    	file_info[rtn].line = l;
-    	file_info[rtn].fp = NULL;
-    }
-    else fprintf(logfile,"open of %s at %s, line %d failed!\n\t(%s)\n",
-			n, f, l, strerror(errno));
-    return rtn;
-}
+#define CALLER	caller_name(__builtin_return_address(0))
 
-int my_close(int h, char *f, int l)
+/* Inside the library a free() may still be of one of our blocks, say
+   a stream buffer the program's stdio got from us and fclose() is
+   giving back. */
+
+static int is_ours(void *p)
 {
-    if (!logfile) my_initialise();
-    if (h>=0)
-    {
-    	if (file_info[h].line <= 0)
-    	    fprintf(logfile,"Bad close(%d) by %s, line %d; already closed at %s, line %d\n",
-    	    	h, f, l, file_info[h].fname, -file_info[h].line);
-    	else
-    	{
-#ifdef GW_TRACE
-    	    fprintf(logfile,"File %2d (%s) opened at %s, line %d, fclosed at %s, line %d\n",
-    	    			h, file_info[h].name, file_info[h].fname,
-    	    			file_info[h].line, f, l);
-#endif
-    	    file_info[h].fname = store_name(f);
-    	    file_info[h].line = -l;
-    	    return close(h);
-    	}
-    }
-    else fprintf(logfile,"Illegal close(%d) by %s line %d\n", h, f, l);
-    return 0;
+    return logfile && my_find_block(p) != NULL;
 }
 
-int my_dup(int h, char *f, int l)
+void *malloc(size_t n)
 {
-    int rtn = -1;
-    if (!logfile) my_initialise();
-    if (h>=0)
+    void *p;
+    STACK_ENTRY;
+    if (!real_malloc)
     {
-    	if (file_info[h].line <= 0)
-    	    fprintf(logfile,"Illegal dup(%d) by %s line %d\n", h, f, l);
-    	else
-    	{
-    	    rtn = dup(h);
-    	    if (rtn >= 0)
-    	    {
-#ifdef GW_TRACE
-    	    	fprintf(logfile,"File %2d (%s) opened at %s, line %d, dup'ed to %d at %s, line %d\n",
-    	    		h,
-    	    		file_info[h].name,
-    	    		file_info[h].fname,
-    	    		file_info[h].line,
-    	    		rtn, f, l);
-#endif
-    	    	file_info[rtn].name = file_info[h].name;
-    	    	file_info[rtn].fname = store_name(f);
-    	    	file_info[rtn].line = l;
-    	    	file_info[rtn].fp = NULL;
-    	    }
-    	    else fprintf(logfile,"dup(%d) by %s line %d failed!\n\t(%s)\n",
-    	    		h, f, l, strerror(errno));
-    	}
+    	if (resolving) return boot_alloc(n);
+    	resolve();
     }
-    else fprintf(logfile,"Illegal dup(%d) by %s line %d!\n", h, f, l);
-    return rtn;
+    if (in_gw || n > UINT_MAX)
+    	return real_malloc(n);
+    GW_ENTER;
+    p = my_malloc((unsigned)n, CALLER, 0);
+    GW_LEAVE;
+    return p;
 }
 
-static int my_readcheck(char *name, void *buf, unsigned len, int space_avail, char *f, int l)
+void *calloc(size_t n, size_t size)
 {
-    if (buf==NULL)
+    void *p;
+    STACK_ENTRY;
+    if (!real_calloc)
     {
-    	fprintf(logfile,"%s with NULL buffer by %s line %d!\n", name, f, l);
-    	return 0;
+    	if (resolving) return boot_alloc(n * size);
+    	resolve();
     }
-    space_avail = my_sizehint(buf, space_avail);
-    if (space_avail >= 0 && space_avail < len)
+    if (size && n > (size_t)-1 / size)
     {
-    	fprintf(logfile,"%s with count (%d)  > available space (5d) by %s line %d!\n",
-    		name, len, space_avail, f, l);
-    	return space_avail;
+    	errno = ENOMEM;
+    	return NULL;
     }
-    else return len;
+    if (in_gw || n * size > UINT_MAX)
+    	return real_calloc(n, size);
+    GW_ENTER;
+    p = my_calloc((unsigned)(n * size), CALLER, 0);
+    GW_LEAVE;
+    return p;
 }
 
-int my_read(int h, void *buf, unsigned len, int space_avail, char *f, int l)
-{
-    if (!logfile) my_initialise();
-    len = my_readcheck("read", buf, len, space_avail, f, l);
-    return len ? read(h,buf,len) : 0;
-}
+/* realloc() and reallocarray(), for the caller at return address ra */
 
-size_t my_fread(void *buf, size_t size, size_t n, FILE *fp, int space_avail, char *f, int l)
+static void *resize(void *p, size_t n, void *ra)
 {
-    if (!logfile) my_initialise();
-    if (size==0)
+    void *rtn;
+    if (IS_BOOT(p))
     {
-    	fprintf(logfile,"fread with size zero at %s line %d!\n", f, l);
-    	return 0;
+    	/* can't know its size; copy what there could be */
+    	size_t avail = boot_heap + sizeof(boot_heap) - (char *)p;
+    	rtn = malloc(n);
+    	if (rtn) memcpy(rtn, p, n < avail ? n : avail);
+    	return rtn;
+    }
+    if (!real_realloc) resolve();
+    if (in_gw && !is_ours(p))
+    	return real_realloc(p, n);
+    if (n > UINT_MAX)
+    {
+    	if (p == NULL || !is_ours(p))
+    	    return real_realloc(p, n);
+    	errno = ENOMEM;
+    	return NULL;
     }
-    n = my_readcheck("fread", buf, n*size, space_avail, f, l) / size;
-    return n ? fread(buf,size,n,fp) : 0;
+    GW_ENTER;
+    rtn = my_realloc(p, (unsigned)n, caller_name(ra), 0);
+    GW_LEAVE;
+    return rtn;
 }
 
-char *my_fgets(void *buf, int n, FILE *fp, int space_avail, char *f, int l)
+void *realloc(void *p, size_t n)
 {
-    if (!logfile) my_initialise();
-    n = my_readcheck("fgets", buf, n, space_avail, f, l);
-    return n ? fgets(buf,n,fp) : buf;
+    STACK_ENTRY;
+    return resize(p, n, __builtin_return_address(0));
 }
 
-static void my_file_report(int is_last)
+void *reallocarray(void *p, size_t n, size_t size)
 {
-    int i, done_heading=0;
-    for (i=0;i<40;i++)
+    STACK_ENTRY;
+    if (size && n > (size_t)-1 / size)
     {
-    	if (file_info[i].line>0)
-    	{
-    	    if (is_last && !done_heading)
-    	    {
-    		done_heading = 1;
-    		fprintf(logfile,"FILE LEAKS:\n");
-    	    }
-    	    fprintf(logfile,"\tFile `%s' (handle %d) opened at %s, line %d\n",
-	    		file_info[i].name,i,file_info[i].fname,	file_info[i].line);
-	}
+    	errno = ENOMEM;
+    	return NULL;
     }
+    return resize(p, n * size, __builtin_return_address(0));
 }
 
-/*************************/
-/* Building on the past! */
-/*************************/
-
-void *my_realloc(void *p, unsigned n, char *f, int l)
+void free(void *p)
 {
-    void *rtn = my_calloc(n,f,l);
-    if (p)
+    if (p == NULL || IS_BOOT(p))
+    	return;
+    if (!real_free) resolve();
+    if (in_gw && !is_ours(p))
     {
-    	my_memcpy(rtn, n, 0, p, 0, 0, f, l);
-    	my_free(p,f,l);
+    	real_free(p);
+    	return;
     }
-    return rtn;
+    GW_ENTER;
+    my_free(p, CALLER, 0);
+    GW_LEAVE;
 }
 
-void far *my_frealloc(void far *p, unsigned long n, char *f, int l)
+size_t malloc_usable_size(void *p)
 {
-    void far *rtn = my_fcalloc(n,f,l);
-    if (p)
-    {
-    	/* MUST STILL DO THE COPY!!!!!!!!! */
-    	my_ffree(p,f,l);
-    }
-    return rtn;
+    blk_info far *bp;
+    size_t n;
+    if (p == NULL || IS_BOOT(p))
+    	return 0;
+    if (!real_usable_size) resolve();
+    GW_ENTER;
+    bp = my_find_block(p);
+    n = bp ? (size_t)bp->nbytes : real_usable_size(p);
+    GW_LEAVE;
+    return n;
 }
 
-/**********************/
-/* Managed name store */
-/**********************/
-
-#ifndef MAX_NAMES
-#define MAX_NAMES	32
-#endif
+/* Is h a descriptor we are keeping track of? */
 
-#ifndef MAX_NAME_LEN
-#define MAX_NAME_LEN	16
-#endif
+static int fd_tracked(int h)
+{
+    int open;
+    if (!logfile)
+    	return 0;
+    GW_LOCK(file_lock);
+    open = file_slot(h, 0)->open;
+    GW_UNLOCK(file_lock);
+    return open;
+}
 
-static char file_names[MAX_NAMES][MAX_NAME_LEN];
+/* Is fp an open stream we are keeping track of? */
 
-static int filename_index = 0;
+static int stream_tracked(FILE *fp)
+{
+    stream_info *st;
+    int open;
+    if (!logfile)
+    	return 0;
+    GW_LOCK(file_lock);
+    open = (st = stream_find(fp, 0)) != NULL && st->open;
+    GW_UNLOCK(file_lock);
+    return open;
+}
 
-static char *store_name(char *name)
+int open(const char *name, int flags, ...)
 {
-    int filename_index;
-    for (filename_index=0 ; filename_index<MAX_NAMES ; filename_index++)
+    int mode = 0, rtn;
+    if (flags & O_CREAT)
     {
-    	if (file_names[filename_index][0]=='\0')
-    	{
-    	    strcpy(file_names[filename_index], name);
-    	    return file_names[filename_index];
-    	}
-    	else if (strcmp(file_names[filename_index],name)==0)
-    	    return file_names[filename_index];
+    	va_list ap;
+    	va_start(ap, flags);
+    	mode = va_arg(ap, int);
+    	va_end(ap);
     }
-    return NULL;
+    if (!real_open) resolve();
+    if (in_gw)
+    	return real_open(name, flags, mode);
+    GW_ENTER;
+    rtn = my_open((char *)name, flags, mode, CALLER, 0);
+    GW_LEAVE;
+    return rtn;
 }
 
-/********************************/
-/* Generate a report at the end */
-/********************************/
-
-void my_report(void)
+int close(int h)
 {
-    time_t tm = time(NULL);
-    if (!logfile) my_initialise();
-    fprintf(logfile,"\n\n================ END-OF-PROGRAM DEBUG LOG ===================\n");
-    fprintf(logfile,"Log date: %s\n\n", ctime(&tm));
-    my_memory_report(1);
-    fprintf(logfile,"\n\n");
-    my_file_report(1);
-    fprintf(logfile,"\n\n================ END OF LOG ===================\n\n");
-#ifdef DEBUG_LOG
-    fclose(logfile);
-#endif
-    logfile=NULL;
+    int rtn;
+    if (!real_close) resolve();
+    if (in_gw || !fd_tracked(h))
+    	return real_close(h);
+    GW_ENTER;
+    rtn = my_close(h, CALLER, 0);
+    GW_LEAVE;
+    return rtn;
 }
 
-/*****************************/
-/* First-time initialisation */
-/*****************************/
+FILE *fopen(const char *name, const char *mode)
+{
+    FILE *rtn;
+    if (!real_fopen) resolve();
+    if (in_gw)
+    	return real_fopen(name, mode);
+    GW_ENTER;
+    rtn = my_fopen((char *)name, (char *)mode, CALLER, 0);
+    GW_LEAVE;
+    return rtn;
+}
 
-void my_initialise(void)
+int fclose(FILE *fp)
 {
-    atexit(my_report);
-#ifdef DEBUG_LOG
-    logfile = fopen(DEBUG_LOG,"w");
-    assert(logfile);
-#else
-    logfile = stderr;
-#endif
+    int rtn;
+    if (!real_fclose) resolve();
+    if (in_gw || fp == NULL || !stream_tracked(fp))
+    	return real_fclose(fp);
+    GW_ENTER;
+    rtn = my_fclose(fp, CALLER, 0);
+    GW_LEAVE;
+    return rtn;
 }
 
+#endif /* GW_PRELOAD */
+
 /*===================================================================*/
 
 #endif /* GW_DEBUG */
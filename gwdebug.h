@@ -10,8 +10,13 @@
 
 #ifdef GW_DEBUG
 
+/* gwdebug.c includes this file with GW_LIBRARY defined, to get the
+   declarations without the macros that would wrap its own calls */
+
 /* Memory debugging */
 
+#ifndef GW_LIBRARY
+
 /* undefine them first in case we included heap.h */
 
 #undef malloc
@@ -23,7 +28,11 @@
 #undef farcalloc
 #undef farrealloc
 #undef farfree
-#else
+#endif
+
+#endif /* GW_LIBRARY */
+
+#if !__MSDOS__
 #define far
 #define huge
 #endif
@@ -39,6 +48,8 @@ extern void far *my_frealloc(void far *p, unsigned long n, char *f, int l);
 extern void my_ffree(void far *p, char *f, int l);
 #endif
 
+#ifndef GW_LIBRARY
+
 #if __MSDOS__
 #define farmalloc(n)	my_fmalloc(n, __FILE__, __LINE__)
 #define farcalloc(n)	my_fcalloc(n, __FILE__, __LINE__)
@@ -62,6 +73,8 @@ extern void my_ffree(void far *p, char *f, int l);
 #  define free(p)	my_free(p, __FILE__, __LINE__)
 #endif
 
+#endif /* GW_LIBRARY */
+
 /* String and memory debugging */
 
 extern char *my_memcpy(char *d, int hint, int limit, char *s, int shint, int flag, char *f, int l);
@@ -70,7 +83,7 @@ extern char *my_memset(char *d, int hint, int limit, char c, char *f, int l);
 extern int   my_memcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l);
 extern int   my_strcmp(char *s1, int siz1, char *s2, int siz2, int n, int flag, char *f, int l);
 extern int   my_strlen(char *s, int siz, char *f, int l);
-extern char *my_strdup(char *s, int siz, int n, char *f, int l);
+extern char *my_strdup(char *s, int siz, char *f, int l);
 extern char *my_strstr(char *s1, int siz1, char *s2, int siz2, char *f, int l);
 extern char *my_strpbrk(char *s1, int siz1, char *s2, int siz2, char *f, int l);
 extern char *my_strchr(char *s, int siz, int c, char *f, int l);
@@ -78,6 +91,8 @@ extern char *my_strrchr(char *s, int siz, int c, char *f, int l);
 extern int   my_strspn(char *s1, int siz1, char *s2, int siz2, char *f, int l);
 extern int   my_strcspn(char *s1, int siz1, char *s2, int siz2, char *f, int l);
 
+#ifndef GW_LIBRARY
+
 #define strcpy(d,s)	my_strcpy(d, sizeof(d), 0, s, sizeof(s), 0, __FILE__, __LINE__)
 #define stpcpy(d,s)	my_strcpy(d, sizeof(d), 0, s, sizeof(s), 2, __FILE__, __LINE__)
 #define strncpy(d,s,n)	my_strcpy(d, sizeof(d), n, s, sizeof(s), 0, __FILE__, __LINE__)
@@ -93,30 +108,338 @@ extern int   my_strcspn(char *s1, int siz1, char *s2, int siz2, char *f, int l);
 #define strdup(s)	my_strdup(s, sizeof(s), __FILE__, __LINE__)
 #define strstr(s1,s2)	my_strstr(s1, sizeof(s1), s2, sizeof(s2), __FILE__, __LINE__)
 #define strpbrk(s1,s2)	my_strpbrk(s1, sizeof(s1), s2, sizeof(s2), __FILE__, __LINE__)
-#define strchr(s,c)	my_strchr(s, sizeof(s1), c, __FILE__, __LINE__)
-#define strrchr(s,c)	my_strrchr(s, sizeof(s1), c, __FILE__, __LINE__)
+#define strchr(s,c)	my_strchr(s, sizeof(s), c, __FILE__, __LINE__)
+#define strrchr(s,c)	my_strrchr(s, sizeof(s), c, __FILE__, __LINE__)
 #define strspn(s1,s2)	my_strspn(s1, sizeof(s1), s2, sizeof(s2), __FILE__, __LINE__)
 #define strcspn(s1,s2)	my_strcspn(s1, sizeof(s1), s2, sizeof(s2), __FILE__, __LINE__)
 
+#endif /* GW_LIBRARY */
+
 /* File debugging */
 
 extern FILE *my_fopen(char *n, char *m, char *f, int l);
 extern int   my_fclose(FILE *fp, char *f, int l);
+extern FILE *my_fdopen(int h, char *m, char *f, int l);
+extern FILE *my_freopen(char *n, char *m, FILE *fp, char *f, int l);
+extern FILE *my_tmpfile(char *f, int l);
 extern int   my_open(char *n, int m, int a, char *f, int l);
 extern int   my_close(int h, char *f, int l);
 extern int   my_dup(int h, char *f, int l);
+extern int   my_dup2(int h, int h2, char *f, int l);
 extern int   my_read(int h, void *buf, unsigned len, int hint, char *f, int l);
 extern size_t my_fread(void *buf, size_t size, size_t n, FILE *fp, int space_avail, char *f, int l);
 extern char *my_fgets(void *buf, int n, FILE *fp, int space_avail, char *f, int l);
+extern int   my_write(int h, const void *buf, unsigned len, int space_avail, char *f, int l);
+extern size_t my_fwrite(const void *buf, size_t size, size_t n, FILE *fp, int space_avail, char *f, int l);
+extern int   my_fputs(const char *s, int siz, FILE *fp, char *f, int l);
+
+#ifndef GW_LIBRARY
 
 #define fopen(n,m)	my_fopen(n,m,__FILE__,__LINE__)
 #define fclose(f)	my_fclose(f,__FILE__,__LINE__)
+#define fdopen(h,m)	my_fdopen(h,m,__FILE__,__LINE__)
+#define freopen(n,m,f)	my_freopen(n,m,f,__FILE__,__LINE__)
+#define tmpfile()	my_tmpfile(__FILE__,__LINE__)
 #define open(n,m,a)	my_open(n,m,a,__FILE__,__LINE__)
 #define close(h)	my_close(h,__FILE__,__LINE__)
 #define dup(h)		my_dup(h,__FILE__,__LINE__)
+#define dup2(h,h2)	my_dup2(h,h2,__FILE__,__LINE__)
 #define read(h,b,n)	my_read(h, b, n, sizeof(b), __FILE__, __LINE__)
 #define fread(b,s,n,f)	my_fread(b, s, n, f, sizeof(b), __FILE__, __LINE__)
 #define fgets(b,n,f)	my_fgets(b, n, f, sizeof(b), __FILE__, __LINE__)
+#define write(h,b,n)	my_write(h, b, n, sizeof(b), __FILE__, __LINE__)
+#define fwrite(b,s,n,f)	my_fwrite(b, s, n, f, sizeof(b), __FILE__, __LINE__)
+#define fputs(s,f)	my_fputs(s, sizeof(s), f, __FILE__, __LINE__)
+
+#endif /* GW_LIBRARY */
+
+/* Descriptor debugging (UNIX only) */
+
+#if !__MSDOS__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+extern int   my_socket(int domain, int type, int protocol, char *f, int l);
+extern int   my_accept(int h, void *a, socklen_t *n, char *f, int l);
+extern int   my_pipe(int *fds, char *f, int l);
+extern FILE *my_popen(char *c, char *m, char *f, int l);
+extern int   my_pclose(FILE *fp, char *f, int l);
+extern FILE *my_open_memstream(char **p, size_t *n, char *f, int l);
+#ifdef __linux__
+extern int   my_accept4(int h, void *a, socklen_t *n, int flags, char *f, int l);
+extern int   my_pipe2(int *fds, int flags, char *f, int l);
+extern int   my_epoll_create1(int flags, char *f, int l);
+extern int   my_eventfd(unsigned n, int flags, char *f, int l);
+#endif
+
+#ifndef GW_LIBRARY
+
+#define socket(d,t,p)	my_socket(d,t,p,__FILE__,__LINE__)
+#define accept(h,a,n)	my_accept(h,a,n,__FILE__,__LINE__)
+#define pipe(p)		my_pipe(p,__FILE__,__LINE__)
+#define popen(c,m)	my_popen(c,m,__FILE__,__LINE__)
+#define pclose(f)	my_pclose(f,__FILE__,__LINE__)
+#define open_memstream(p,n) my_open_memstream(p,n,__FILE__,__LINE__)
+#ifdef __linux__
+#define accept4(h,a,n,fl) my_accept4(h,a,n,fl,__FILE__,__LINE__)
+#define pipe2(p,fl)	my_pipe2(p,fl,__FILE__,__LINE__)
+#define epoll_create1(fl) my_epoll_create1(fl,__FILE__,__LINE__)
+#define eventfd(n,fl)	my_eventfd(n,fl,__FILE__,__LINE__)
+#endif
+
+#endif /* GW_LIBRARY */
+
+/* Mapped memory debugging */
+
+extern void *my_mmap(void *a, size_t n, int prot, int flags, int fd, off_t off,
+		char *f, int l);
+extern int   my_munmap(void *a, size_t n, char *f, int l);
+#ifdef __linux__
+extern void *my_mremap(void *a, size_t n, size_t m, int flags, void *na,
+		char *f, int l);
+#endif
+
+#ifndef GW_LIBRARY
+
+#define mmap(a,n,p,fl,fd,o) my_mmap(a,n,p,fl,fd,o,__FILE__,__LINE__)
+#define munmap(a,n)	my_munmap(a,n,__FILE__,__LINE__)
+#ifdef MREMAP_MAYMOVE
+/* the new address is only given with MREMAP_FIXED */
+#define mremap(...)	GW_MREMAP(__VA_ARGS__, (void *)0, 0)
+#define GW_MREMAP(a,n,m,fl,na,...) my_mremap(a,n,m,fl,na,__FILE__,__LINE__)
+#endif
+
+#endif /* GW_LIBRARY */
+
+#endif /* !__MSDOS__ */
+
+/* Run-time queries */
+
+/* Kinds of descriptor */
+
+enum
+{
+    GW_FD_FILE, GW_FD_SOCKET, GW_FD_PIPE, GW_FD_EPOLL, GW_FD_EVENT,
+    GW_FD_KINDS
+};
+
+typedef struct
+{
+    int		handle;
+    int		kind;		/* GW_FD_FILE... */
+    char       *name;		/* the file's, for GW_FD_FILE */
+    char       *file;		/* where opened */
+    int		line;
+} gw_fd_info;
+
+/* Print the descriptors in fds (as open, or if is_last as leaked),
+   then how many of each kind each site has open; sorts fds in place */
+
+extern void  gw_fd_report(FILE *fp, gw_fd_info *fds, unsigned long n, int is_last);
+
+/* How a stream was opened */
+
+enum
+{
+    GW_S_FOPEN, GW_S_FDOPEN, GW_S_FREOPEN, GW_S_TMPFILE, GW_S_POPEN,
+    GW_S_MEMSTREAM,
+    GW_S_KINDS
+};
+
+typedef struct
+{
+    char       *name;		/* file, command, or how it was made */
+    int		how;		/* GW_S_FOPEN... */
+    int		handle;		/* the descriptor under it, or -1 */
+    long	pending;	/* bytes written but not flushed, or -1 */
+    char       *file;		/* where opened */
+    int		line;
+} gw_stream_info;
+
+/* Print the streams in s (as open, or if is_last as leaked), with
+   what each still has buffered; sorts s in place */
+
+extern void  gw_stream_report(FILE *fp, gw_stream_info *s, unsigned long n, int is_last);
+
+typedef struct
+{
+    unsigned long allocs;		/* tracked allocations so far */
+    unsigned long frees;		/* tracked frees so far */
+    unsigned long bytes_allocated;
+    unsigned long bytes_freed;
+    unsigned long live_blocks;		/* blocks currently tracked */
+} gw_counters;
+
+extern void  gw_get_counters(gw_counters *c);
+
+/* Totals for one allocation site (file and line). Blocks count
+   against the site that allocated them, including when freed. */
+
+typedef struct
+{
+    char       *file;
+    int		line;
+    unsigned long allocs;	/* blocks allocated here */
+    unsigned long bytes;	/* bytes allocated here */
+    unsigned long frees;	/* of those, how many were freed */
+    unsigned long live;		/* still allocated */
+    unsigned long live_bytes;
+    unsigned long peak_bytes;	/* most live_bytes ever */
+} gw_site_stats;
+
+#ifndef GW_TOP_SITES
+#define GW_TOP_SITES	10	/* sites listed in my_report's tables */
+#endif
+
+/* Print the top sites by bytes and by count; sorts s in place */
+
+extern void  gw_site_report(FILE *fp, gw_site_stats *s, unsigned long n, int top);
+
+/* Take a snapshot of the heap, to pass to gw_snapshot_diff later */
+
+extern unsigned long gw_snapshot(void);
+
+/* Print the blocks allocated after snapshot a and up to snapshot b
+   (or gw_snapshot() for now) that are still live, by site, to fp
+   (NULL: the log); returns how many there are */
+
+extern unsigned long gw_snapshot_diff(unsigned long a, unsigned long b,
+		FILE *fp);
+
+/* Write the counters, live memory by site and open files to fp
+   (NULL: the log) without stopping the program */
+
+extern void  gw_live_report(FILE *fp);
+
+/* With GW_HISTOGRAMS, the sizes asked of malloc, calloc and realloc
+   and the time spent in each wrapper, counted by powers of two:
+   bucket[0] counts zeroes and bucket[i] values from 2^(i-1) up */
+
+#define GW_HIST_BUCKETS	32
+
+typedef struct
+{
+    unsigned long count;
+    unsigned long total;
+    unsigned long bucket[GW_HIST_BUCKETS];
+} gw_hist;
+
+enum
+{
+    GW_W_MALLOC, GW_W_CALLOC, GW_W_REALLOC, GW_W_FREE,
+    GW_W_MEMCPY, GW_W_STRCPY, GW_W_MEMSET, GW_W_MEMCMP, GW_W_STRCMP,
+    GW_W_STRLEN, GW_W_STRDUP, GW_W_STRSTR, GW_W_STRPBRK, GW_W_STRCHR,
+    GW_W_STRRCHR, GW_W_STRSPN, GW_W_STRCSPN,
+    GW_W_FOPEN, GW_W_FCLOSE, GW_W_FDOPEN, GW_W_FREOPEN, GW_W_TMPFILE,
+    GW_W_POPEN, GW_W_PCLOSE, GW_W_OPEN_MEMSTREAM, GW_W_OPEN, GW_W_CLOSE, GW_W_DUP, GW_W_DUP2,
+    GW_W_SOCKET, GW_W_ACCEPT, GW_W_ACCEPT4, GW_W_PIPE, GW_W_PIPE2,
+    GW_W_EPOLL_CREATE1, GW_W_EVENTFD,
+    GW_W_READ, GW_W_FREAD, GW_W_FGETS, GW_W_WRITE, GW_W_FWRITE, GW_W_FPUTS,
+    GW_W_MMAP, GW_W_MUNMAP, GW_W_MREMAP,
+    GW_W_COUNT
+};
+
+typedef struct
+{
+    gw_hist sizes;			/* in bytes */
+    gw_hist times[GW_W_COUNT];		/* by wrapper, in time_unit */
+    char   *time_unit;			/* "cycles" or "ns" */
+} gw_histograms;
+
+extern void  gw_get_histograms(gw_histograms *h);
+extern char *gw_wrapper_name(int w);
+
+/* Check live blocks for overruns, carrying on from the last call,
+   for up to budget microseconds (0: to the end of the heap); returns
+   the number of bad blocks found */
+
+extern unsigned long gw_sweep(unsigned long budget);
+
+/* With GW_SAMPLE, how many blocks and bytes a tracked block of n bytes
+   stands for, given one sample per `rate' bytes on average. The count
+   is in 1/GW_WEIGHT_ONE blocks, as it is seldom a whole number. */
+
+#define GW_WEIGHT_ONE	256
+
+extern void  gw_sample_weight(unsigned long n, unsigned long rate,
+		unsigned long *count, unsigned long *bytes);
+
+/* Log events. Every diagnostic is one of these; with GW_BINARY_LOG
+   the log file is a stream of them (see gwdebug.c for the layout),
+   which gwdecode turns back into text. */
+
+enum
+{
+    GW_E_OVERRUN_FREE, GW_E_WRONG_FREE, GW_E_BAD_FREE, GW_E_FREED_BEFORE,
+    GW_E_NULL_ARG, GW_E_UNINIT_ARG, GW_E_NULL_NULL, GW_E_NULL_1, GW_E_NULL_2,
+    GW_E_INVALID_1, GW_E_INVALID_2,
+    GW_E_COPY_OVERRUN, GW_E_COPY_POTENTIAL, GW_E_COPY_CLOBBER,
+    GW_E_MEMSET_OVERRUN,
+    GW_E_FOPEN_REOPEN, GW_E_FOPEN_FAIL, GW_E_FCLOSE_BAD, GW_E_FCLOSE_TRACE,
+    GW_E_FCLOSE_NULL, GW_E_OPEN_REOPEN, GW_E_OPEN_TRACE, GW_E_OPEN_FAIL,
+    GW_E_CLOSE_BAD, GW_E_CLOSE_TRACE, GW_E_CLOSE_ILLEGAL, GW_E_DUP_ILLEGAL,
+    GW_E_DUP_TRACE, GW_E_DUP_FAIL, GW_E_READ_NULL, GW_E_READ_OVER,
+    GW_E_FREAD_ZERO, GW_E_FREED_WRITE, GW_E_SWEEP_OVERRUN, GW_E_SWEEP_HEADER,
+    GW_E_MMAP_FAIL, GW_E_MUNMAP_PARTIAL, GW_E_MUNMAP_TWICE, GW_E_MUNMAP_UNKNOWN,
+    GW_E_STREAM_MISMATCH, GW_E_CLOSE_STREAM,
+    /* only in binary logs. With GW_BINARY_TRACE there is an ALLOC,
+       FREE, MAP, UNMAP, FILE_OPEN or FILE_CLOSE for each call;
+       otherwise an ALLOC for each live block before each REPORT,
+       and before the END an ALLOC, MAP and FILE_OPEN for each thing
+       still live, then the SITEs, MAP_SITEs and COUNTS; with
+       GW_STACKS, the STACKS come last either way */
+    GW_E_ALLOC,		/* ptr, a = size, b = GW_SAMPLE weight */
+    GW_E_FREE,		/* ptr, a = size */
+    GW_E_FILE_OPEN,	/* name, a = handle, b = GW_FD_ kind */
+    GW_E_FILE_CLOSE,	/* a = handle */
+    GW_E_REPORT,	/* my_memory_report called; a = is_last */
+    GW_E_END,		/* my_report; a = time() */
+    GW_E_SAMPLE,	/* GW_SAMPLE in use; a = its value */
+    GW_E_MAP,		/* ptr, a = length; b = the length it had, if
+    			   mremap moved or resized it */
+    GW_E_UNMAP,		/* ptr, a = length; always within one mapping */
+    GW_E_STREAM,	/* open at the end: name, a = handle, b = unflushed,
+    			   line2 = GW_S_ how */
+    GW_E_TRACING,	/* GW_BINARY_TRACE in use */
+    GW_E_SITE,		/* totals for a site: a = allocs, b = bytes,
+    			   ptr = peak live bytes */
+    GW_E_MAP_SITE,	/* mapping totals for a site: a = maps,
+    			   b = bytes, ptr = peak live bytes */
+    GW_E_COUNTS,	/* a = allocs, b = bytes allocated */
+    GW_E_STACKS,	/* GW_STACKS in use; a = how many STACKs follow */
+    GW_E_STACK,		/* live totals for a stack: a = bytes, b = blocks,
+    			   file/line = a site it was seen at; then
+    			   a FRAME for each of its return addresses */
+    GW_E_FRAME,		/* name = symbol, ptr = pc, line = depth */
+    GW_E_NAME = 0xff	/* string definition */
+};
+
+typedef struct
+{
+    int		type;
+    char       *name;	/* wrapper or file name, if any */
+    char       *file;	/* where it happened */
+    int		line;
+    char       *file2;	/* a related place, e.g. where allocated */
+    int		line2;
+    void far   *ptr;
+    long	a, b;	/* sizes, handles, errno... */
+    unsigned long time;	/* microseconds; binary logs only */
+} gw_event;
+
+#define GW_BINLOG_MAGIC		"GWDB"
+#define GW_BINLOG_VERSION	7
+
+extern void  gw_render_event(FILE *fp, gw_event *e);
+
+/* What GW_ASYNC_LOG does when its buffer is full */
+
+#define GW_LOG_BLOCK	0	/* write the buffer out, then carry on */
+#define GW_LOG_DROP	1	/* discard the new message */
+
+extern void  gw_log_policy(int policy);
+extern void  my_memory_report(int is_last);
 
 #endif /* GW_DEBUG */
 
@@ -0,0 +1,698 @@
+/* gwdecode: turn a binary gwdebug log (built with GW_BINARY_LOG)
+   back into the usual text log.
+
+   Usage: gwdecode logfile
+
+   The diagnostics are printed as they would have been at the time,
+   and the memory, mapping, allocation site and file reports are
+   rebuilt from the records of what was live at each report and at
+   the end, and the totals by site; or, if the library was built with
+   GW_BINARY_TRACE, from the allocation, free, map, unmap, open and
+   close records in the log. The streams still open, and with
+   GW_STACKS the live blocks by stack, are recorded at the end.
+   Link with gwdebug for gw_render_event().
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef GW_DEBUG
+#define GW_DEBUG
+#endif
+#define GW_LIBRARY
+#include "gwdebug.h"
+
+#define NBUCKETS	65536	/* a power of two */
+#define NSITEBUCKETS	4096	/* likewise */
+
+typedef struct site
+{
+    gw_site_stats st;
+    unsigned long maps, mapped, map_live, map_peak;
+    struct site *chain;
+} site;
+
+typedef struct block
+{
+    unsigned long ptr;
+    long size;
+    unsigned long weight;	/* in 1/GW_WEIGHT_ONE blocks */
+    char *file;
+    int line;
+    site *where;
+    struct block *chain;	/* hash bucket */
+    struct block *next, *prev;	/* live list, newest first */
+} block;
+
+typedef struct
+{
+    unsigned long start, len;
+    site *where;
+} mapping;
+
+typedef struct
+{
+    char *file;		/* a site it was seen at */
+    int line;
+    unsigned long bytes, blocks;
+    unsigned long depth, first;	/* its frames in frames[] */
+} stack;
+
+typedef struct
+{
+    char *symbol;
+    unsigned long pc;
+} frame;
+
+typedef struct
+{
+    char *name;
+    int kind;
+    char *file;
+    int line;		/* negative when closed */
+} handle;
+
+static FILE *in;
+static char **names = NULL;
+static unsigned long nnames = 0;
+static block *buckets[NBUCKETS];	/* only when traced */
+static block *live = NULL, *last = NULL;
+static site *site_buckets[NSITEBUCKETS];
+static unsigned long nsites = 0;
+static mapping *maps = NULL;	/* sorted by address */
+static unsigned long nmaps = 0, map_room = 0;
+static handle *handles = NULL;
+static long nhandles = 0;
+static gw_stream_info *streams = NULL;
+static unsigned long nstreams = 0, stream_room = 0;
+/* block counts are in 1/GW_WEIGHT_ONE blocks, as the library keeps them */
+static unsigned long allocs = 0, frees = 0, bytes_allocated = 0, bytes_freed = 0;
+static unsigned long sample_rate = 0;	/* GW_SAMPLE, if it was used */
+static int traced = 0;			/* GW_BINARY_TRACE was used */
+static int stacked = 0;			/* GW_STACKS was used */
+static stack *stacks = NULL;
+static unsigned long nstacks = 0;
+static frame *frames = NULL;
+static unsigned long nframes = 0, frame_room = 0;
+
+static void truncated(void)
+{
+    fprintf(stderr, "gwdecode: log is truncated\n");
+    exit(1);
+}
+
+static unsigned long get_varint(void)
+{
+    unsigned long v = 0;
+    int shift = 0, c;
+    do
+    {
+    	if ((c = getc(in)) == EOF) truncated();
+    	v |= (unsigned long)(c & 0x7f) << shift;
+    	shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+static long get_signed(void)
+{
+    unsigned long v = get_varint();
+    return (long)(v >> 1) ^ -(long)(v & 1);
+}
+
+static char *get_name(unsigned long id)
+{
+    if (id == 0) return NULL;
+    return (id < nnames) ? names[id] : "?";
+}
+
+static void define_name(void)
+{
+    unsigned long id = get_varint(), len = get_varint();
+    char *s = malloc(len+1);
+    if (s == NULL || fread(s, 1, len, in) != len) truncated();
+    s[len] = 0;
+    if (id >= nnames)
+    {
+    	unsigned long n = nnames ? nnames : 256;
+    	while (n <= id) n *= 2;
+    	names = realloc(names, n * sizeof(char *));
+    	memset(names + nnames, 0, (n - nnames) * sizeof(char *));
+    	nnames = n;
+    }
+    names[id] = s;
+}
+
+static unsigned long bucket_of(unsigned long ptr)
+{
+    return ((ptr >> 3) * 2654435761UL >> 8) & (NBUCKETS-1);
+}
+
+/* Names are read once each, so sites can be matched by pointer */
+
+static site *find_site(char *file, int line)
+{
+    unsigned long h = ((((unsigned long)file >> 3) + (unsigned long)line)
+    			* 2654435761UL >> 8) & (NSITEBUCKETS-1);
+    site *sp;
+    for (sp = site_buckets[h]; sp; sp = sp->chain)
+    	if (sp->st.file == file && sp->st.line == line)
+    	    return sp;
+    sp = calloc(1, sizeof(site));
+    if (sp == NULL) { fprintf(stderr, "gwdecode: out of memory\n"); exit(1); }
+    sp->st.file = file;
+    sp->st.line = line;
+    sp->chain = site_buckets[h];
+    site_buckets[h] = sp;
+    nsites++;
+    return sp;
+}
+
+static unsigned long whole(unsigned long c)
+{
+    return (c + GW_WEIGHT_ONE/2) / GW_WEIGHT_ONE;
+}
+
+/* What a block stands for. The library logs the weight it gave a
+   sampled block, which it keeps when the block is resized. */
+
+static void weigh(block *b, unsigned long *c, unsigned long *n)
+{
+    *c = b->weight;
+    *n = (unsigned long)((double)b->size * (double)b->weight / GW_WEIGHT_ONE + 0.5);
+}
+
+/* A block allocated, when traced; otherwise one still live at a
+   report, which goes on the end of the list, as they come newest
+   first, and counts only as live (the totals come at the end) */
+
+static void add_block(gw_event *e)
+{
+    block *b = malloc(sizeof(block));
+    unsigned long h = bucket_of((unsigned long)e->ptr), c, n;
+    if (b == NULL) { fprintf(stderr, "gwdecode: out of memory\n"); exit(1); }
+    b->ptr = (unsigned long)e->ptr;
+    b->size = e->a;
+    b->file = e->file;
+    b->line = e->line;
+    if (sample_rate && e->b > 0)
+    	b->weight = (unsigned long)e->b;
+    else
+    {
+    	gw_sample_weight((unsigned long)e->a, sample_rate, &c, &n);
+    	b->weight = c;
+    }
+    weigh(b, &c, &n);
+    b->where = find_site(e->file, e->line);
+    b->where->st.live += c;
+    b->where->st.live_bytes += n;
+    if (!traced)
+    {
+    	b->next = NULL;
+    	b->prev = last;
+    	if (last) last->next = b;
+    	else live = b;
+    	last = b;
+    	return;
+    }
+    b->where->st.allocs += c;
+    b->where->st.bytes += n;
+    if (b->where->st.live_bytes > b->where->st.peak_bytes)
+    	b->where->st.peak_bytes = b->where->st.live_bytes;
+    b->chain = buckets[h];
+    buckets[h] = b;
+    b->prev = NULL;
+    b->next = live;
+    if (live) live->prev = b;
+    live = b;
+    allocs += c;
+    bytes_allocated += n;
+}
+
+/* Forget the live blocks of a report, once it is printed */
+
+static void drop_blocks(void)
+{
+    block *b;
+    unsigned long c, n;
+    while ((b = live) != NULL)
+    {
+    	weigh(b, &c, &n);
+    	b->where->st.live -= c;
+    	b->where->st.live_bytes -= n;
+    	live = b->next;
+    	free(b);
+    }
+    last = NULL;
+}
+
+/* A block count from the library, which keeps whole blocks when it
+   isn't sampling */
+
+static unsigned long blocks_of(long a)
+{
+    return sample_rate ? (unsigned long)a : (unsigned long)a * GW_WEIGHT_ONE;
+}
+
+/* The totals at the end; what was freed is what is no longer live */
+
+static void set_site(gw_event *e)
+{
+    site *sp = find_site(e->file, e->line);
+    sp->st.allocs = blocks_of(e->a);
+    sp->st.bytes = (unsigned long)e->b;
+    sp->st.peak_bytes = (unsigned long)e->ptr;
+    sp->st.frees = sp->st.allocs - sp->st.live;
+}
+
+static void set_map_site(gw_event *e)
+{
+    site *sp = find_site(e->file, e->line);
+    sp->maps = (unsigned long)e->a;
+    sp->mapped = (unsigned long)e->b;
+    sp->map_peak = (unsigned long)e->ptr;
+}
+
+static void set_counts(gw_event *e)
+{
+    block *b;
+    unsigned long c, n;
+    allocs = frees = blocks_of(e->a);
+    bytes_allocated = bytes_freed = (unsigned long)e->b;
+    for (b = live; b; b = b->next)
+    {
+    	weigh(b, &c, &n);
+    	frees -= c;
+    	bytes_freed -= n;
+    }
+}
+
+/* The stacks come sorted already; the frames follow each */
+
+static void start_stacks(gw_event *e)
+{
+    stacked = 1;
+    stacks = calloc(e->a ? (size_t)e->a : 1, sizeof(stack));
+    if (stacks == NULL) { fprintf(stderr, "gwdecode: out of memory\n"); exit(1); }
+}
+
+static void add_stack(gw_event *e)
+{
+    stack *sp = &stacks[nstacks++];
+    sp->file = e->file;
+    sp->line = e->line;
+    sp->bytes = (unsigned long)e->a;
+    sp->blocks = blocks_of(e->b);
+    sp->first = nframes;
+}
+
+static void add_frame(gw_event *e)
+{
+    if (nframes == frame_room)
+    {
+    	frame_room = frame_room ? frame_room*2 : 64;
+    	frames = realloc(frames, frame_room * sizeof(frame));
+    	if (frames == NULL) { fprintf(stderr, "gwdecode: out of memory\n"); exit(1); }
+    }
+    frames[nframes].symbol = e->name;
+    frames[nframes++].pc = (unsigned long)e->ptr;
+    stacks[nstacks-1].depth++;
+}
+
+static void remove_block(gw_event *e)
+{
+    block **bp = &buckets[bucket_of((unsigned long)e->ptr)], *b;
+    unsigned long c, n;
+    gw_sample_weight((unsigned long)e->a, sample_rate, &c, &n);
+    for (; (b = *bp) != NULL; bp = &b->chain)
+    {
+    	if (b->ptr == (unsigned long)e->ptr)
+    	{
+    	    weigh(b, &c, &n);
+    	    *bp = b->chain;
+    	    if (b->prev) b->prev->next = b->next;
+    	    else live = b->next;
+    	    if (b->next) b->next->prev = b->prev;
+    	    b->where->st.frees += c;
+    	    b->where->st.live -= c;
+    	    b->where->st.live_bytes -= n;
+    	    free(b);
+    	    break;
+    	}
+    }
+    frees += c;
+    bytes_freed += n;
+}
+
+/* The first mapping that ends after address a */
+
+static unsigned long map_first(unsigned long a)
+{
+    unsigned long lo = 0, hi = nmaps;
+    while (lo < hi)
+    {
+    	unsigned long mid = lo + (hi - lo) / 2;
+    	if (maps[mid].start + maps[mid].len <= a)
+    	    lo = mid + 1;
+    	else
+    	    hi = mid;
+    }
+    return lo;
+}
+
+static void map_insert(unsigned long i, unsigned long start,
+	unsigned long len, site *where)
+{
+    if (nmaps == map_room)
+    {
+    	map_room = map_room ? map_room * 2 : 64;
+    	maps = realloc(maps, map_room * sizeof(mapping));
+    	if (maps == NULL) { fprintf(stderr, "gwdecode: out of memory\n"); exit(1); }
+    }
+    memmove(&maps[i+1], &maps[i], (nmaps - i) * sizeof(mapping));
+    maps[i].start = start;
+    maps[i].len = len;
+    maps[i].where = where;
+    nmaps++;
+}
+
+/* A mapping made, when traced; otherwise one still there at the end */
+
+static void add_map(gw_event *e)
+{
+    site *sp = find_site(e->file, e->line);
+    map_insert(map_first((unsigned long)e->ptr), (unsigned long)e->ptr,
+    	    (unsigned long)e->a, sp);
+    if (!traced)
+    {
+    	sp->map_live += e->a;
+    	return;
+    }
+    if (e->b == 0)
+    	sp->maps++;
+    if (e->a > e->b)
+    	sp->mapped += e->a - e->b;
+    if ((sp->map_live += e->a) > sp->map_peak)
+    	sp->map_peak = sp->map_live;
+}
+
+/* Each unmap record is for a piece of just one mapping */
+
+static void remove_map(gw_event *e)
+{
+    unsigned long lo = (unsigned long)e->ptr, hi = lo + e->a;
+    unsigned long i = map_first(lo), end;
+    mapping m;
+    if (i == nmaps || maps[i].start > lo)
+    	return;
+    m = maps[i];
+    end = m.start + m.len;
+    m.where->map_live -= e->a;
+    if (lo > m.start && hi < end)
+    {
+    	maps[i].len = lo - m.start;
+    	map_insert(i+1, hi, end - hi, m.where);
+    }
+    else if (lo > m.start)
+    	maps[i].len = lo - m.start;
+    else if (hi < end)
+    {
+    	maps[i].start = hi;
+    	maps[i].len = end - hi;
+    }
+    else
+    {
+    	memmove(&maps[i], &maps[i+1], (nmaps - i - 1) * sizeof(mapping));
+    	nmaps--;
+    }
+}
+
+static void set_handle(long h, char *name, int kind, char *file, int line)
+{
+    if (h < 0) return;
+    if (h >= nhandles)
+    {
+    	long n = nhandles ? nhandles : 64;
+    	while (n <= h) n *= 2;
+    	handles = realloc(handles, n * sizeof(handle));
+    	memset(handles + nhandles, 0, (n - nhandles) * sizeof(handle));
+    	nhandles = n;
+    }
+    if (name) handles[h].name = name;
+    if (line > 0) handles[h].kind = kind;
+    handles[h].file = file;
+    handles[h].line = line;
+}
+
+static void add_stream(gw_event *e)
+{
+    if (nstreams == stream_room)
+    {
+    	stream_room = stream_room ? stream_room * 2 : 16;
+    	streams = realloc(streams, stream_room * sizeof(gw_stream_info));
+    }
+    streams[nstreams].name = e->name;
+    streams[nstreams].how = e->line2;
+    streams[nstreams].handle = (int)e->a;
+    streams[nstreams].pending = e->b;
+    streams[nstreams].file = e->file;
+    streams[nstreams].line = e->line;
+    nstreams++;
+}
+
+static void memory_report(int is_last)
+{
+    block *b;
+    if (live)
+    {
+    	printf(is_last ? "MEMORY LEAKS:\n" : "Allocated Memory Blocks:\n");
+    	for (b = live; b; b = b->next)
+    	{
+    	    unsigned long c, n;
+    	    if (sample_rate == 0)
+    	    {
+    		printf("\tSize %8ld File %16s Line %d\n", b->size, b->file, b->line);
+    		continue;
+    	    }
+    	    weigh(b, &c, &n);
+    	    printf("\tSize %8ld File %16s Line %d (about %lu blocks, %lu bytes)\n",
+    		    b->size, b->file, b->line, whole(c), n);
+    	}
+    }
+}
+
+static int by_mapped(const void *a, const void *b)
+{
+    const site *x = *(const site **)a;
+    const site *y = *(const site **)b;
+    int c;
+    if (x->map_live != y->map_live)
+    	return (x->map_live < y->map_live) ? 1 : -1;
+    if (x->mapped != y->mapped)
+    	return (x->mapped < y->mapped) ? 1 : -1;
+    c = strcmp(x->st.file, y->st.file);
+    return c ? c : x->st.line - y->st.line;
+}
+
+static void map_report(void)
+{
+    site **s = malloc((nsites ? nsites : 1) * sizeof(site *));
+    unsigned long h, i, n = 0;
+    site *sp;
+    if (nmaps)
+    {
+    	printf("MAPPING LEAKS:\n");
+    	for (i = 0; i < nmaps; i++)
+    	    printf("\tMapping %#lx Size %8lu mapped at %s, line %d\n",
+    		    maps[i].start, maps[i].len,
+    		    maps[i].where->st.file, maps[i].where->st.line);
+    	printf("\n\n");
+    }
+    if (s == NULL) return;
+    for (h = 0; h < NSITEBUCKETS; h++)
+    	for (sp = site_buckets[h]; sp; sp = sp->chain)
+    	    if (sp->maps)
+    		s[n++] = sp;
+    if (n)
+    {
+    	qsort(s, n, sizeof(site *), by_mapped);
+    	printf("MAPPED MEMORY BY SITE:\n");
+    	for (i = 0; i < n; i++)
+    	    printf("\tLive %10lu (peak %lu) Mapped %10lu in %6lu maps File %16s Line %d\n",
+    		    s[i]->map_live, s[i]->map_peak, s[i]->mapped, s[i]->maps,
+    		    s[i]->st.file, s[i]->st.line);
+    	printf("\n\n");
+    }
+    free(s);
+}
+
+static void stack_report(void)
+{
+    unsigned long i, k;
+    if (nstacks)
+    {
+    	printf("LEAKS BY STACK (%lu stacks):\n", nstacks);
+    	for (i = 0; i < nstacks; i++)
+    	{
+    	    printf("\tBytes %10lu Blocks %8lu File %16s Line %d\n",
+    		    stacks[i].bytes, whole(stacks[i].blocks),
+    		    stacks[i].file, stacks[i].line);
+    	    if (stacks[i].depth == 0)
+    		printf("\t\t(no stack)\n");
+    	    for (k = 0; k < stacks[i].depth; k++)
+    		printf("\t\t#%-2d %p %s\n", (int)k,
+    			(void *)frames[stacks[i].first + k].pc,
+    			frames[stacks[i].first + k].symbol);
+    	}
+    }
+    printf("\n\n");
+}
+
+static void site_report(void)
+{
+    gw_site_stats *s = malloc((nsites ? nsites : 1) * sizeof(gw_site_stats));
+    unsigned long h, n = 0;
+    site *sp;
+    if (s == NULL) return;
+    for (h = 0; h < NSITEBUCKETS; h++)
+    	for (sp = site_buckets[h]; sp; sp = sp->chain)
+    	{
+    	    s[n] = sp->st;
+    	    s[n].allocs = whole(s[n].allocs);
+    	    s[n].frees = whole(s[n].frees);
+    	    s[n].live = whole(s[n].live);
+    	    n++;
+    	}
+    gw_site_report(stdout, s, n, GW_TOP_SITES);
+    free(s);
+}
+
+static void file_report(void)
+{
+    gw_fd_info *fds = malloc((nhandles ? nhandles : 1) * sizeof(gw_fd_info));
+    long i, n = 0;
+    if (fds == NULL) return;
+    for (i = 0; i < nhandles; i++)
+    {
+    	if (handles[i].line > 0)
+    	{
+    	    fds[n].handle = (int)i;
+    	    fds[n].kind = handles[i].kind;
+    	    fds[n].name = handles[i].name;
+    	    fds[n].file = handles[i].file;
+    	    fds[n].line = handles[i].line;
+    	    n++;
+    	}
+    }
+    gw_fd_report(stdout, fds, (unsigned long)n, 1);
+    free(fds);
+}
+
+static void end_report(time_t tm)
+{
+    printf("\n\n================ END-OF-PROGRAM DEBUG LOG ===================\n");
+    printf("Log date: %s\n\n", ctime(&tm));
+    printf("%lu allocations (%lu bytes), %lu frees (%lu bytes)\n\n",
+    	    whole(allocs), bytes_allocated, whole(frees), bytes_freed);
+    if (sample_rate)
+    	printf("(estimated from a sample of one allocation per %lu bytes)\n\n",
+    		sample_rate);
+    memory_report(1);
+    printf("\n\n");
+    map_report();
+    if (stacked)
+    	stack_report();
+    site_report();
+    printf("\n\n");
+    file_report();
+    if (nstreams)
+    {
+    	printf("\n");
+    	gw_stream_report(stdout, streams, nstreams, 1);
+    }
+    printf("\n\n================ END OF LOG ===================\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char magic[4];
+    int c, ended = 0;
+    if (argc != 2)
+    {
+    	fprintf(stderr, "Usage: gwdecode logfile\n");
+    	return 2;
+    }
+    if ((in = fopen(argv[1], "rb")) == NULL)
+    {
+    	perror(argv[1]);
+    	return 1;
+    }
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, GW_BINLOG_MAGIC, 4) != 0)
+    {
+    	fprintf(stderr, "gwdecode: %s is not a binary gwdebug log\n", argv[1]);
+    	return 1;
+    }
+    if (getc(in) != GW_BINLOG_VERSION || getc(in) != (int)sizeof(long))
+    {
+    	fprintf(stderr, "gwdecode: %s was written by another version or machine\n", argv[1]);
+    	return 1;
+    }
+    (void)get_varint(); /* start time */
+    while ((c = getc(in)) != EOF)
+    {
+    	gw_event e;
+    	if (c == GW_E_NAME)
+    	{
+    	    define_name();
+    	    continue;
+    	}
+    	e.type = c;
+    	e.time = get_signed(); /* relative; we don't need absolute times */
+    	e.name = get_name(get_varint());
+    	e.file = get_name(get_varint());
+    	e.file2 = get_name(get_varint());
+    	e.line = (int)get_signed();
+    	e.line2 = (int)get_signed();
+    	e.ptr = (void *)get_varint();
+    	e.a = get_signed();
+    	e.b = get_signed();
+    	switch (e.type)
+    	{
+    	case GW_E_ALLOC:	add_block(&e);				break;
+    	case GW_E_FREE:		remove_block(&e);			break;
+    	case GW_E_MAP:		add_map(&e);				break;
+    	case GW_E_UNMAP:	remove_map(&e);				break;
+    	case GW_E_FILE_OPEN:	set_handle(e.a, e.name, (int)e.b, e.file, e.line); break;
+    	case GW_E_FILE_CLOSE:	set_handle(e.a, NULL, 0, e.file, -e.line); break;
+    	case GW_E_REPORT:
+    	    memory_report((int)e.a);
+    	    if (!traced)
+    	    	drop_blocks();
+    	    break;
+    	case GW_E_STREAM:	add_stream(&e);				break;
+    	case GW_E_SAMPLE:	sample_rate = (unsigned long)e.a;	break;
+    	case GW_E_TRACING:	traced = 1;				break;
+    	case GW_E_SITE:		set_site(&e);				break;
+    	case GW_E_MAP_SITE:	set_map_site(&e);			break;
+    	case GW_E_COUNTS:	set_counts(&e);				break;
+    	case GW_E_STACKS:	start_stacks(&e);			break;
+    	case GW_E_STACK:	add_stack(&e);				break;
+    	case GW_E_FRAME:	add_frame(&e);				break;
+    	case GW_E_END:		end_report((time_t)e.a); ended = 1;	break;
+    	default:		gw_render_event(stdout, &e);		break;
+    	}
+    }
+    if (!ended)
+    {
+    	/* the program died before my_report ran; report what we know */
+    	printf("\n(log ends without an end-of-program record)\n");
+    	if (traced)
+    	    end_report(time(NULL));
+    	else
+    	    printf("(without GW_BINARY_TRACE, what was live is only logged at the end)\n");
+    }
+    fclose(in);
+    return 0;
+}
@@ -102,6 +102,29 @@ void initTest(void)
     FREE(p);
 }
 
+void guardTest(void)
+{
+    /* With GW_GUARD each of these has pages of its own; for some
+	sizes the header is on the second page of the mapping. Freeing
+	a block must unmap its own pages and nobody else's. */
+#ifdef LOCAL_HEAP
+    printf("This test is skipped with local heap\n");
+#else
+    unsigned n, i;
+    for (n = 4096 - 64; n <= 3 * 4096 + 64; n++)
+    {
+    	char *p = (char *)MALLOC(n), *q = (char *)MALLOC(n);
+    	assert(p != NULL && q != NULL);
+    	for (i = 0; i < n; i++)
+    	    p[i] = q[i] = (char)i;
+    	FREE(p);
+    	for (i = 0; i < n; i++)
+    	    assert(q[i] == (char)i);
+    	FREE(q);
+    }
+#endif
+}
+
 #ifdef LOCAL_HEAP
 static char heap[24000];
 #endif
@@ -119,6 +142,7 @@ void main(void)
     	printf("\t4 - for overrun test 3\n");
     	printf("\t5 - for bad free\n\t6 - for double free\n");
     	printf("\t7 - for file test\n\t8 - for uninit test\n");
+    	printf("\t9 - for guard page test\n");
     	ch=getchar();
     	switch(ch)
     	{
@@ -130,6 +154,7 @@ void main(void)
     	case '6': doubleFreeTest(); 	break;
     	case '7': fileTest(); 		break;
     	case '8': initTest(); 		break;
+    	case '9': guardTest(); 		break;
     	}
     	while (getchar() != '\n');
     }
@@ -0,0 +1,150 @@
+/* Multithreaded test of the library. Needs GW_THREADS (UNIX only).
+
+   Several threads allocate, fill, check, resize and free blocks
+   and open and close files, all at once. Each thread leaks exactly
+   one block on purpose. At the end the tracked counts must agree
+   with what the threads did, and the blocks still live, by site,
+   must be one per thread and nothing else.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gwdebug.h"
+
+#define NTHREADS	8
+#define NSLOTS		256
+#define ITERATIONS	50000
+
+static unsigned long thread_allocs[NTHREADS];
+static unsigned long thread_frees[NTHREADS];
+static int thread_bad[NTHREADS];
+
+/* Fill a block with a pattern unique to this thread and slot */
+
+static void fill(unsigned char *p, unsigned n, int t, int slot)
+{
+    unsigned i;
+    for (i = 0; i < n; i++)
+    	p[i] = (unsigned char)(t * 31 + slot + i);
+}
+
+static int check(unsigned char *p, unsigned n, int t, int slot)
+{
+    unsigned i;
+    for (i = 0; i < n; i++)
+    	if (p[i] != (unsigned char)(t * 31 + slot + i))
+    	    return 0;
+    return 1;
+}
+
+static void *worker(void *arg)
+{
+    int t = (int)(long)arg;
+    unsigned char *blk[NSLOTS];
+    unsigned size[NSLOTS];
+    unsigned seed = t + 1;
+    int i;
+    for (i = 0; i < NSLOTS; i++)
+    	blk[i] = NULL;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+    	int s = rand_r(&seed) % NSLOTS;
+    	if (blk[s] == NULL)
+    	{
+    	    size[s] = rand_r(&seed) % 200 + 1;
+    	    blk[s] = malloc(size[s]);
+    	    thread_allocs[t]++;
+    	    fill(blk[s], size[s], t, s);
+    	}
+    	else if (rand_r(&seed) % 4 == 0)
+    	{
+    	    /* a resize counts as a free and an allocation */
+    	    unsigned n = rand_r(&seed) % 200 + 1;
+    	    if (!check(blk[s], size[s], t, s))
+    	    	thread_bad[t]++;
+    	    blk[s] = realloc(blk[s], n);
+    	    if (!check(blk[s], n < size[s] ? n : size[s], t, s))
+    	    	thread_bad[t]++;
+    	    size[s] = n;
+    	    fill(blk[s], n, t, s);
+    	    thread_allocs[t]++;
+    	    thread_frees[t]++;
+    	}
+    	else
+    	{
+    	    if (!check(blk[s], size[s], t, s))
+    	    	thread_bad[t]++;
+    	    free(blk[s]);
+    	    thread_frees[t]++;
+    	    blk[s] = NULL;
+    	}
+    	if (i % 1000 == 0)
+    	{
+    	    int h = open("/dev/null", O_RDONLY, 0);
+    	    close(h);
+    	}
+    }
+    for (i = 0; i < NSLOTS; i++)
+    {
+    	if (blk[i])
+    	{
+    	    if (!check(blk[i], size[i], t, i))
+    	    	thread_bad[t]++;
+    	    free(blk[i]);
+    	    thread_frees[t]++;
+    	}
+    }
+    (void)malloc(t + 1); /* the one deliberate leak */
+    thread_allocs[t]++;
+    return NULL;
+}
+
+/* The leaks, as a snapshot diff of everything still live: there
+   should be NTHREADS blocks, all from the one line in worker */
+
+static int leaks_ok(void)
+{
+    FILE *fp = tmpfile();
+    char line[256];
+    unsigned long blocks;
+    int sites = 0;
+    if (fp == NULL)
+    	return 0;
+    blocks = gw_snapshot_diff(0, gw_snapshot(), fp);
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp))
+    	if (line[0] == '\t')
+    	    sites++;
+    fclose(fp);
+    return blocks == NTHREADS && sites == 1;
+}
+
+int main(void)
+{
+    pthread_t th[NTHREADS];
+    unsigned long allocs = 0, frees = 0;
+    gw_counters c;
+    int t, ok, bad_blocks = 0;
+    for (t = 0; t < NTHREADS; t++)
+    	pthread_create(&th[t], NULL, worker, (void *)(long)t);
+    for (t = 0; t < NTHREADS; t++)
+    {
+    	pthread_join(th[t], NULL);
+    	allocs += thread_allocs[t];
+    	frees += thread_frees[t];
+    	bad_blocks += thread_bad[t];
+    }
+    gw_get_counters(&c);
+    printf("allocs %lu/%lu, frees %lu/%lu, live %lu/%d, corrupted %d\n",
+    	c.allocs, allocs, c.frees, frees, c.live_blocks, NTHREADS,
+    	bad_blocks);
+    ok = c.allocs == allocs && c.frees == frees &&
+    	c.live_blocks == NTHREADS && bad_blocks == 0 && leaks_ok();
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
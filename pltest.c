@@ -0,0 +1,51 @@
+/* Test of the LD_PRELOAD build. Built without gwdebug.h and run as
+
+	GWDEBUG_LOG=pltest.log LD_PRELOAD=./libgwdebug.so ./pltest
+
+   It resizes a few dozen blocks over and over, so that the library's
+   own calls on the C library's realloc and free come up with every
+   shard's lock held in turn; any of them that finds its way back
+   into the registry hangs, and the alarm turns that into a FAIL.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define NSLOTS		64
+#define ITERATIONS	400000
+#define TIMEOUT		120	/* seconds */
+
+static void hung(int sig)
+{
+    static char msg[] = "FAIL (hung)\n";
+    (void)sig;
+    write(1, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+int main(void)
+{
+    void *blk[NSLOTS];
+    int i;
+    signal(SIGALRM, hung);
+    alarm(TIMEOUT);
+    for (i = 0; i < NSLOTS; i++)
+    	blk[i] = NULL;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+    	int s = i % NSLOTS;
+    	void *p = realloc(blk[s], (unsigned)(i * 37) % 3000 + 1);
+    	if (p == NULL)
+    	{
+    	    printf("FAIL (out of memory)\n");
+    	    return 1;
+    	}
+    	blk[s] = p;
+    }
+    for (i = 0; i < NSLOTS; i++)
+    	free(blk[i]);
+    printf("PASS\n");
+    return 0;
+}
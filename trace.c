@@ -10,49 +10,104 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <dos.h>
 
 unsigned short *stacktop;
 
+/* The map file's public symbols, read in once and sorted by
+   address, so each frame is a binary search rather than a pass
+   over the whole file */
+
+typedef struct
+{
+	unsigned short addr;
+	char name[40];
+} mapsym;
+
+static mapsym *syms = NULL;
+static int nsyms = -1;	/* not read yet */
+
+static int bysymaddr(const void *a, const void *b)
+{
+	unsigned short x = ((const mapsym *)a)->addr;
+	unsigned short y = ((const mapsym *)b)->addr;
+	return (x > y) - (x < y);
+}
+
+static void near LoadMap(char *mapfile)
+{
+	char buf[128];
+	int room = 0;
+	FILE *map = fopen(mapfile, "r");
+	nsyms = 0;
+	if (map == NULL)
+		return;
+	buf[127] = 0;
+	while (fgets(buf, 127, map))
+	{
+		if (strncmp(buf, "  Address         Publics by Value", 34)==0)
+			break;
+	}
+	while (fgets(buf, 127, map))
+	{
+		char n1[40], n2[40], *n;
+		unsigned short addr;
+		int cnt = sscanf(buf, "%*X:%hX %39s %39s", &addr, n1, n2);
+		if (cnt == 3) n = n2;
+		else if (cnt == 2) n = n1;
+		else continue;
+		if (nsyms == room)
+		{
+			mapsym *more;
+			room = room ? room*2 : 128;
+			more = (mapsym *)realloc(syms, room * sizeof(mapsym));
+			if (more == NULL)
+				break;
+			syms = more;
+		}
+		syms[nsyms].addr = addr;
+		strcpy(syms[nsyms].name, n);
+		nsyms++;
+	}
+	fclose(map);
+	qsort(syms, nsyms, sizeof(mapsym), bysymaddr);
+}
+
+/* The symbol an address is in: the last one below it, or NULL */
+
+static char * near FindSym(unsigned short addr)
+{
+	int lo = 0, hi = nsyms;	/* syms[lo..hi-1] are candidates */
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (syms[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? syms[lo-1].name : NULL;
+}
+
 void near Abort(char *mapfile)
 {
     unsigned short *p = (unsigned short *)&p;
 	  fprintf(stderr, "Aborting! Stack backtrace:\n\n");
+	  if (nsyms < 0)
+		  LoadMap(mapfile);
 	  p++; /* get to first BP */
 	  while (p < stacktop)
 	  {
-		  char buf[128], lastn[40];
-		  unsigned short lastaddr = 0xffff;
-		  FILE *map = fopen(mapfile, "r");
-		  buf[127] = 0;
-		  while (!feof(map))
+		  char *n = FindSym(p[1]);
+		  if (n)
 		  {
-			fgets(buf, 127, map);
-			if (strncmp(buf, "  Address         Publics by Value", 34)==0)
-				break;
-		  }
-		  while (!feof(map))
-		  {
-			char n1[40], n2[40], *n;
-			short addr, cnt;
-			fgets(buf, 127, map);
-			cnt = sscanf(buf, "%*X:%X %s %s", &addr, n1, n2);
-			if (cnt == 3) n = n2;
-			else if (cnt == 2) n = n1;
-			else continue;
-			if (p[1] > lastaddr && p[1] < addr)
-			{
-				fprintf(stderr, "%04X  %s\n", p[1], lastn);
-				if (strcmp(lastn, "_main")==0)
-					exit(-1);
-				break;
-			}
-			strcpy(lastn, n);
-			lastaddr = addr;
+			  fprintf(stderr, "%04X  %s\n", p[1], n);
+			  if (strcmp(n, "_main")==0)
+				  exit(-1);
 		  }
 		  p = (unsigned short *)(*p);
-		  fclose(map);
 	  }  
 }
 